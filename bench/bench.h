@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+// A minimal microbenchmark harness. Each benchmark calls a function many
+// times, with no network, and reports the time and the number of global
+// heap allocations per call, so regressions show up in both.
+namespace bench
+{
+// operator new calls, counted by the replacement in main.cpp
+extern std::atomic<std::uint64_t> allocations;
+
+// only benchmarks whose name contains this are run
+extern std::string filter;
+
+// written by keep, and defined in main.cpp so the stores cannot be elided
+extern volatile std::uintptr_t sink;
+
+// stops the compiler from discarding a result
+inline void
+keep(void const* p)
+{
+  sink = reinterpret_cast<std::uintptr_t>(p);
+}
+
+template <typename F>
+void
+run(std::string_view name, F&& f, std::uint64_t iterations = 200000)
+{
+  if (name.find(filter) == std::string_view::npos)
+    return;
+
+  // warm up, so caches and arenas reach their steady state
+  for (std::uint64_t i = 0; i < iterations / 10 + 1; ++i)
+    f();
+
+  auto const allocs = allocations.load(std::memory_order_relaxed);
+  auto const start  = std::chrono::steady_clock::now();
+  for (std::uint64_t i = 0; i < iterations; ++i)
+    f();
+  auto const elapsed = std::chrono::steady_clock::now() - start;
+
+  auto const ns = std::chrono::duration<double, std::nano>(elapsed).count();
+  auto const n  = allocations.load(std::memory_order_relaxed) - allocs;
+  std::printf("%-48.*s %10.1f ns/op %8.2f allocs/op\n",
+              static_cast<int>(name.size()),
+              name.data(),
+              ns / iterations,
+              static_cast<double>(n) / iterations);
+}
+
+} // namespace bench
+
+// benchmark groups, one per file
+void
+parse_benchmarks();
+
+void
+headers_benchmarks();
+
+void
+handle_request_benchmarks();
+
+void
+util_benchmarks();
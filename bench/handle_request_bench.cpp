@@ -0,0 +1,179 @@
+#include "bench.h"
+#include "handle_request.h"
+
+namespace
+{
+using namespace http_tcl;
+
+// Answers every request with the same small response, so that only the
+// server's own work is measured.
+class stub_handler final : public alt_handler
+{
+  static get_r
+  ok()
+  {
+    return { 200, std::nullopt, "{\"ok\": true}", "application/json" };
+  }
+
+public:
+  options_r
+  options(std::string_view, std::string_view, headers_access&&) override
+  {
+    return ok();
+  }
+
+  head_r
+  head(std::string_view, headers_access&&) override
+  {
+    return { 200, std::nullopt, 12, "application/json" };
+  }
+
+  get_r
+  get(std::string_view, headers_access&&) override
+  {
+    return ok();
+  }
+
+  post_r
+  post(std::string_view, std::string_view, headers_access&&) override
+  {
+    return ok();
+  }
+
+  put_r
+  put(std::string_view, std::string_view, headers_access&&) override
+  {
+    return { 204, std::nullopt };
+  }
+
+  delete_r
+  delete_(std::string_view, std::string_view, headers_access&&) override
+  {
+    return ok();
+  }
+};
+
+// The stub behind the lock which serializes calls into an interpreter.
+class locked_stub final : public thread_safe_handler<locked_stub>
+{
+  stub_handler stub_;
+
+public:
+  options_r
+  do_options(std::string_view target,
+             std::string_view body,
+             headers_access&& get_headers)
+  {
+    return stub_.options(target, body, std::move(get_headers));
+  }
+
+  head_r
+  do_head(std::string_view target, headers_access&& get_headers)
+  {
+    return stub_.head(target, std::move(get_headers));
+  }
+
+  get_r
+  do_get(std::string_view target, headers_access&& get_headers)
+  {
+    return stub_.get(target, std::move(get_headers));
+  }
+
+  post_r
+  do_post(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers)
+  {
+    return stub_.post(target, body, std::move(get_headers));
+  }
+
+  put_r
+  do_put(std::string_view target,
+         std::string_view body,
+         headers_access&& get_headers)
+  {
+    return stub_.put(target, body, std::move(get_headers));
+  }
+
+  delete_r
+  do_delete_(std::string_view target,
+             std::string_view body,
+             headers_access&& get_headers)
+  {
+    return stub_.delete_(target, body, std::move(get_headers));
+  }
+};
+
+// Holds responses as the servers do before a write.
+struct send_to_batch
+{
+  response_batch& batch;
+
+  template <bool isRequest, class Body, class Fields>
+  void
+  operator()(http::message<isRequest, Body, Fields>&& msg) const
+  {
+    if constexpr (! isRequest && is_batchable<Body>::value)
+      batch.push(std::move(msg));
+  }
+};
+
+// Builds a request in the arena, as the servers read one, handles it and
+// serializes the response, leaving out only the socket.
+void
+handle(alt_handler&     handler,
+       request_arena&   arena,
+       response_batch&  batch,
+       http::verb       method,
+       std::string_view body)
+{
+  arena.reset();
+  arena_request req{ std::piecewise_construct,
+                     std::make_tuple(arena.allocator()),
+                     std::make_tuple(arena.allocator()) };
+  req.method(method);
+  req.target("/api/users/42?fields=name");
+  req.version(11);
+  req.set(http::field::host, "api.example.com");
+  req.set(http::field::user_agent, "Mozilla/5.0 (X11; Linux x86_64)");
+  req.set(http::field::accept, "application/json");
+  req.set(http::field::accept_encoding, "gzip, deflate, br");
+  if (! body.empty())
+  {
+    req.set(http::field::content_type, "application/json");
+    req.body().assign(body.data(), body.size());
+    req.prepare_payload();
+  }
+
+  handle_request(handler, std::move(req), send_to_batch{ batch });
+  bench::keep(batch.buffers().data());
+  batch.clear();
+}
+
+} // namespace
+
+void
+handle_request_benchmarks()
+{
+  stub_handler   stub;
+  locked_stub    locked;
+  request_arena  arena;
+  response_batch batch;
+
+  bench::run("handle_request GET, stub handler", [&] {
+    handle(stub, arena, batch, http::verb::get, {});
+  });
+  bench::run("handle_request POST, stub handler", [&] {
+    handle(stub, arena, batch, http::verb::post, "{\"name\": \"Ada\"}");
+  });
+
+  // the cost of the lock every request takes on its way into Tcl
+  bench::run("dispatch, alt_handler", [&stub] {
+    auto res = stub.get("/", {});
+    bench::keep(&res);
+  });
+  bench::run("dispatch, thread_safe_handler", [&locked] {
+    auto res = locked.get("/", {});
+    bench::keep(&res);
+  });
+}
@@ -0,0 +1,70 @@
+#include "bench.h"
+#include "http_tcl/http_tcl.h"
+
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include <utility>
+
+namespace
+{
+using namespace http_tcl;
+
+constexpr std::pair<std::string_view, std::string_view> fields[] = {
+  { "Host", "api.example.com" },
+  { "User-Agent", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0)" },
+  { "Accept", "application/json, text/plain, */*" },
+  { "Accept-Language", "en-US,en;q=0.5" },
+  { "Accept-Encoding", "gzip, deflate, br" },
+  { "Content-Type", "application/json" },
+  { "Content-Length", "60" },
+  { "Cookie", "session=2f6c1b9e8d7a4c3b; theme=dark" },
+  { "X-Request-Id", "7c9e6679-7425-40de-944b-e07fc1f90ae7" },
+  { "Connection", "keep-alive" },
+};
+
+constexpr std::string_view lookups[] = { "content-type",
+                                         "ACCEPT-ENCODING",
+                                         "x-missing" };
+
+// The map the headers used to be, looked up the way its users did: a
+// case-insensitive name needs a scan of every bucket.
+void
+unordered_map_headers()
+{
+  std::unordered_map<std::string, std::string> hs;
+  for (auto const& [name, value]: fields)
+    hs.emplace(name, value);
+
+  for (auto name: lookups)
+  {
+    auto it = std::find_if(hs.begin(), hs.end(), [name](auto const& kv) {
+      return headers::iequals(kv.first, name);
+    });
+    bench::keep(it == hs.end() ? nullptr : &it->second);
+  }
+}
+
+void
+flat_headers()
+{
+  headers hs;
+  hs.reserve(std::size(fields));
+  for (auto const& [name, value]: fields)
+    hs.add(name, value);
+
+  for (auto name: lookups)
+  {
+    auto value = hs.get(name);
+    bench::keep(value ? value->data() : nullptr);
+  }
+}
+
+} // namespace
+
+void
+headers_benchmarks()
+{
+  bench::run("headers, unordered_map", unordered_map_headers);
+  bench::run("headers, http_tcl::headers", flat_headers);
+}
@@ -0,0 +1,48 @@
+#include "bench.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace bench
+{
+std::atomic<std::uint64_t> allocations{ 0 };
+std::string                filter;
+volatile std::uintptr_t    sink{ 0 };
+} // namespace bench
+
+// Count every allocation made through the global operator new; the array
+// and nothrow forms call this one.
+void*
+operator new(std::size_t size)
+{
+  bench::allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size ? size : 1); p)
+    return p;
+  throw std::bad_alloc{};
+}
+
+void
+operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void
+operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+// Usage: http_tcl_bench ?filter?
+int
+main(int argc, char* argv[])
+{
+  if (argc > 1)
+    bench::filter = argv[1];
+
+  parse_benchmarks();
+  headers_benchmarks();
+  handle_request_benchmarks();
+  util_benchmarks();
+  return 0;
+}
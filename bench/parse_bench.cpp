@@ -0,0 +1,58 @@
+#include "bench.h"
+#include "handle_request.h"
+
+namespace
+{
+using namespace http_tcl;
+
+constexpr std::string_view request
+  = "POST /api/users/42/posts?fields=title,body HTTP/1.1\r\n"
+    "Host: api.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101\r\n"
+    "Accept: application/json, text/plain, */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 60\r\n"
+    "Cookie: session=2f6c1b9e8d7a4c3b; theme=dark\r\n"
+    "X-Request-Id: 7c9e6679-7425-40de-944b-e07fc1f90ae7\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+    "{\"title\": \"Hello\", \"body\": \"A post with a few words in it.\"}";
+
+// Parses the request as the servers do: the header first, then the body
+// into memory, with every allocation made through alloc.
+template <class Allocator>
+void
+parse(Allocator alloc)
+{
+  using body = http::basic_string_body<char, std::char_traits<char>, Allocator>;
+
+  beast::error_code ec;
+
+  http::request_parser<http::empty_body, Allocator> header{
+    std::piecewise_construct, std::make_tuple(), std::make_tuple(alloc)
+  };
+  auto n = header.put(net::buffer(request.data(), request.size()), ec);
+
+  http::request_parser<body, Allocator> parser{ std::move(header), alloc };
+  parser.put(net::buffer(request.data() + n, request.size() - n), ec);
+  if (ec || ! parser.is_done())
+    std::abort();
+  bench::keep(&parser.get());
+}
+
+} // namespace
+
+void
+parse_benchmarks()
+{
+  bench::run("parse request, std::allocator",
+             [] { parse(std::allocator<char>{}); });
+
+  request_arena arena;
+  bench::run("parse request, request_arena", [&arena] {
+    arena.reset();
+    parse(arena.allocator());
+  });
+}
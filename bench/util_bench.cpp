@@ -0,0 +1,78 @@
+#include "bench.h"
+#include "util.h"
+
+#include <cstdlib>
+
+namespace
+{
+constexpr std::string_view plain
+  = "name=Ada+Lovelace&city=London&lang=en-GB&page=12&sort=created_at";
+
+constexpr std::string_view escaped
+  = "q=%E2%9C%93%20caf%C3%A9%20%26%20bar&next=%2Fapi%2Fusers%3Fpage%3D2";
+
+// The library calls Tcl through the stubs table, which a program embedding
+// Tcl fills in from an interpreter created with the library's own functions.
+#undef Tcl_FindExecutable
+#undef Tcl_CreateInterp
+
+Tcl_Interp*
+make_interp()
+{
+  Tcl_FindExecutable(nullptr);
+  auto interp = Tcl_CreateInterp();
+  if (! Tcl_InitStubs(interp, TCL_VERSION, 0))
+    std::abort();
+  return interp;
+}
+
+} // namespace
+
+void
+util_benchmarks()
+{
+  bench::run("url::percent_encode, 64 bytes", [] {
+    auto out = url::percent_encode(plain);
+    bench::keep(out.data());
+  });
+  bench::run("url::percent_decode, 64 bytes", [] {
+    auto out = url::percent_decode(escaped);
+    bench::keep(out->data());
+  });
+
+  // Tcl allocates with its own allocator, which the counts leave out
+  auto interp = make_interp();
+
+  TclObj dict{ Tcl_NewDictObj() };
+  for (auto [name, value]:
+       { std::pair{ "Host", "api.example.com" },
+         { "User-Agent", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0)" },
+         { "Accept", "application/json, text/plain, */*" },
+         { "Accept-Language", "en-US,en;q=0.5" },
+         { "Accept-Encoding", "gzip, deflate, br" },
+         { "Content-Type", "application/json" },
+         { "Content-Length", "60" },
+         { "Cookie", "session=2f6c1b9e8d7a4c3b; theme=dark" },
+         { "X-Request-Id", "7c9e6679-7425-40de-944b-e07fc1f90ae7" },
+         { "Connection", "keep-alive" } })
+    Tcl_DictObjPut(interp,
+                   dict.value(),
+                   Tcl_NewStringObj(name, -1),
+                   Tcl_NewStringObj(value, -1));
+
+  bench::run("get_dict and to_dict, 10 headers", [&] {
+    auto    headers = get_dict(interp, dict.value());
+    TclObj  out{ to_dict(interp, *headers) };
+    bench::keep(out.value());
+  });
+
+  url::query_fields fields;
+  bench::run("url::parse_query and to_dict, 5 fields", [&] {
+    fields.clear();
+    url::parse_query(plain, fields);
+    TclObj out{ url::to_dict(fields) };
+    bench::keep(out.value());
+  });
+
+  Tcl_DeleteInterp(interp);
+}
@@ -1,29 +1,409 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <initializer_list>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
-#include <unordered_map>
 #include <utility>
+#include <vector>
 
 namespace http_tcl
 {
-using headers = std::unordered_map<std::string, std::string>;
+// Header fields in the order they were added. Names are compared ignoring
+// case, and a name may appear more than once, as Set-Cookie often does.
+// Fields are kept in one flat array, and the names of typical fields fit in
+// std::string's inline storage, so most fields need no allocation of their
+// own.
+class headers
+{
+public:
+  using value_type     = std::pair<std::string, std::string>;
+  using container_type = std::vector<value_type>;
+  using iterator       = container_type::iterator;
+  using const_iterator = container_type::const_iterator;
+
+  headers() = default;
+  headers(std::initializer_list<value_type> fields) : fields_(fields) {}
+
+  // compares two names, ignoring the case of ASCII letters
+  static bool
+  iequals(std::string_view a, std::string_view b)
+  {
+    if (a.size() != b.size())
+      return false;
+    for (size_t i = 0; i < a.size(); ++i)
+      if (a[i] != b[i] && fold(a[i]) != fold(b[i]))
+        return false;
+    return true;
+  }
+
+  iterator
+  begin()
+  {
+    return fields_.begin();
+  }
+
+  iterator
+  end()
+  {
+    return fields_.end();
+  }
+
+  const_iterator
+  begin() const
+  {
+    return fields_.begin();
+  }
+
+  const_iterator
+  end() const
+  {
+    return fields_.end();
+  }
+
+  size_t
+  size() const
+  {
+    return fields_.size();
+  }
+
+  bool
+  empty() const
+  {
+    return fields_.empty();
+  }
+
+  void
+  reserve(size_t n)
+  {
+    fields_.reserve(n);
+  }
+
+  // the first field with this name, or end()
+  iterator
+  find(std::string_view name)
+  {
+    return std::find_if(begin(), end(), [name](value_type const& f) {
+      return iequals(f.first, name);
+    });
+  }
+
+  const_iterator
+  find(std::string_view name) const
+  {
+    return std::find_if(begin(), end(), [name](value_type const& f) {
+      return iequals(f.first, name);
+    });
+  }
+
+  // the value of the first field with this name
+  std::optional<std::string_view>
+  get(std::string_view name) const
+  {
+    if (auto it = find(name); it != end())
+      return it->second;
+    return std::nullopt;
+  }
+
+  // how many fields have this name
+  size_t
+  count(std::string_view name) const
+  {
+    return std::count_if(begin(), end(), [name](value_type const& f) {
+      return iequals(f.first, name);
+    });
+  }
+
+  // adds a field, after any others with the same name
+  void
+  add(std::string_view name, std::string_view value)
+  {
+    fields_.emplace_back(name, value);
+  }
+
+  // replaces every field with this name by one with value
+  void
+  set(std::string_view name, std::string_view value)
+  {
+    if (auto it = find(name); it != end())
+    {
+      it->second = value;
+      fields_.erase(std::remove_if(std::next(it),
+                                   end(),
+                                   [name](value_type const& f) {
+                                     return iequals(f.first, name);
+                                   }),
+                    end());
+    }
+    else
+      add(name, value);
+  }
+
+  // removes every field with this name; returns how many there were
+  size_t
+  erase(std::string_view name)
+  {
+    auto const n = fields_.size();
+    fields_.erase(std::remove_if(begin(),
+                                 end(),
+                                 [name](value_type const& f) {
+                                   return iequals(f.first, name);
+                                 }),
+                  end());
+    return n - fields_.size();
+  }
+
+private:
+  static char
+  fold(char c)
+  {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  }
+
+  container_type fields_;
+};
+
+// A vector of small values which keeps its first N in place, so that short
+// lists, such as the segments of a path, are built without allocating.
+template <typename T, size_t N>
+class small_vector
+{
+public:
+  T*
+  data() noexcept
+  {
+    return heap_.empty() ? inline_.data() : heap_.data();
+  }
+
+  T const*
+  data() const noexcept
+  {
+    return heap_.empty() ? inline_.data() : heap_.data();
+  }
+
+  size_t
+  size() const noexcept
+  {
+    return size_;
+  }
+
+  bool
+  empty() const noexcept
+  {
+    return size_ == 0;
+  }
+
+  T const*
+  begin() const noexcept
+  {
+    return data();
+  }
+
+  T const*
+  end() const noexcept
+  {
+    return data() + size_;
+  }
+
+  T&
+  operator[](size_t i) noexcept
+  {
+    return data()[i];
+  }
+
+  T const&
+  operator[](size_t i) const noexcept
+  {
+    return data()[i];
+  }
+
+  // once the values outgrow the array, all of them move to the heap
+  void
+  push_back(T const& value)
+  {
+    if (! heap_.empty())
+      heap_.push_back(value);
+    else if (size_ < N)
+      inline_[size_] = value;
+    else
+    {
+      heap_.reserve(2 * N);
+      heap_.assign(inline_.begin(), inline_.end());
+      heap_.push_back(value);
+    }
+    ++size_;
+  }
+
+  void
+  pop_back() noexcept
+  {
+    if (! heap_.empty())
+      heap_.pop_back();
+    --size_;
+  }
+
+  void
+  clear() noexcept
+  {
+    heap_.clear();
+    size_ = 0;
+  }
+
+private:
+  std::array<T, N> inline_{};
+  std::vector<T>   heap_;
+  size_t           size_{ 0 };
+};
+
+// The route matched by a router, and the path parameters it captured, in
+// the order they appear in the route's pattern. Parameter values view the
+// request target, still percent-encoded.
+struct route_match
+{
+  size_t                                                         id{ 0 };
+  small_vector<std::pair<std::string_view, std::string_view>, 8> params;
+};
+
+// Access to the headers of the request being handled, valid until the
+// handler returns. Fields are read in place from the request; nothing is
+// copied unless a header is asked for.
+struct headers_access
+{
+  using visitor = std::function<void(std::string_view name,
+                                     std::string_view value)>;
+
+  // calls visit for each field, in the order received
+  std::function<void(visitor const& visit)> each;
+
+  // the value of the first field with this name, ignoring case
+  std::function<std::optional<std::string_view>(std::string_view name)> find;
+
+  // the route which matched the request, if it went through a router
+  route_match const* route{ nullptr };
+
+  // the file holding the request body if it was spooled, in which case the
+  // body passed to the handler is empty
+  std::string_view body_file{};
+
+  // when the server finished reading the request
+  std::chrono::steady_clock::time_point received{};
+
+  // copies every field
+  headers
+  operator()() const
+  {
+    headers hs;
+    each([&hs](std::string_view name, std::string_view value) {
+      hs.add(name, value);
+    });
+    return hs;
+  }
+};
+
+// Produces the body of a streamed response one chunk at a time. The server
+// asks for the next chunk only once the previous one has been written, so a
+// slow client holds back the producer.
+class chunk_source
+{
+public:
+  virtual ~chunk_source() = default;
+
+  // the next chunk, or nothing at the end of the body; throws to abandon
+  // the response, which closes the connection
+  virtual std::optional<std::string>
+  next() = 0;
+
+  // the length of the whole body, if it is known before it is produced; the
+  // body is then sent with a Content-Length instead of chunked, and the
+  // source must produce exactly that many bytes or throw
+  virtual std::optional<std::uint64_t>
+  size() const
+  {
+    return std::nullopt;
+  }
+};
+
+// The body of a response. It either owns its bytes, or views bytes kept
+// alive by an owner, such as a Tcl object, which is released only after the
+// response has been written. Bytes are never converted or copied.
+// Alternatively it is streamed from a chunk_source.
+class response_body
+{
+  std::string                   storage_;
+  std::shared_ptr<void const>   owner_;
+  std::string_view              view_;
+  std::shared_ptr<chunk_source> chunks_;
+
+public:
+  response_body() = default;
+  response_body(std::string s) : storage_(std::move(s)) {}
+  response_body(char const* s) : storage_(s) {}
+  response_body(char const* s, size_t n) : storage_(s, n) {}
+  response_body(std::shared_ptr<void const> owner, std::string_view view)
+      : owner_(std::move(owner))
+      , view_(view)
+  {
+  }
+
+  // a body sent with chunked transfer encoding as source produces it
+  explicit response_body(std::shared_ptr<chunk_source> source)
+      : chunks_(std::move(source))
+  {
+  }
+
+  // the source of a streamed body, or null
+  std::shared_ptr<chunk_source> const&
+  chunks() const
+  {
+    return chunks_;
+  }
+
+  std::string_view
+  view() const
+  {
+    return owner_ ? view_ : std::string_view{ storage_ };
+  }
+
+  char const*
+  data() const
+  {
+    return view().data();
+  }
+
+  size_t
+  size() const
+  {
+    return view().size();
+  }
+};
 
 class alt_handler
 {
 public:
   using head_r = std::tuple<int, std::optional<headers>, size_t, std::string>;
   using get_r
-    = std::tuple<int, std::optional<headers>, std::string, std::string>;
+    = std::tuple<int, std::optional<headers>, response_body, std::string>;
   using options_r      = get_r;
   using post_r         = get_r;
   using put_r          = std::tuple<int, std::optional<headers>>;
   using delete_r       = get_r;
-  using headers_access = std::function<headers()>;
+  using headers_access = http_tcl::headers_access;
+
+  // a head_r size which sends no Content-Length, for a response whose size
+  // is not known without producing its body
+  static constexpr size_t unknown_size = static_cast<size_t>(-1);
 
   virtual options_r
   options(std::string_view target,
@@ -64,6 +444,17 @@ class thread_safe_handler : public alt_handler
   std::mutex                   mutex_;
   std::shared_ptr<alt_handler> handler_;
 
+protected:
+  // runs f while no request is being handled, e.g. to produce the next
+  // chunk of a streamed body
+  template <typename F>
+  auto
+  locked(F&& f)
+  {
+    std::lock_guard lock(mutex_);
+    return f();
+  }
+
 public:
   options_r
   options(std::string_view target,
@@ -119,6 +510,455 @@ public:
   }
 };
 
+// Dispatches each request to whichever of a fixed set of worker threads is
+// free. Every worker owns its own handler, created by calling make_handler on
+// the worker thread itself, so a handler may own thread-bound resources such
+// as a Tcl interpreter. The chunks of a streamed body are produced by the
+// worker which handled the request. The constructor throws if any handler
+// cannot be created.
+class worker_pool : public alt_handler
+{
+public:
+  using handler_factory = std::function<std::shared_ptr<alt_handler>()>;
+
+  worker_pool(int workers, handler_factory make_handler);
+  ~worker_pool();
+
+  worker_pool(worker_pool const&) = delete;
+  worker_pool&
+  operator=(worker_pool const&)
+    = delete;
+
+  options_r
+  options(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+  head_r
+  head(std::string_view target, headers_access&& get_headers) override;
+
+  get_r
+  get(std::string_view target, headers_access&& get_headers) override;
+
+  post_r
+  post(std::string_view target,
+       std::string_view body,
+       headers_access&& get_headers) override;
+
+  put_r
+  put(std::string_view target,
+      std::string_view body,
+      headers_access&& get_headers) override;
+
+  delete_r
+  delete_(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+private:
+  struct job;
+  template <typename R, typename F>
+  struct typed_job;
+  class pinned_source;
+
+  template <typename F>
+  auto
+  dispatch(F&& f);
+
+  template <typename F>
+  auto
+  dispatch_to(std::deque<job*>& queue, F&& f);
+
+  template <typename R>
+  R
+  pin(R&& result);
+
+  void
+  work(handler_factory const& make_handler);
+
+  void
+  stop();
+
+  // the jobs pinned to the calling worker thread
+  static thread_local std::deque<job*>* own_jobs_;
+
+  std::mutex               mutex_;
+  std::condition_variable  cv_;
+  std::deque<job*>         jobs_;
+  bool                     stopping_{ false };
+  int                      starting_{ 0 };
+  std::string              start_error_;
+  std::vector<std::thread> threads_;
+};
+
+// A histogram of durations which any thread may record into without locking,
+// in the manner of HdrHistogram: each power of two of nanoseconds is split
+// into eight buckets, so quantiles are within an eighth of the true value.
+class latency_histogram
+{
+public:
+  // durations in seconds; quantiles are the upper bounds of their buckets
+  struct summary
+  {
+    uint64_t count{ 0 };
+    double   sum{ 0 };
+    double   p50{ 0 };
+    double   p90{ 0 };
+    double   p99{ 0 };
+    double   max{ 0 };
+  };
+
+  void
+  record(std::chrono::steady_clock::duration elapsed);
+
+  summary
+  summarize() const;
+
+private:
+  static constexpr size_t sub_buckets = 8;
+
+  // 2^42 ns is over an hour; longer durations go in the last bucket
+  static constexpr size_t max_power    = 42;
+  static constexpr size_t bucket_count = (max_power - 2) * sub_buckets;
+
+  static size_t
+  bucket(uint64_t ns);
+
+  static uint64_t
+  upper_bound(size_t bucket);
+
+  std::array<std::atomic<uint64_t>, bucket_count> buckets_{};
+  std::atomic<uint64_t>                           sum_{ 0 };
+  std::atomic<uint64_t>                           max_{ 0 };
+};
+
+// The requests of one method or route: how many there were, by the class of
+// their status, and how long their handlers took.
+struct request_metrics
+{
+  std::atomic<uint64_t>                requests{ 0 };
+  std::array<std::atomic<uint64_t>, 5> statuses{}; // 1xx to 5xx
+  latency_histogram                    latency;
+
+  void
+  record(int status, std::chrono::steady_clock::duration elapsed);
+};
+
+// The requests which matched one route of a router.
+struct route_metrics
+{
+  route_metrics(std::string method, std::string pattern)
+      : method(std::move(method))
+      , pattern(std::move(pattern))
+  {
+  }
+
+  std::string     method; // e.g. "GET"
+  std::string     pattern;
+  request_metrics counters;
+};
+
+using route_metrics_table = std::deque<route_metrics>;
+
+// Matches each request against a set of routes before calling the wrapped
+// handler, which finds the match in headers_access::route. Patterns are
+// paths whose segments are either literal or a parameter such as {id}, e.g.
+// /users/{id}/posts; literal segments take precedence. Matching walks a
+// tree of the routes' segments rather than trying each route in turn. A HEAD
+// request which matches no HEAD route uses a GET route, and its body is
+// dropped. A request which matches no route is answered with 404, unless its
+// method is one of fallback, in which case it is passed on without a route.
+class router : public alt_handler
+{
+public:
+  enum class method
+  {
+    options,
+    head,
+    get,
+    post,
+    put,
+    delete_
+  };
+
+  // a route's id is its index in routes
+  struct route
+  {
+    method      verb;
+    std::string pattern;
+  };
+
+  // throws std::invalid_argument if a pattern is malformed; of two routes
+  // with the same method and path, the later one wins
+  router(alt_handler*              next,
+         std::vector<route> const& routes,
+         std::vector<method> const& fallback = {});
+  ~router();
+
+  router(router const&) = delete;
+  router&
+  operator=(router const&)
+    = delete;
+
+  // the reason pattern is malformed, or nothing if it is valid
+  static std::optional<std::string>
+  check_pattern(std::string_view pattern);
+
+  options_r
+  options(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+  head_r
+  head(std::string_view target, headers_access&& get_headers) override;
+
+  get_r
+  get(std::string_view target, headers_access&& get_headers) override;
+
+  post_r
+  post(std::string_view target,
+       std::string_view body,
+       headers_access&& get_headers) override;
+
+  put_r
+  put(std::string_view target,
+      std::string_view body,
+      headers_access&& get_headers) override;
+
+  delete_r
+  delete_(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+private:
+  struct node;
+
+  bool
+  find(method verb, std::string_view target, route_match& out) const;
+
+  template <typename R, typename F>
+  R
+  call_route(route_match& match, headers_access& get_headers, F&& call);
+
+  template <typename R, typename F>
+  R
+  dispatch(method           verb,
+           std::string_view target,
+           headers_access&  get_headers,
+           R&&              not_found,
+           F&&              call);
+
+  alt_handler*                          next_;
+  std::unique_ptr<node>                 root_;
+  std::vector<std::vector<std::string>> names_;
+  std::vector<bool>                     fallback_;
+  std::shared_ptr<route_metrics_table>  metrics_;
+};
+
+// Keeps GET responses which opt in with "Cache-Control: max-age=N" and
+// answers later GET and HEAD requests for the same target from memory,
+// without calling the wrapped handler, until they are N seconds old. A
+// response's Vary header selects request headers which become part of the
+// key. Bodies are kept to a total of max_bytes, least recently used first
+// out. Responses which set cookies, requests with Authorization, and
+// "no-store", "no-cache" or "private" responses are never cached.
+class response_cache : public alt_handler
+{
+public:
+  response_cache(alt_handler* next, size_t max_bytes);
+  ~response_cache();
+
+  response_cache(response_cache const&) = delete;
+  response_cache&
+  operator=(response_cache const&)
+    = delete;
+
+  // drops every response whose target begins with prefix; returns how many
+  size_t
+  purge(std::string_view prefix);
+
+  options_r
+  options(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+  head_r
+  head(std::string_view target, headers_access&& get_headers) override;
+
+  get_r
+  get(std::string_view target, headers_access&& get_headers) override;
+
+  post_r
+  post(std::string_view target,
+       std::string_view body,
+       headers_access&& get_headers) override;
+
+  put_r
+  put(std::string_view target,
+      std::string_view body,
+      headers_access&& get_headers) override;
+
+  delete_r
+  delete_(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+private:
+  struct entry;
+  struct store;
+
+  alt_handler*           next_;
+  std::unique_ptr<store> store_;
+};
+
+// Which responses a compressor compresses, and how hard it tries.
+struct compress_options
+{
+  // bodies smaller than this are sent as they are
+  size_t min_size{ 1024 };
+
+  // media types to compress; "text/*" matches every text type
+  std::vector<std::string> types{ "text/*",
+                                  "application/json",
+                                  "application/javascript",
+                                  "application/xml",
+                                  "image/svg+xml" };
+
+  // zlib compression level, 1 (fastest) to 9 (smallest)
+  int level{ 6 };
+
+  // whether a body of this type and size should be compressed
+  bool
+  compresses(std::string_view content_type, size_t size) const;
+};
+
+// Compresses the bodies of responses from the wrapped handler with gzip or
+// deflate, whichever the request's Accept-Encoding prefers, and adds
+// Vary: Accept-Encoding to every response it could have compressed. It runs
+// on the calling thread after the wrapped handler has returned, so a
+// handler which serialises requests does not compress under its lock.
+// Streamed bodies, and bodies which already have a Content-Encoding, are
+// passed on untouched. A HEAD request which would get a compressed response
+// is answered without Content-Length, since the compressed size is not known
+// without producing the body.
+class compressor : public alt_handler
+{
+public:
+  compressor(alt_handler* next, compress_options options);
+
+  // the coding to answer a request with this Accept-Encoding with: "gzip",
+  // "deflate", or empty for none
+  static std::string_view
+  negotiate(std::optional<std::string_view> accept_encoding);
+
+  // bytes compressed with coding, which is "gzip" or "deflate"
+  static std::string
+  encode(std::string_view bytes, std::string_view coding, int level);
+
+  options_r
+  options(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+  head_r
+  head(std::string_view target, headers_access&& get_headers) override;
+
+  get_r
+  get(std::string_view target, headers_access&& get_headers) override;
+
+  post_r
+  post(std::string_view target,
+       std::string_view body,
+       headers_access&& get_headers) override;
+
+  put_r
+  put(std::string_view target,
+      std::string_view body,
+      headers_access&& get_headers) override;
+
+  delete_r
+  delete_(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+private:
+  get_r
+  compress(get_r&& res, std::string_view coding) const;
+
+  alt_handler*     next_;
+  compress_options options_;
+};
+
+// Serves GET and HEAD requests for targets under prefix from the files under
+// root, without calling the wrapped handler, so static content never waits
+// for it. Other requests go to the wrapped handler. Open files and their
+// stat results are kept in a cache of up to cache_size entries, least
+// recently used first out; small files are held in memory, and larger ones
+// are read from their descriptor as they are sent. With compress options,
+// files which would be compressed are served gzipped to requests which accept
+// it: from a file of the same name with .gz appended if there is one, or else,
+// for files small enough to be held in memory, compressed once when the file
+// is opened.
+class static_files : public alt_handler
+{
+public:
+  static_files(alt_handler*                    next,
+               std::string                     root,
+               std::string                     prefix,
+               std::optional<compress_options> compress   = std::nullopt,
+               size_t                          cache_size = 256);
+  ~static_files();
+
+  static_files(static_files const&) = delete;
+  static_files&
+  operator=(static_files const&)
+    = delete;
+
+  options_r
+  options(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+  head_r
+  head(std::string_view target, headers_access&& get_headers) override;
+
+  get_r
+  get(std::string_view target, headers_access&& get_headers) override;
+
+  post_r
+  post(std::string_view target,
+       std::string_view body,
+       headers_access&& get_headers) override;
+
+  put_r
+  put(std::string_view target,
+      std::string_view body,
+      headers_access&& get_headers) override;
+
+  delete_r
+  delete_(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+private:
+  struct contents;
+  struct file;
+  struct cache;
+
+  bool
+  serves(std::string_view target) const;
+
+  // the file for a target under prefix, or null if there is no such file
+  std::shared_ptr<file const>
+  lookup(std::string_view target);
+
+  alt_handler*                    next_;
+  std::string                     root_;
+  std::string                     prefix_;
+  std::optional<compress_options> compress_;
+  std::unique_ptr<cache>          cache_;
+};
+
 // begin gsl - MIT License - https://github.com/microsoft/GSL
 
 // final_action allows you to ensure something gets run at the end of a scope
@@ -171,18 +1011,293 @@ finally(F&& f) noexcept
 // end gsl
 
 
+// What to do with connections accepted while max_connections are open.
+enum class overflow_policy
+{
+  queue,  // hold up to backlog connections until a slot frees
+  reject, // answer 503 Service Unavailable with Retry-After, then close
+  close,  // close the connection
+};
+
+struct admission_options
+{
+  int             max_connections{ 250 };
+  int             backlog{ 250 };
+  overflow_policy overflow{ overflow_policy::queue };
+};
+
+// How request bodies are read. Bodies longer than max_size are refused with
+// 413. Bodies longer than spool_threshold, if it is not zero, and chunked
+// bodies of unknown length, are written to a file in spool_dir instead of
+// memory (the system's temporary directory if spool_dir is empty). The file
+// is removed once the response has been sent.
+struct body_options
+{
+  uint64_t    max_size{ 1024 * 1024 };
+  uint64_t    spool_threshold{ 0 };
+  std::string spool_dir;
+};
+
+// Snapshot of the server's connection counters since the process started.
+struct admission_stats
+{
+  uint64_t admitted; // connections given to a session
+  uint64_t queued;   // connections which waited in the backlog
+  uint64_t rejected; // connections answered with 503 or closed
+  int      active;   // connections being served now
+  int      waiting;  // connections in the backlog now
+};
+
+admission_stats
+get_admission_stats();
+
+// Counters and histograms of the server side of the whole process, which
+// I/O threads update without locking. A request's time is split into its
+// wait for the interpreter or a worker to be free (queue_wait), the time
+// Tcl spends on it (eval), and the time taken to write the response
+// (write), which includes producing a streamed body.
+class server_metrics
+{
+public:
+  using method = router::method;
+
+  static constexpr size_t method_count = 6;
+
+  // e.g. "GET"
+  static char const*
+  method_name(method m);
+
+  request_metrics&
+  requests(method m)
+  {
+    return methods_[static_cast<size_t>(m)];
+  }
+
+  request_metrics const&
+  requests(method m) const
+  {
+    return methods_[static_cast<size_t>(m)];
+  }
+
+  // the routes of the router created last, which records into them
+  void
+  set_routes(std::shared_ptr<route_metrics_table> routes);
+
+  std::shared_ptr<route_metrics_table const>
+  routes() const;
+
+  // everything, with the connection counters, in the Prometheus text
+  // exposition format
+  std::string
+  prometheus() const;
+
+  latency_histogram     queue_wait;
+  latency_histogram     eval;
+  latency_histogram     write;
+  std::atomic<uint64_t> bytes_in{ 0 };
+  std::atomic<uint64_t> bytes_out{ 0 };
+
+private:
+  std::array<request_metrics, method_count> methods_;
+  mutable std::mutex                        mutex_;
+  std::shared_ptr<route_metrics_table>      routes_;
+};
+
+server_metrics&
+get_server_metrics();
+
+// Answers GET and HEAD requests for target with get_server_metrics() in
+// the Prometheus text format, without calling the wrapped handler, so they
+// never wait for the interpreter.
+class metrics_target : public alt_handler
+{
+public:
+  metrics_target(alt_handler* next, std::string target);
+
+  options_r
+  options(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+  head_r
+  head(std::string_view target, headers_access&& get_headers) override;
+
+  get_r
+  get(std::string_view target, headers_access&& get_headers) override;
+
+  post_r
+  post(std::string_view target,
+       std::string_view body,
+       headers_access&& get_headers) override;
+
+  put_r
+  put(std::string_view target,
+      std::string_view body,
+      headers_access&& get_headers) override;
+
+  delete_r
+  delete_(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override;
+
+private:
+  bool
+  matches(std::string_view target) const;
+
+  alt_handler* next_;
+  std::string  target_;
+};
+
+int
+run(std::string_view         address_,
+    unsigned short           port,
+    alt_handler*             alt_handler,
+    admission_options const& admission = {},
+    body_options const&      body      = {});
+
+// Asynchronous server: a fixed pool of io_threads runs all connections.
 int
-run(std::string_view address_,
-    unsigned short   port,
-    alt_handler*     alt_handler,
-    int              max_connections = 250);
+run_async(std::string_view         address_,
+          unsigned short           port,
+          alt_handler*             alt_handler,
+          int                      io_threads,
+          admission_options const& admission = {},
+          body_options const&      body      = {});
+
+// Asynchronous server which runs on its own io_threads from construction
+// until stop is called or it is destroyed. Throws if it cannot listen on the
+// address and port.
+class server
+{
+public:
+  server(std::string_view         address_,
+         unsigned short           port,
+         alt_handler*             alt_handler,
+         int                      io_threads,
+         admission_options const& admission = {},
+         body_options const&      body      = {});
+  ~server();
+
+  server(server const&) = delete;
+  server&
+  operator=(server const&)
+    = delete;
+
+  // Stops accepting, abandons open connections and joins the I/O threads.
+  // Handlers still running must return before stop can complete.
+  void
+  stop();
 
-std::tuple<int, headers, std::string>
+  // Blocks until the server is stopped from another thread.
+  void
+  wait();
+
+private:
+  struct impl;
+  std::unique_ptr<impl> impl_;
+};
+
+// Idle connections kept by http_client for reuse, per host and port.
+struct client_pool_options
+{
+  int                       max_idle_per_host{ 4 };
+  std::chrono::milliseconds idle_timeout{ 15000 };
+
+  // how long name lookups, and failed lookups, are cached
+  std::chrono::milliseconds dns_ttl{ 60000 };
+  std::chrono::milliseconds dns_failure_ttl{ 5000 };
+};
+
+// Counters since the process started: requests sent on a reused connection
+// (hits) or a new one (misses), connections now idle in the pool, and name
+// lookups answered from the cache (dns_hits) or not (dns_misses).
+struct client_pool_stats
+{
+  uint64_t hits{ 0 };
+  uint64_t misses{ 0 };
+  int      idle{ 0 };
+  uint64_t dns_hits{ 0 };
+  uint64_t dns_misses{ 0 };
+};
+
+void
+set_client_pool_options(client_pool_options const& options);
+
+client_pool_stats
+get_client_pool_stats();
+
+// A cached name lookup: the addresses of host:port, or the error of a
+// failed lookup, and how much longer it is kept.
+struct client_dns_entry
+{
+  std::string               key;
+  std::vector<std::string>  addresses;
+  std::string               error;
+  std::chrono::milliseconds ttl;
+};
+
+std::vector<client_dns_entry>
+get_client_dns_cache();
+
+void
+flush_client_dns_cache();
+
+// The status, headers and body of a response.
+using client_result = std::tuple<int, headers, std::string>;
+
+// Receives a response body piece by piece; returns false to give up.
+using body_sink = std::function<bool(char const* data, std::size_t size)>;
+
+// Sends one request and returns the status, headers and body of the
+// response. Connections are reused when the server allows keep-alive. With
+// a sink, the body is passed to it as it arrives, whatever its size, and
+// the returned body is empty.
+client_result
 http_client(std::string_view              method,
             std::string                   host,
             std::string                   port,
             std::string                   target,
             std::optional<headers> const& headers,
-            std::string_view              body);
+            std::string_view              body,
+            body_sink const&              sink = {});
+
+// Sends one request from a background thread and returns its id at once.
+// The callback runs on that thread with the response, or with status 500
+// and a message if the request fails, times out or is cancelled. A timeout
+// of zero means none.
+uint64_t
+http_client_async(std::string_view                     method,
+                  std::string                          host,
+                  std::string                          port,
+                  std::string                          target,
+                  std::optional<headers> const&        headers,
+                  std::string_view                     body,
+                  std::chrono::milliseconds            timeout,
+                  std::function<void(client_result&&)> callback);
+
+// One request of a batch sent by http_client_multi.
+struct client_request
+{
+  std::string                      method{ "get" };
+  std::string                      host;
+  std::string                      port{ "80" };
+  std::string                      target{ "/" };
+  std::optional<http_tcl::headers> headers;
+  std::string                      body;
+};
+
+// Sends a batch of requests from the background thread, at most concurrency
+// at a time (all at once if zero), and returns their results in order.
+// Requests which have not completed when the timeout expires, counted from
+// the call, are reported as timed out. A timeout of zero means none.
+std::vector<client_result>
+http_client_multi(std::vector<client_request> const& requests,
+                  std::chrono::milliseconds          timeout,
+                  int                                concurrency);
+
+// Cancels a request started by http_client_async. Returns false if it has
+// already finished.
+bool
+http_client_cancel(uint64_t id);
 
 } // namespace http_tcl
@@ -0,0 +1,154 @@
+#pragma once
+#include "http_tcl/http_tcl.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace http_tcl
+{
+// Process-wide connection counters, reported by admission_stats().
+struct admission_counters
+{
+  std::atomic<uint64_t> admitted{ 0 };
+  std::atomic<uint64_t> queued{ 0 };
+  std::atomic<uint64_t> rejected{ 0 };
+  std::atomic<int>      active{ 0 };
+  std::atomic<int>      waiting{ 0 };
+};
+
+extern admission_counters the_admission_counters;
+
+// Limits the number of connections being served at once. Connections beyond
+// max_connections are held in a bounded backlog, answered with 503, or
+// closed, according to the overflow policy. A queued connection takes over
+// the slot of the next admitted connection to finish.
+template <typename Connection>
+class admission_control
+{
+public:
+  enum class decision
+  {
+    admit,
+    queue,
+    reject,
+    close
+  };
+
+  explicit admission_control(admission_options const& options)
+      : options_(options)
+  {
+    if (options_.max_connections < 1)
+      options_.max_connections = 1;
+    if (options_.backlog < 0)
+      options_.backlog = 0;
+  }
+
+  // Decides what to do with a newly accepted connection. Never blocks. On
+  // decision::queue the connection has been moved into the backlog.
+  decision
+  offer(Connection& connection)
+  {
+    std::lock_guard lock(mutex_);
+    if (active_ < options_.max_connections)
+    {
+      ++active_;
+      ++the_admission_counters.active;
+      ++the_admission_counters.admitted;
+      return decision::admit;
+    }
+
+    if (options_.overflow == overflow_policy::queue
+        && static_cast<int>(backlog_.size()) < options_.backlog)
+    {
+      backlog_.push_back(std::move(connection));
+      ++the_admission_counters.waiting;
+      ++the_admission_counters.queued;
+      return decision::queue;
+    }
+
+    ++the_admission_counters.rejected;
+    return options_.overflow == overflow_policy::close ? decision::close
+                                                       : decision::reject;
+  }
+
+  // True if offer would admit or queue a new connection.
+  bool
+  has_room()
+  {
+    std::lock_guard lock(mutex_);
+    return has_room_locked();
+  }
+
+  // Blocks while offer would have to turn a new connection away under the
+  // queue policy, so the acceptor leaves further connections in the
+  // listen queue instead of spinning.
+  void
+  wait_for_room()
+  {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this] { return has_room_locked(); });
+  }
+
+  // Called when an admitted connection finishes. Returns the oldest queued
+  // connection, which is admitted in its place.
+  std::optional<Connection>
+  release()
+  {
+    std::optional<Connection> next;
+    {
+      std::lock_guard lock(mutex_);
+      if (backlog_.empty())
+      {
+        --active_;
+        --the_admission_counters.active;
+      }
+      else
+      {
+        next.emplace(std::move(backlog_.front()));
+        backlog_.pop_front();
+        --the_admission_counters.waiting;
+        ++the_admission_counters.admitted;
+      }
+    }
+    cv_.notify_one();
+    return next;
+  }
+
+  // Called instead of release when an admitted connection finishes while
+  // the server is stopping. Queued connections are closed rather than
+  // admitted, so the counters still return to zero.
+  void
+  release_stopping()
+  {
+    std::deque<Connection> dropped;
+    {
+      std::lock_guard lock(mutex_);
+      --active_;
+      --the_admission_counters.active;
+      the_admission_counters.waiting -= static_cast<int>(backlog_.size());
+      dropped.swap(backlog_);
+    }
+    cv_.notify_all();
+  }
+
+private:
+  bool
+  has_room_locked() const
+  {
+    return options_.overflow != overflow_policy::queue
+           || active_ < options_.max_connections
+           || static_cast<int>(backlog_.size()) < options_.backlog;
+  }
+
+  admission_options       options_;
+  std::mutex              mutex_;
+  std::condition_variable cv_;
+  int                     active_{ 0 };
+  std::deque<Connection>  backlog_;
+};
+
+} // namespace http_tcl
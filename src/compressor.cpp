@@ -0,0 +1,252 @@
+#include "header_tokens.h"
+#include "http_tcl/http_tcl.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace http_tcl
+{
+namespace
+{
+using namespace header_tokens;
+
+// The quality of a coding such as "gzip;q=0.5"; 1 if none is given.
+double
+quality(std::string_view params)
+{
+  for (;;)
+  {
+    auto semi = params.find(';');
+    if (semi == std::string_view::npos)
+      return 1.0;
+    params.remove_prefix(semi + 1);
+
+    auto param = trim(params.substr(0, params.find(';')));
+    if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q')
+        && param[1] == '=')
+    {
+      std::string value{ param.substr(2) };
+      return std::strtod(value.c_str(), nullptr);
+    }
+  }
+}
+
+// Adds Accept-Encoding to the response's Vary header.
+void
+vary_on_encoding(headers& hs)
+{
+  auto it = hs.find("Vary");
+  if (it == hs.end())
+  {
+    hs.add("Vary", "Accept-Encoding");
+    return;
+  }
+
+  bool found{ false };
+  for_each_token(it->second, [&](std::string_view name) {
+    found = found || name == "*" || iequals(name, "Accept-Encoding");
+  });
+  if (! found)
+    it->second.append(", Accept-Encoding");
+}
+
+} // namespace
+
+bool
+compress_options::compresses(std::string_view content_type, size_t size) const
+{
+  if (size < min_size)
+    return false;
+
+  auto media = trim(content_type.substr(0, content_type.find(';')));
+  return std::any_of(types.begin(), types.end(), [media](auto const& type) {
+    std::string_view t{ type };
+    if (t.size() < 2 || t.substr(t.size() - 2) != "/*")
+      return iequals(media, t);
+
+    auto prefix = t.substr(0, t.size() - 1);
+    return media.size() > prefix.size()
+           && iequals(media.substr(0, prefix.size()), prefix);
+  });
+}
+
+compressor::compressor(alt_handler* next, compress_options options)
+    : next_(next)
+    , options_(std::move(options))
+{
+}
+
+std::string_view
+compressor::negotiate(std::optional<std::string_view> accept_encoding)
+{
+  if (! accept_encoding)
+    return {};
+
+  // codings not named take the quality of "*", if it is there
+  double gzip{ -1 }, deflate{ -1 }, any{ 0 };
+  for_each_token(*accept_encoding, [&](std::string_view token) {
+    auto name = trim(token.substr(0, token.find(';')));
+    auto q    = quality(token);
+    if (iequals(name, "gzip") || iequals(name, "x-gzip"))
+      gzip = q;
+    else if (iequals(name, "deflate"))
+      deflate = q;
+    else if (name == "*")
+      any = q;
+  });
+  if (gzip < 0)
+    gzip = any;
+  if (deflate < 0)
+    deflate = any;
+
+  if (gzip > 0 && gzip >= deflate)
+    return "gzip";
+  if (deflate > 0)
+    return "deflate";
+  return {};
+}
+
+std::string
+compressor::encode(std::string_view bytes, std::string_view coding, int level)
+{
+  // deflate in HTTP means the zlib format; gzip adds its own wrapper
+  z_stream zs{};
+  auto     window = coding == "gzip" ? MAX_WBITS + 16 : MAX_WBITS;
+  if (deflateInit2(&zs, level, Z_DEFLATED, window, 8, Z_DEFAULT_STRATEGY)
+      != Z_OK)
+    throw std::runtime_error("could not start compression");
+
+  // zlib counts input and output in uInt, so larger bodies are passed in
+  // slices; a body which fits is compressed in one call
+  constexpr size_t slice = std::numeric_limits<uInt>::max();
+  size_t           taken{ 0 };
+  std::string      out;
+  int              rc{ Z_OK };
+  while (rc == Z_OK)
+  {
+    if (zs.avail_in == 0)
+    {
+      auto n      = std::min(bytes.size() - taken, slice);
+      zs.next_in  = reinterpret_cast<Bytef*>(
+        const_cast<char*>(bytes.data() + taken));
+      zs.avail_in = static_cast<uInt>(n);
+      taken += n;
+    }
+
+    auto left  = zs.avail_in + (bytes.size() - taken);
+    auto room  = std::min<size_t>(
+      deflateBound(&zs, static_cast<uLong>(std::min(left, slice))), slice);
+    auto start = out.size();
+    out.resize(start + room);
+    zs.next_out  = reinterpret_cast<Bytef*>(out.data() + start);
+    zs.avail_out = static_cast<uInt>(room);
+
+    rc = deflate(&zs, taken == bytes.size() ? Z_FINISH : Z_NO_FLUSH);
+    out.resize(out.size() - zs.avail_out);
+  }
+  deflateEnd(&zs);
+  if (rc != Z_STREAM_END)
+    throw std::runtime_error("could not compress the response body");
+
+  return out;
+}
+
+alt_handler::get_r
+compressor::compress(get_r&& res, std::string_view coding) const
+{
+  auto& [status, hs, body, content_type] = res;
+  if (status < 200 || status >= 300 || status == 204 || body.chunks()
+      || ! options_.compresses(content_type, body.size()))
+    return std::move(res);
+
+  if (! hs)
+    hs.emplace();
+  else if (hs->get("Content-Encoding"))
+    return std::move(res);
+
+  // caches must tell apart the responses to requests which accept
+  // compression from the others
+  vary_on_encoding(*hs);
+
+  if (coding.empty())
+    return std::move(res);
+
+  auto encoded = encode(body.view(), coding, options_.level);
+  if (encoded.size() >= body.size())
+    return std::move(res);
+
+  hs->add("Content-Encoding", coding);
+  body = response_body{ std::move(encoded) };
+  return std::move(res);
+}
+
+alt_handler::options_r
+compressor::options(std::string_view target,
+                    std::string_view body,
+                    headers_access&& get_headers)
+{
+  auto coding = negotiate(get_headers.find("Accept-Encoding"));
+  return compress(next_->options(target, body, std::move(get_headers)),
+                  coding);
+}
+
+alt_handler::head_r
+compressor::head(std::string_view target, headers_access&& get_headers)
+{
+  auto coding = negotiate(get_headers.find("Accept-Encoding"));
+  auto res    = next_->head(target, std::move(get_headers));
+  auto& [status, hs, size, content_type] = res;
+  if (status < 200 || status >= 300 || status == 204
+      || ! options_.compresses(content_type, size)
+      || (hs && hs->get("Content-Encoding")))
+    return res;
+
+  if (! hs)
+    hs.emplace();
+  vary_on_encoding(*hs);
+
+  // GET would be compressed, to a size which is not known without producing
+  // the body
+  if (! coding.empty())
+    size = unknown_size;
+  return res;
+}
+
+alt_handler::get_r
+compressor::get(std::string_view target, headers_access&& get_headers)
+{
+  auto coding = negotiate(get_headers.find("Accept-Encoding"));
+  return compress(next_->get(target, std::move(get_headers)), coding);
+}
+
+alt_handler::post_r
+compressor::post(std::string_view target,
+                 std::string_view body,
+                 headers_access&& get_headers)
+{
+  auto coding = negotiate(get_headers.find("Accept-Encoding"));
+  return compress(next_->post(target, body, std::move(get_headers)), coding);
+}
+
+alt_handler::put_r
+compressor::put(std::string_view target,
+                std::string_view body,
+                headers_access&& get_headers)
+{
+  return next_->put(target, body, std::move(get_headers));
+}
+
+alt_handler::delete_r
+compressor::delete_(std::string_view target,
+                    std::string_view body,
+                    headers_access&& get_headers)
+{
+  auto coding = negotiate(get_headers.find("Accept-Encoding"));
+  return compress(next_->delete_(target, body, std::move(get_headers)),
+                  coding);
+}
+
+} // namespace http_tcl
@@ -0,0 +1,774 @@
+//
+// Copyright (c) 2016-2019 Vinnie Falco (vinnie dot falco at gmail dot com)
+// Portions Copyright (c) 2021 anticrisis <https://github.com/anticrisis>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Official repository: https://github.com/boostorg/beast
+//
+
+// anticrisis: request handling shared by the synchronous and asynchronous
+// servers. Changes by anticrisis marked with 'anticrisis'
+
+#pragma once
+#include "http_tcl/http_tcl.h"
+
+#include <boost/asio/error.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/optional.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <random>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace http_tcl
+{
+namespace beast = boost::beast; // from <boost/beast.hpp>
+namespace http  = beast::http;  // from <boost/beast/http.hpp>
+namespace net   = boost::asio;  // from <boost/asio.hpp>
+
+//------------------------------------------------------------------------------
+
+// anticrisis: a Beast body which writes a response_body in place, so the
+// bytes returned by a handler go to the socket without another copy
+struct shared_body
+{
+  using value_type = response_body;
+
+  static std::uint64_t
+  size(value_type const& body)
+  {
+    return body.size();
+  }
+
+  class writer
+  {
+    value_type const& body_;
+
+  public:
+    using const_buffers_type = net::const_buffer;
+
+    template <bool isRequest, class Fields>
+    writer(http::header<isRequest, Fields> const&, value_type const& body)
+        : body_(body)
+    {
+    }
+
+    void
+    init(beast::error_code& ec)
+    {
+      ec = {};
+    }
+
+    boost::optional<std::pair<const_buffers_type, bool>>
+    get(beast::error_code& ec)
+    {
+      ec = {};
+      return { { const_buffers_type{ body_.data(), body_.size() }, false } };
+    }
+  };
+};
+
+// anticrisis: a Beast body which asks a chunk_source for each chunk only
+// when the serializer is ready for it; send it with chunked(true), unless
+// the source knows its size
+struct chunked_body
+{
+  using value_type = std::shared_ptr<chunk_source>;
+
+  class writer
+  {
+    value_type const& source_;
+    std::string       chunk_;
+
+  public:
+    using const_buffers_type = net::const_buffer;
+
+    template <bool isRequest, class Fields>
+    writer(http::header<isRequest, Fields> const&, value_type const& source)
+        : source_(source)
+    {
+    }
+
+    void
+    init(beast::error_code& ec)
+    {
+      ec = {};
+    }
+
+    boost::optional<std::pair<const_buffers_type, bool>>
+    get(beast::error_code& ec)
+    {
+      ec = {};
+      try
+      {
+        // an empty chunk would end the body, so skip it
+        for (;;)
+        {
+          auto next = source_->next();
+          if (! next)
+            return boost::none;
+          if (next->empty())
+            continue;
+
+          chunk_ = std::move(*next);
+          return { { const_buffers_type{ chunk_.data(), chunk_.size() },
+                     true } };
+        }
+      }
+      catch (std::exception const&)
+      {
+        ec = net::error::operation_aborted;
+        return boost::none;
+      }
+    }
+  };
+};
+
+// anticrisis: bodies whose serializer produces the whole message in one step,
+// so a response_batch can hold them
+template <class Body>
+struct is_batchable : std::false_type
+{
+};
+
+template <>
+struct is_batchable<shared_body> : std::true_type
+{
+};
+
+template <>
+struct is_batchable<http::string_body> : std::true_type
+{
+};
+
+template <>
+struct is_batchable<http::empty_body> : std::true_type
+{
+};
+
+// anticrisis: responses to pipelined requests, held in order until they are
+// sent together with one gathered write
+class response_batch
+{
+  struct item
+  {
+    virtual ~item() = default;
+
+    virtual void
+    collect(std::vector<net::const_buffer>& out)
+      = 0;
+  };
+
+  template <class Body, class Fields>
+  struct message_item : item
+  {
+    http::response<Body, Fields>          msg;
+    http::serializer<false, Body, Fields> sr{ msg };
+
+    explicit message_item(http::response<Body, Fields>&& m) : msg(std::move(m))
+    {
+    }
+
+    void
+    collect(std::vector<net::const_buffer>& out) override
+    {
+      beast::error_code ec;
+      sr.next(ec, [&out](beast::error_code&, auto const& buffers) {
+        for (auto b: beast::buffers_range_ref(buffers))
+          out.push_back(b);
+      });
+    }
+  };
+
+  std::vector<std::unique_ptr<item>> items_;
+  std::vector<net::const_buffer>     buffers_;
+  bool                               close_{ false };
+
+public:
+  // the most responses held before they are written
+  static constexpr size_t max_size = 16;
+
+  template <class Body, class Fields>
+  void
+  push(http::response<Body, Fields>&& msg)
+  {
+    static_assert(is_batchable<Body>::value);
+    close_ = close_ || msg.need_eof();
+    items_.push_back(
+      std::make_unique<message_item<Body, Fields>>(std::move(msg)));
+  }
+
+  bool
+  empty() const
+  {
+    return items_.empty();
+  }
+
+  size_t
+  size() const
+  {
+    return items_.size();
+  }
+
+  // whether the connection closes once the held responses are written
+  bool
+  close() const
+  {
+    return close_;
+  }
+
+  // the bytes of every held response, in order; valid until clear
+  std::vector<net::const_buffer> const&
+  buffers()
+  {
+    buffers_.clear();
+    for (auto& i: items_)
+      i->collect(buffers_);
+    return buffers_;
+  }
+
+  // closes the connection once the held responses are written, e.g. after
+  // the next request could not be read
+  void
+  close_after()
+  {
+    close_ = true;
+  }
+
+  void
+  clear()
+  {
+    buffers_.clear();
+    items_.clear();
+    close_ = false;
+  }
+};
+
+// anticrisis: whether the buffer already holds the header of another
+// request, which a pipelining client sent without waiting for the response.
+// Empty lines before it are skipped, as the parser does; anything else must
+// begin with a request line.
+inline bool
+has_pipelined_request(beast::flat_buffer const& buffer)
+{
+  std::string_view data{ static_cast<char const*>(buffer.data().data()),
+                         buffer.size() };
+  while (data.substr(0, 2) == "\r\n")
+    data.remove_prefix(2);
+  if (data.find("\r\n\r\n") == std::string_view::npos)
+    return false;
+
+  // method, target and version, separated by single spaces
+  auto const line   = data.substr(0, data.find("\r\n"));
+  auto const first  = line.find(' ');
+  auto const second = line.rfind(' ');
+  if (first == 0 || first == std::string_view::npos || second == first)
+    return false;
+  auto const printable = [](char c) { return c > ' ' && c < 0x7f; };
+  return std::all_of(line.begin(), line.begin() + first, printable)
+         && line.substr(second + 1, 5) == "HTTP/";
+}
+
+// anticrisis: copies a handler's header fields to a response. The first
+// field of each name replaces any the server has set, such as Content-Type;
+// later ones with the same name are added after it.
+template <class Fields>
+void
+set_fields(Fields& fields, headers&& hs)
+{
+  for (auto it = hs.begin(); it != hs.end(); ++it)
+    if (hs.find(it->first) == it)
+      fields.set(it->first, std::move(it->second));
+    else
+      fields.insert(it->first, std::move(it->second));
+}
+
+//------------------------------------------------------------------------------
+
+// This function produces an HTTP response for the given
+// request. The type of the response object depends on the
+// contents of the request, so the interface requires the
+// caller to pass a generic lambda for receiving the response.
+// anticrisis: remove support for doc_root and static files; add support for
+// alt_handler
+// anticrisis: body_file names the file holding the body if it was spooled
+template <class Body, class Allocator, class Send>
+void
+handle_request(alt_handler&                                         alt_handler,
+               http::request<Body, http::basic_fields<Allocator>>&& req,
+               Send&&                                               send,
+               std::string_view body_file = {})
+{
+  // Returns a bad request response
+  auto const bad_request = [&req](beast::string_view why) {
+    http::response<http::string_body> res{ http::status::bad_request,
+                                           req.version() };
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/html");
+    res.keep_alive(req.keep_alive());
+    res.body() = std::string(why);
+    res.prepare_payload();
+    return res;
+  };
+
+  // Returns a not found response
+  auto const not_found = [&req](beast::string_view target) {
+    http::response<http::string_body> res{ http::status::not_found,
+                                           req.version() };
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/html");
+    res.keep_alive(req.keep_alive());
+    res.body() = "The resource '" + std::string(target) + "' was not found.";
+    res.prepare_payload();
+    return res;
+  };
+
+  // Returns a server error response
+  auto const server_error = [&req](beast::string_view what) {
+    http::response<http::string_body> res{ http::status::internal_server_error,
+                                           req.version() };
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/html");
+    res.keep_alive(req.keep_alive());
+    res.body() = "An error occurred: '" + std::string(what) + "'";
+    res.prepare_payload();
+    return res;
+  };
+
+  // anticrisis
+  auto const send_no_content
+    = [&send, &req](int status, std::optional<headers>&& headers) {
+        http::response<http::empty_body> res{ static_cast<http::status>(status),
+                                              req.version() };
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        if (headers)
+          set_fields(res.base(), std::move(*headers));
+        res.keep_alive(req.keep_alive());
+        return send(std::move(res));
+      };
+
+  auto const send_empty = [&send, &req](int                      status,
+                                        std::optional<headers>&& headers,
+                                        size_t                   content_size,
+                                        std::string&&            content_type) {
+    http::response<http::empty_body> res{ static_cast<http::status>(status),
+                                          req.version() };
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, content_type);
+    if (content_size != alt_handler::unknown_size)
+      res.content_length(content_size);
+    if (headers)
+      set_fields(res.base(), std::move(*headers));
+    res.keep_alive(req.keep_alive());
+    return send(std::move(res));
+  };
+
+  auto const send_body = [&send, &req](int                      status,
+                                       std::optional<headers>&& headers,
+                                       response_body&&          body,
+                                       std::string&&            content_type) {
+    // a streamed body is sent chunk by chunk as it is produced
+    if (auto source = body.chunks(); source)
+    {
+      http::response<chunked_body> res{ static_cast<http::status>(status),
+                                        req.version() };
+      res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+      res.set(http::field::content_type, content_type);
+      if (headers)
+        set_fields(res.base(), std::move(*headers));
+      if (auto size = source->size(); size)
+        res.content_length(*size);
+      else
+        res.chunked(true);
+      res.body() = std::move(source);
+      res.keep_alive(req.keep_alive());
+      return send(std::move(res));
+    }
+
+    http::response<shared_body> res{ static_cast<http::status>(status),
+                                     req.version() };
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, content_type);
+    res.content_length(body.size());
+    if (headers)
+      set_fields(res.base(), std::move(*headers));
+    res.body() = std::move(body);
+    res.keep_alive(req.keep_alive());
+    return send(std::move(res));
+  };
+
+  // anticrisis: headers are read from the request only when asked for
+  headers_access get_headers{
+    [&req](headers_access::visitor const& visit) {
+      for (auto const& kv: req.base())
+        visit({ kv.name_string().data(), kv.name_string().size() },
+              { kv.value().data(), kv.value().size() });
+    },
+    [&req](std::string_view name) -> std::optional<std::string_view> {
+      auto it = req.base().find({ name.data(), name.size() });
+      if (it == req.base().end())
+        return std::nullopt;
+      return std::string_view{ it->value().data(), it->value().size() };
+    }
+  };
+  get_headers.body_file = body_file;
+  get_headers.received  = std::chrono::steady_clock::now();
+
+  // anticrisis: counts a request of method m, with the time since it was
+  // read
+  auto const count = [received = get_headers.received](router::method m,
+                                                       int            status) {
+    get_server_metrics().requests(m).record(
+      status,
+      std::chrono::steady_clock::now() - received);
+  };
+
+  // Make sure we can handle the method
+  // anticrisis: add methods
+  if (req.method() != http::verb::get && req.method() != http::verb::head
+      && req.method() != http::verb::post && req.method() != http::verb::put
+      && req.method() != http::verb::delete_
+      && req.method() != http::verb::options)
+    return send(bad_request("Unknown HTTP-method"));
+
+  // Request path must be absolute and not contain "..".
+  if (req.target().empty() || req.target()[0] != '/'
+      || req.target().find("..") != beast::string_view::npos)
+    return send(bad_request("Illegal request-target"));
+
+  // anticrisis: replace doc_root support with alt_handler
+  if (req.method() == http::verb::options)
+  {
+    auto [status, headers, body, content_type]
+      = alt_handler.options({ req.target().data(), req.target().size() },
+                            { req.body().data(), req.body().size() },
+                            std::move(get_headers));
+    count(router::method::options, status);
+    return send_body(status,
+                     std::move(headers),
+                     std::move(body),
+                     std::move(content_type));
+  }
+  else if (req.method() == http::verb::head)
+  {
+    auto [status, headers, size, content_type]
+      = alt_handler.head({ req.target().data(), req.target().size() },
+                         std::move(get_headers));
+    count(router::method::head, status);
+    return send_empty(status,
+                      std::move(headers),
+                      size,
+                      std::move(content_type));
+  }
+  else if (req.method() == http::verb::get)
+  {
+    auto [status, headers, body, content_type]
+      = alt_handler.get({ req.target().data(), req.target().size() },
+                        std::move(get_headers));
+    count(router::method::get, status);
+    return send_body(status,
+                     std::move(headers),
+                     std::move(body),
+                     std::move(content_type));
+  }
+  else if (req.method() == http::verb::post)
+  {
+    auto [status, headers, body, content_type]
+      = alt_handler.post({ req.target().data(), req.target().size() },
+                         { req.body().data(), req.body().size() },
+                         std::move(get_headers));
+    count(router::method::post, status);
+    return send_body(status,
+                     std::move(headers),
+                     std::move(body),
+                     std::move(content_type));
+  }
+  else if (req.method() == http::verb::put)
+  {
+    auto [status, headers]
+      = alt_handler.put({ req.target().data(), req.target().size() },
+                        { req.body().data(), req.body().size() },
+                        std::move(get_headers));
+    count(router::method::put, status);
+    return send_no_content(status, std::move(headers));
+  }
+  else if (req.method() == http::verb::delete_)
+  {
+    auto [status, headers, body, content_type]
+      = alt_handler.delete_({ req.target().data(), req.target().size() },
+                            { req.body().data(), req.body().size() },
+                            std::move(get_headers));
+    count(router::method::delete_, status);
+    return send_body(status,
+                     std::move(headers),
+                     std::move(body),
+                     std::move(content_type));
+  }
+
+  return send(server_error("not implemented."));
+}
+
+//------------------------------------------------------------------------------
+
+// anticrisis: response for connections turned away by admission control,
+// before any request has been read
+inline http::response<http::string_body>
+service_unavailable()
+{
+  http::response<http::string_body> res{ http::status::service_unavailable,
+                                         11 };
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.set(http::field::retry_after, "1");
+  res.keep_alive(false);
+  res.body() = "The server is too busy to accept the connection.";
+  res.prepare_payload();
+  return res;
+}
+
+// anticrisis: response for a request whose body is larger than allowed;
+// the connection is closed since the body is left unread
+inline http::response<http::string_body>
+payload_too_large()
+{
+  http::response<http::string_body> res{ http::status::payload_too_large,
+                                         11 };
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(false);
+  res.body() = "The request body is too large.";
+  res.prepare_payload();
+  return res;
+}
+
+// anticrisis: response for a request whose body could not be spooled; the
+// connection is closed since the body is left unread
+inline http::response<http::string_body>
+spool_failed()
+{
+  http::response<http::string_body> res{ http::status::internal_server_error,
+                                         11 };
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(false);
+  res.body() = "The request body could not be stored.";
+  res.prepare_payload();
+  return res;
+}
+
+// anticrisis: where a request body goes, decided from the request header
+enum class body_plan
+{
+  memory,
+  spool,
+  too_large
+};
+
+// anticrisis: an allocator drawing from a memory resource. Unlike
+// std::pmr::polymorphic_allocator it is assignable, as Beast's fields
+// require, and it moves with the container.
+template <class T>
+class arena_allocator
+{
+  std::pmr::memory_resource* resource_;
+
+public:
+  using value_type                             = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap            = std::true_type;
+
+  arena_allocator() noexcept : resource_(std::pmr::get_default_resource()) {}
+
+  arena_allocator(std::pmr::memory_resource* resource) noexcept
+      : resource_(resource)
+  {
+  }
+
+  template <class U>
+  arena_allocator(arena_allocator<U> const& other) noexcept
+      : resource_(other.resource())
+  {
+  }
+
+  T*
+  allocate(size_t n)
+  {
+    return static_cast<T*>(resource_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void
+  deallocate(T* p, size_t n) noexcept
+  {
+    resource_->deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  std::pmr::memory_resource*
+  resource() const noexcept
+  {
+    return resource_;
+  }
+
+  template <class U>
+  bool
+  operator==(arena_allocator<U> const& other) const noexcept
+  {
+    return resource_ == other.resource();
+  }
+
+  template <class U>
+  bool
+  operator!=(arena_allocator<U> const& other) const noexcept
+  {
+    return resource_ != other.resource();
+  }
+};
+
+// anticrisis: memory for the request being read, carved from a buffer owned
+// by the connection and given back in one step before the next request, so
+// a typical request's fields and body never reach the global heap. Larger
+// requests overflow to the heap until the next reset.
+class request_arena
+{
+public:
+  using allocator_type = arena_allocator<char>;
+
+  // big enough for the header and body of most requests
+  static constexpr size_t initial_size = 16 * 1024;
+
+  request_arena() = default;
+
+  request_arena(request_arena const&) = delete;
+  request_arena&
+  operator=(request_arena const&)
+    = delete;
+
+  allocator_type
+  allocator()
+  {
+    return &resource_;
+  }
+
+  // call once nothing allocated from the arena is in use
+  void
+  reset()
+  {
+    resource_.release();
+  }
+
+private:
+  alignas(std::max_align_t) std::array<std::byte, initial_size> buffer_;
+  std::pmr::monotonic_buffer_resource resource_{ buffer_.data(),
+                                                 buffer_.size() };
+};
+
+// anticrisis: requests are read into memory from a request_arena
+using arena_fields = http::basic_fields<request_arena::allocator_type>;
+using arena_body   = http::basic_string_body<char,
+                                           std::char_traits<char>,
+                                           request_arena::allocator_type>;
+using arena_request = http::request<arena_body, arena_fields>;
+
+template <class Body>
+using arena_parser = http::request_parser<Body, request_arena::allocator_type>;
+
+template <class Parser>
+body_plan
+plan_body(Parser const& header, body_options const& options)
+{
+  auto const length = header.content_length();
+  if (length && *length > options.max_size)
+    return body_plan::too_large;
+  if (options.spool_threshold > 0
+      && (length ? *length > options.spool_threshold : header.chunked()))
+    return body_plan::spool;
+  return body_plan::memory;
+}
+
+// anticrisis: a new temporary file for a spooled request body, removed
+// when this is destroyed
+class spool_file
+{
+  std::string path_;
+
+public:
+  spool_file() = default;
+
+  explicit spool_file(std::string_view dir)
+  {
+    static std::atomic<uint64_t> counter{ 0 };
+    static auto const            prefix = [] {
+      std::random_device r;
+      return "act_http_" + std::to_string(r()) + "_";
+    }();
+
+    auto const base = dir.empty() ? std::filesystem::temp_directory_path()
+                                  : std::filesystem::path{ dir };
+    path_ = (base / (prefix + std::to_string(counter++))).string();
+  }
+
+  ~spool_file() { remove(); }
+
+  spool_file(spool_file&& other) noexcept
+      : path_(std::exchange(other.path_, {}))
+  {
+  }
+
+  spool_file&
+  operator=(spool_file&& other) noexcept
+  {
+    if (this != &other)
+    {
+      remove();
+      path_ = std::exchange(other.path_, {});
+    }
+    return *this;
+  }
+
+  std::string const&
+  path() const
+  {
+    return path_;
+  }
+
+  void
+  remove()
+  {
+    if (path_.empty())
+      return;
+    std::error_code ec;
+    std::filesystem::remove(path_, ec);
+    path_.clear();
+  }
+};
+
+// Report a failure
+inline void
+fail(beast::error_code ec, char const* what)
+{
+  // anticrisis: ignore these common errors
+  if (ec == net::error::operation_aborted || ec == beast::error::timeout
+      || ec == net::error::connection_reset)
+    return;
+
+  std::cerr << what << ": " << ec.message() << "\n";
+}
+
+} // namespace http_tcl
@@ -0,0 +1,42 @@
+#pragma once
+#include "http_tcl/http_tcl.h"
+
+#include <string_view>
+
+// Helpers for reading the comma separated values of header fields, shared
+// by the compressor and the response cache.
+namespace http_tcl::header_tokens
+{
+inline bool
+iequals(std::string_view a, std::string_view b)
+{
+  return headers::iequals(a, b);
+}
+
+inline std::string_view
+trim(std::string_view s)
+{
+  while (! s.empty() && (s.front() == ' ' || s.front() == '\t'))
+    s.remove_prefix(1);
+  while (! s.empty() && (s.back() == ' ' || s.back() == '\t'))
+    s.remove_suffix(1);
+  return s;
+}
+
+// Calls f with each trimmed element of a comma separated header value.
+template <typename F>
+void
+for_each_token(std::string_view value, F&& f)
+{
+  for (;;)
+  {
+    auto comma = value.find(',');
+    if (auto token = trim(value.substr(0, comma)); ! token.empty())
+      f(token);
+    if (comma == std::string_view::npos)
+      break;
+    value.remove_prefix(comma + 1);
+  }
+}
+
+} // namespace http_tcl::header_tokens
@@ -0,0 +1,387 @@
+#include "http_client.h"
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <condition_variable>
+
+namespace http_tcl
+{
+using namespace client;
+
+namespace
+{
+class request_op;
+
+// Requests in flight, by id, so they can be cancelled.
+std::mutex                                    the_requests_mutex;
+std::map<uint64_t, std::weak_ptr<request_op>> the_requests;
+std::atomic<uint64_t>                         the_next_id{ 1 };
+
+// One request, driven by the pool's background thread. Like the
+// synchronous client, it reuses a pooled connection if there is one, and
+// retries on a new connection if a reused one fails before any of the
+// response arrives.
+class request_op : public std::enable_shared_from_this<request_op>
+{
+  using callback = std::function<void(client_result&&)>;
+
+  uint64_t                                                 id_;
+  std::string                                              host_;
+  std::string                                              port_;
+  std::string                                              key_;
+  http::verb                                               verb_;
+  http::request<http::string_body>                         req_;
+  std::chrono::milliseconds                                timeout_;
+  callback                                                 callback_;
+  tcp::resolver                                            resolver_;
+  net::steady_timer                                        timer_;
+  std::vector<tcp::endpoint>                               endpoints_;
+  std::optional<beast::tcp_stream>                         stream_;
+  beast::flat_buffer                                       buffer_;
+  std::optional<http::response_parser<http::dynamic_body>> parser_;
+  bool                                                     reused_{ false };
+  bool                                                     cancelled_{ false };
+  bool                                                     timed_out_{ false };
+  bool                                                     done_{ false };
+
+  // turns success into an error once the request has been given up
+  bool
+  aborted(beast::error_code& ec) const
+  {
+    if (! ec && (cancelled_ || timed_out_))
+      ec = net::error::operation_aborted;
+    return ec.failed();
+  }
+
+  void
+  attempt()
+  {
+    auto& pool   = the_pool();
+    auto  socket = pool.acquire(key_);
+    pool.count(socket.has_value());
+
+    reused_ = socket.has_value();
+    buffer_.clear();
+    if (reused_)
+    {
+      stream_.emplace(std::move(*socket));
+      return do_write();
+    }
+
+    stream_.emplace(pool.context());
+
+    // look up the domain name, unless the cache knows it
+    beast::error_code ec;
+    if (auto endpoints = the_resolver_cache().lookup(key_, ec); ec)
+      return fail(ec);
+    else if (endpoints)
+      return do_connect(std::move(*endpoints));
+
+    resolver_.async_resolve(
+      host_,
+      port_,
+      beast::bind_front_handler(&request_op::on_resolve, shared_from_this()));
+  }
+
+  void
+  on_resolve(beast::error_code ec, tcp::resolver::results_type results)
+  {
+    // an abandoned lookup says nothing about the name
+    if (! cancelled_ && ! timed_out_)
+      endpoints_ = the_resolver_cache().store(key_, results, ec);
+    if (aborted(ec))
+      return fail(ec);
+    do_connect(std::move(endpoints_));
+  }
+
+  void
+  do_connect(std::vector<tcp::endpoint> endpoints)
+  {
+    // the endpoints must outlive the operation
+    endpoints_ = std::move(endpoints);
+    stream_->async_connect(
+      endpoints_,
+      beast::bind_front_handler(&request_op::on_connect, shared_from_this()));
+  }
+
+  void
+  on_connect(beast::error_code ec, tcp::endpoint)
+  {
+    if (aborted(ec))
+      return fail(ec);
+    do_write();
+  }
+
+  void
+  do_write()
+  {
+    // a response to HEAD has no body, whatever its Content-Length says
+    parser_.emplace();
+    if (verb_ == http::verb::head)
+      parser_->skip(true);
+
+    http::async_write(
+      *stream_,
+      req_,
+      beast::bind_front_handler(&request_op::on_write, shared_from_this()));
+  }
+
+  void
+  on_write(beast::error_code ec, std::size_t)
+  {
+    if (aborted(ec))
+      return retry_or_fail(ec);
+
+    http::async_read(
+      *stream_,
+      buffer_,
+      *parser_,
+      beast::bind_front_handler(&request_op::on_read, shared_from_this()));
+  }
+
+  void
+  on_read(beast::error_code ec, std::size_t)
+  {
+    if (aborted(ec))
+      return retry_or_fail(ec);
+
+    auto& res = parser_->get();
+    if (res.keep_alive() && parser_->is_done())
+      the_pool().release(key_, stream_->release_socket());
+    else
+      stream_->socket().shutdown(tcp::socket::shutdown_both, ec);
+
+    finish({ static_cast<int>(res.result_int()),
+             to_headers(res.base()),
+             beast::buffers_to_string(res.body().data()) });
+  }
+
+  void
+  retry_or_fail(beast::error_code ec)
+  {
+    if (reused_ && ! parser_->got_some() && verb_ != http::verb::post
+        && ! cancelled_ && ! timed_out_)
+      return attempt();
+    fail(ec);
+  }
+
+  void
+  fail(beast::error_code ec)
+  {
+    if (timed_out_)
+      return finish({ 500, headers{}, "request timed out" });
+    if (cancelled_)
+      return finish({ 500, headers{}, "request cancelled" });
+    finish({ 500, headers{}, ec.message() });
+  }
+
+  void
+  finish(client_result&& result)
+  {
+    if (done_)
+      return;
+    done_ = true;
+    timer_.cancel();
+    {
+      std::lock_guard lock(the_requests_mutex);
+      the_requests.erase(id_);
+    }
+    callback_(std::move(result));
+  }
+
+public:
+  request_op(uint64_t                         id,
+             std::string                      host,
+             std::string                      port,
+             http::verb                       verb,
+             http::request<http::string_body> req,
+             std::chrono::milliseconds        timeout,
+             callback                         cb)
+      : id_(id)
+      , host_(std::move(host))
+      , port_(std::move(port))
+      , key_(host_ + ':' + port_)
+      , verb_(verb)
+      , req_(std::move(req))
+      , timeout_(timeout)
+      , callback_(std::move(cb))
+      , resolver_(the_pool().context())
+      , timer_(the_pool().context())
+  {
+  }
+
+  void
+  start()
+  {
+    if (timeout_.count() > 0)
+    {
+      timer_.expires_after(timeout_);
+      timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+        if (ec || self->done_)
+          return;
+        self->timed_out_ = true;
+        self->abort();
+      });
+    }
+    attempt();
+  }
+
+  // gives up the request; runs on the background thread
+  void
+  cancel()
+  {
+    cancelled_ = true;
+    abort();
+  }
+
+private:
+  void
+  abort()
+  {
+    resolver_.cancel();
+    if (stream_)
+      stream_->cancel();
+  }
+};
+
+} // namespace
+
+uint64_t
+http_client_async(std::string_view                     method,
+                  std::string                          host,
+                  std::string                          port,
+                  std::string                          target,
+                  std::optional<headers> const&        headers,
+                  std::string_view                     body,
+                  std::chrono::milliseconds            timeout,
+                  std::function<void(client_result&&)> callback)
+{
+  auto& pool = the_pool();
+  pool.run_in_background();
+
+  auto const id   = the_next_id++;
+  auto const verb = to_verb(method);
+  auto       req  = make_request(verb, host, target, headers, body);
+  auto       op   = std::make_shared<request_op>(id,
+                                         std::move(host),
+                                         std::move(port),
+                                         verb,
+                                         std::move(req),
+                                         timeout,
+                                         std::move(callback));
+  {
+    std::lock_guard lock(the_requests_mutex);
+    the_requests.emplace(id, op);
+  }
+  net::post(pool.context(), [op] { op->start(); });
+  return id;
+}
+
+std::vector<client_result>
+http_client_multi(std::vector<client_request> const& requests,
+                  std::chrono::milliseconds          timeout,
+                  int                                concurrency)
+{
+  struct batch
+  {
+    std::mutex                                mutex;
+    std::condition_variable                   cv;
+    std::vector<std::optional<client_result>> results;
+    std::size_t                               next{ 0 };
+    std::size_t                               done{ 0 };
+  };
+
+  auto const deadline = clock::now() + timeout;
+  auto const limit    = concurrency > 0
+                          ? std::min<std::size_t>(concurrency, requests.size())
+                          : requests.size();
+  auto       b        = std::make_shared<batch>();
+  b->results.resize(requests.size());
+
+  // starts the next request, or completes it at once if the deadline has
+  // passed; each completion starts another, keeping limit in flight
+  std::function<void()> start_next = [&] {
+    for (;;)
+    {
+      std::size_t n{ 0 };
+      {
+        std::lock_guard lock(b->mutex);
+        if (b->next == requests.size())
+          return;
+        n = b->next++;
+      }
+
+      auto remaining = std::chrono::milliseconds{ 0 };
+      if (timeout.count() > 0)
+      {
+        remaining = std::chrono::ceil<std::chrono::milliseconds>(
+          deadline - clock::now());
+        if (remaining.count() <= 0)
+        {
+          std::lock_guard lock(b->mutex);
+          b->results[n].emplace(500, headers{}, "request timed out");
+          ++b->done;
+          continue;
+        }
+      }
+
+      auto const& req = requests[n];
+      http_client_async(req.method,
+                        req.host,
+                        req.port,
+                        req.target,
+                        req.headers,
+                        req.body,
+                        remaining,
+                        [b, n, &start_next](client_result&& result) {
+                          {
+                            std::lock_guard lock(b->mutex);
+                            b->results[n].emplace(std::move(result));
+                          }
+
+                          // start_next lives until the batch is done, so
+                          // call it before counting this request
+                          start_next();
+
+                          std::lock_guard lock(b->mutex);
+                          ++b->done;
+                          b->cv.notify_one();
+                        });
+      return;
+    }
+  };
+
+  for (std::size_t n = 0; n < limit; ++n)
+    start_next();
+
+  std::vector<client_result> results;
+  {
+    std::unique_lock lock(b->mutex);
+    b->cv.wait(lock, [&] { return b->done == requests.size(); });
+    results.reserve(requests.size());
+    for (auto& result: b->results)
+      results.push_back(std::move(*result));
+  }
+  return results;
+}
+
+bool
+http_client_cancel(uint64_t id)
+{
+  std::shared_ptr<request_op> op;
+  {
+    std::lock_guard lock(the_requests_mutex);
+    auto            it = the_requests.find(id);
+    if (it == the_requests.end())
+      return false;
+    op = it->second.lock();
+  }
+  if (! op)
+    return false;
+
+  net::post(the_pool().context(), [op] { op->cancel(); });
+  return true;
+}
+
+} // namespace http_tcl
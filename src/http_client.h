@@ -0,0 +1,339 @@
+#pragma once
+#include "http_tcl/http_tcl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace http_tcl
+{
+namespace client
+{
+namespace beast = boost::beast; // from <boost/beast.hpp>
+namespace http  = beast::http;  // from <boost/beast/http.hpp>
+namespace net   = boost::asio;  // from <boost/asio.hpp>
+using tcp       = net::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+using clock     = std::chrono::steady_clock;
+
+// Process-wide pool of idle keep-alive connections, keyed by host:port.
+// Pooled sockets belong to one io_context, which the synchronous client uses
+// directly and the asynchronous client runs on a background thread.
+class connection_pool
+{
+  struct idle_connection
+  {
+    tcp::socket       socket;
+    clock::time_point since;
+  };
+
+  net::io_context                                    ioc_;
+  std::once_flag                                     started_;
+  std::thread                                        thread_;
+  std::mutex                                         mutex_;
+  client_pool_options                                options_;
+  std::map<std::string, std::deque<idle_connection>> idle_;
+  int                                                idle_count_{ 0 };
+  std::atomic<uint64_t>                              hits_{ 0 };
+  std::atomic<uint64_t>                              misses_{ 0 };
+
+  // drops connections idle for too long; call with the mutex held
+  void
+  expire(clock::time_point now)
+  {
+    for (auto it = idle_.begin(); it != idle_.end();)
+    {
+      auto& conns = it->second;
+      while (! conns.empty()
+             && now - conns.front().since >= options_.idle_timeout)
+      {
+        conns.pop_front();
+        --idle_count_;
+      }
+      it = conns.empty() ? idle_.erase(it) : std::next(it);
+    }
+  }
+
+public:
+  ~connection_pool()
+  {
+    if (thread_.joinable())
+    {
+      ioc_.stop();
+      thread_.join();
+    }
+  }
+
+  net::io_context&
+  context()
+  {
+    return ioc_;
+  }
+
+  // Starts the background thread which runs asynchronous requests, once.
+  void
+  run_in_background()
+  {
+    std::call_once(started_, [this] {
+      thread_ = std::thread{ [this] {
+        auto work = net::make_work_guard(ioc_);
+        ioc_.run();
+      } };
+    });
+  }
+
+  void
+  set_options(client_pool_options const& options)
+  {
+    std::lock_guard lock(mutex_);
+    options_ = options;
+    expire(clock::now());
+    for (auto& [key, conns]: idle_)
+      while (static_cast<int>(conns.size()) > options_.max_idle_per_host)
+      {
+        conns.pop_front();
+        --idle_count_;
+      }
+  }
+
+  client_pool_stats
+  stats()
+  {
+    std::lock_guard lock(mutex_);
+    return { hits_, misses_, idle_count_ };
+  }
+
+  // True unless the server has closed the connection, or sent something
+  // unexpected, while it was idle.
+  static bool
+  alive(tcp::socket& socket)
+  {
+    beast::error_code ec, ignored;
+    char              c;
+    socket.non_blocking(true, ignored);
+    auto n = socket.receive(net::buffer(&c, 1), tcp::socket::message_peek, ec);
+    socket.non_blocking(false, ignored);
+    return n == 0 && ec == net::error::would_block;
+  }
+
+  // the most recently used idle connection to key which is still open, if
+  // any
+  std::optional<tcp::socket>
+  acquire(std::string const& key)
+  {
+    std::lock_guard lock(mutex_);
+    expire(clock::now());
+    auto it = idle_.find(key);
+    if (it == idle_.end())
+      return std::nullopt;
+
+    std::optional<tcp::socket> socket;
+    auto&                      conns = it->second;
+    while (! socket && ! conns.empty())
+    {
+      if (alive(conns.back().socket))
+        socket.emplace(std::move(conns.back().socket));
+      conns.pop_back();
+      --idle_count_;
+    }
+    if (conns.empty())
+      idle_.erase(it);
+    return socket;
+  }
+
+  void
+  release(std::string const& key, tcp::socket&& socket)
+  {
+    std::lock_guard lock(mutex_);
+    auto            now = clock::now();
+    expire(now);
+    if (options_.max_idle_per_host <= 0)
+      return;
+
+    auto& conns = idle_[key];
+    if (static_cast<int>(conns.size()) >= options_.max_idle_per_host)
+    {
+      conns.pop_front();
+      --idle_count_;
+    }
+    conns.push_back({ std::move(socket), now });
+    ++idle_count_;
+  }
+
+  void
+  count(bool reused)
+  {
+    ++(reused ? hits_ : misses_);
+  }
+};
+
+// Process-wide cache of name lookups, keyed by host:port. Addresses are kept
+// for the TTL and failed lookups for the failure TTL; zero disables either.
+// Each use of an entry starts from the next of its addresses, spreading new
+// connections across hosts which have several.
+class resolver_cache
+{
+  struct entry
+  {
+    std::vector<tcp::endpoint> endpoints;
+    beast::error_code          error;
+    clock::time_point          expires;
+    std::size_t                next{ 0 };
+  };
+
+  std::mutex                   mutex_;
+  std::chrono::milliseconds    ttl_{ 60000 };
+  std::chrono::milliseconds    failure_ttl_{ 5000 };
+  std::map<std::string, entry> entries_;
+  std::atomic<uint64_t>        hits_{ 0 };
+  std::atomic<uint64_t>        misses_{ 0 };
+
+  // call with the mutex held
+  void
+  expire(clock::time_point now)
+  {
+    for (auto it = entries_.begin(); it != entries_.end();)
+      it = it->second.expires <= now ? entries_.erase(it) : std::next(it);
+  }
+
+  static std::vector<tcp::endpoint>
+  rotate(entry& e)
+  {
+    auto endpoints = e.endpoints;
+    if (! endpoints.empty())
+    {
+      std::rotate(endpoints.begin(),
+                  endpoints.begin() + e.next % endpoints.size(),
+                  endpoints.end());
+      e.next = (e.next + 1) % endpoints.size();
+    }
+    return endpoints;
+  }
+
+public:
+  void
+  set_ttl(std::chrono::milliseconds ttl, std::chrono::milliseconds failure_ttl)
+  {
+    std::lock_guard lock(mutex_);
+    ttl_         = ttl;
+    failure_ttl_ = failure_ttl;
+    entries_.clear();
+  }
+
+  // The addresses of key, or in ec the error of a failed lookup; nullopt
+  // if there is no fresh entry and the name must be looked up.
+  std::optional<std::vector<tcp::endpoint>>
+  lookup(std::string const& key, beast::error_code& ec)
+  {
+    std::lock_guard lock(mutex_);
+    auto            it = entries_.find(key);
+    if (it == entries_.end() || it->second.expires <= clock::now())
+    {
+      ++misses_;
+      return std::nullopt;
+    }
+
+    ++hits_;
+    ec = it->second.error;
+    return rotate(it->second);
+  }
+
+  // keeps the outcome of a lookup, and returns its addresses
+  std::vector<tcp::endpoint>
+  store(std::string const&                 key,
+        tcp::resolver::results_type const& results,
+        beast::error_code                  ec)
+  {
+    entry e;
+    e.error = ec;
+    if (! ec)
+      for (auto const& r: results)
+        e.endpoints.push_back(r.endpoint());
+
+    std::lock_guard lock(mutex_);
+    auto const      now = clock::now();
+    auto const      ttl = ec ? failure_ttl_ : ttl_;
+    expire(now);
+    if (ttl.count() <= 0)
+      return e.endpoints;
+
+    e.expires = now + ttl;
+    auto& kept = entries_[key] = std::move(e);
+    return rotate(kept);
+  }
+
+  std::vector<client_dns_entry>
+  entries()
+  {
+    std::lock_guard lock(mutex_);
+    auto const      now = clock::now();
+    expire(now);
+
+    std::vector<client_dns_entry> res;
+    for (auto const& [key, e]: entries_)
+    {
+      client_dns_entry out;
+      out.key = key;
+      for (auto const& ep: e.endpoints)
+        out.addresses.push_back(ep.address().to_string());
+      if (e.error)
+        out.error = e.error.message();
+      out.ttl = std::chrono::duration_cast<std::chrono::milliseconds>(
+        e.expires - now);
+      res.push_back(std::move(out));
+    }
+    return res;
+  }
+
+  void
+  flush()
+  {
+    std::lock_guard lock(mutex_);
+    entries_.clear();
+  }
+
+  uint64_t
+  hits() const
+  {
+    return hits_;
+  }
+
+  uint64_t
+  misses() const
+  {
+    return misses_;
+  }
+};
+
+connection_pool&
+the_pool();
+
+resolver_cache&
+the_resolver_cache();
+
+http::verb
+to_verb(std::string_view method);
+
+http::request<http::string_body>
+make_request(http::verb                    verb,
+             std::string const&            host,
+             std::string const&            target,
+             std::optional<headers> const& headers,
+             std::string_view              body);
+
+headers
+to_headers(http::fields const& fields);
+
+} // namespace client
+} // namespace http_tcl
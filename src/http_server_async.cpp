@@ -0,0 +1,637 @@
+//
+// Copyright (c) 2016-2019 Vinnie Falco (vinnie dot falco at gmail dot com)
+// Portions Copyright (c) 2021 anticrisis <https://github.com/anticrisis>
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Official repository: https://github.com/boostorg/beast
+//
+
+//------------------------------------------------------------------------------
+//
+// Example: HTTP server, asynchronous
+//
+// Changes by anticrisis marked with 'anticrisis'
+//
+//------------------------------------------------------------------------------
+
+// anticrisis: include header
+#include "admission.h"
+#include "handle_request.h"
+#include "http_tcl/http_tcl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/config.hpp>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// anticrisis: add namespace
+namespace http_tcl
+{
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http  = beast::http;          // from <boost/beast/http.hpp>
+namespace net   = boost::asio;          // from <boost/asio.hpp>
+using tcp       = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+
+namespace
+{
+class listener;
+
+// anticrisis: how long a connection may wait for the client to send, or to
+// take, the next piece of a request or response
+constexpr auto timeout = std::chrono::seconds(30);
+
+void
+send_unavailable(tcp::socket&& socket);
+
+// Handles an HTTP server connection
+class session : public std::enable_shared_from_this<session>
+{
+  // This is the C++11 equivalent of a generic lambda.
+  // The function object is used to send an HTTP message.
+  struct send_lambda
+  {
+    session& self_;
+
+    explicit send_lambda(session& self) : self_(self) {}
+
+    // anticrisis: responses are held in the batch until do_write, except
+    // streamed ones, which do_write sends after the batch
+    template <bool isRequest, class Body, class Fields>
+    void
+    operator()(http::message<isRequest, Body, Fields>&& msg) const
+    {
+      if constexpr (! isRequest && is_batchable<Body>::value)
+        self_.batch_.push(std::move(msg));
+      else
+      {
+        // The lifetime of the message has to extend
+        // for the duration of the async operation so
+        // we use a shared_ptr to manage it.
+        auto sp = std::make_shared<http::message<isRequest, Body, Fields>>(
+          std::move(msg));
+
+        // Store a type-erased version of the shared
+        // pointer in the class to keep it alive.
+        self_.res_ = sp;
+
+        // Write the response
+        // anticrisis: a piece at a time, see write_streamed
+        self_.write_alone_ = [sp](session& self) {
+          using serializer = http::serializer<isRequest, Body, Fields>;
+          self.write_streamed(std::make_shared<serializer>(*sp),
+                              sp->need_eof(),
+                              0);
+        };
+      }
+    }
+  };
+
+  beast::tcp_stream     stream_;
+  beast::flat_buffer    buffer_;
+  std::shared_ptr<void> res_;
+  send_lambda           lambda_;
+
+  // anticrisis: responses waiting to be written together, the write of a
+  // streamed response which follows them, and when the current write began
+  response_batch                        batch_;
+  std::function<void(session& self)>    write_alone_;
+  std::chrono::steady_clock::time_point write_started_;
+
+  // anticrisis: replace doc_root with alt_handler; keep the listener alive
+  // so it can be told when this connection closes
+  alt_handler*              alt_handler_;
+  std::shared_ptr<listener> listener_;
+
+  // anticrisis: the header is read first, to decide whether the body is
+  // refused, read into memory or spooled to a file; each request is read
+  // into memory from the arena
+  body_options const&                           body_;
+  request_arena                                 arena_;
+  std::optional<arena_parser<http::empty_body>> header_;
+  std::optional<arena_parser<arena_body>>       parser_;
+  std::optional<arena_parser<http::file_body>>  spool_parser_;
+  spool_file                                    spool_;
+
+public:
+  // Take ownership of the stream
+  session(tcp::socket&&             socket,
+          alt_handler*              alt_handler,
+          std::shared_ptr<listener> listener,
+          body_options const&       body)
+      : stream_(std::move(socket))
+      , lambda_(*this)
+      , alt_handler_(alt_handler)
+      , listener_(std::move(listener))
+      , body_(body)
+  {
+  }
+
+  ~session();
+
+  // Start the asynchronous operation
+  void
+  run()
+  {
+    // We need to be executing within a strand to perform async operations
+    // on the I/O objects in this session. Although not strictly necessary
+    // for single-threaded contexts, this example code is written to be
+    // thread-safe by default.
+    net::dispatch(
+      stream_.get_executor(),
+      beast::bind_front_handler(&session::do_read, shared_from_this()));
+  }
+
+  void
+  do_read()
+  {
+    // anticrisis: drop the previous request's parsers and spooled body,
+    // then its memory
+    header_.reset();
+    parser_.reset();
+    spool_parser_.reset();
+    spool_.remove();
+    arena_.reset();
+    header_.emplace(std::piecewise_construct,
+                    std::make_tuple(),
+                    std::make_tuple(arena_.allocator()));
+
+    // Set the timeout.
+    stream_.expires_after(timeout);
+
+    // Read a request
+    // anticrisis: read the header alone
+    http::async_read_header(
+      stream_,
+      buffer_,
+      *header_,
+      beast::bind_front_handler(&session::on_read_header, shared_from_this()));
+  }
+
+  // anticrisis: read the body into memory or a file, or refuse it
+  void
+  on_read_header(beast::error_code ec, std::size_t bytes_transferred)
+  {
+    // anticrisis: count the bytes of each request
+    get_server_metrics().bytes_in += bytes_transferred;
+
+    if (ec)
+      return end_read(ec);
+
+    switch (plan_body(*header_, body_))
+    {
+    case body_plan::too_large:
+      lambda_(payload_too_large());
+      return do_write();
+    case body_plan::spool:
+      spool_ = spool_file{ body_.spool_dir };
+      spool_parser_.emplace(std::move(*header_));
+      spool_parser_->body_limit(body_.max_size);
+      spool_parser_->get().body().open(spool_.path().c_str(),
+                                       beast::file_mode::write_new,
+                                       ec);
+      if (ec)
+      {
+        fail(ec, "spool");
+        lambda_(spool_failed());
+        return do_write();
+      }
+      return do_read_body(*spool_parser_);
+    case body_plan::memory:
+      parser_.emplace(std::move(*header_), arena_.allocator());
+      parser_->body_limit(body_.max_size);
+      return do_read_body(*parser_);
+    }
+  }
+
+  // anticrisis: read the body a piece at a time, each with its own deadline,
+  // so that a large upload is cut off only when the client stops sending
+  template <class Parser>
+  void
+  do_read_body(Parser& parser)
+  {
+    if (parser.is_done())
+      return on_read({});
+
+    stream_.expires_after(timeout);
+    http::async_read_some(
+      stream_,
+      buffer_,
+      parser,
+      [self = shared_from_this(), &parser](
+        beast::error_code ec, std::size_t bytes_transferred) {
+        get_server_metrics().bytes_in += bytes_transferred;
+        if (ec)
+          return self->on_read(ec);
+        self->do_read_body(parser);
+      });
+  }
+
+  void
+  on_read(beast::error_code ec)
+  {
+    // anticrisis: a chunked body may turn out to be too large
+    if (ec == http::error::body_limit)
+    {
+      lambda_(payload_too_large());
+      return do_write();
+    }
+
+    if (ec)
+      return end_read(ec);
+
+    // Send the response
+    // anticrisis: the handler runs on this I/O thread
+    if (spool_parser_)
+    {
+      spool_parser_->get().body().close();
+      handle_request(*alt_handler_,
+                     arena_request{ std::move(spool_parser_->release().base()),
+                                    arena_.allocator() },
+                     lambda_,
+                     spool_.path());
+    }
+    else
+      handle_request(*alt_handler_, parser_->release(), lambda_);
+
+    // anticrisis: answer the requests a pipelining client has already sent
+    // before writing, so that their responses go out together
+    if (! write_alone_ && ! batch_.close()
+        && batch_.size() < response_batch::max_size
+        && has_pipelined_request(buffer_))
+      return do_read();
+    do_write();
+  }
+
+  // anticrisis: a read error ends the connection, but the responses held
+  // for the requests read before it are still sent
+  void
+  end_read(beast::error_code ec)
+  {
+    // This means they closed the connection
+    if (ec != http::error::end_of_stream)
+      fail(ec, "read");
+
+    if (batch_.empty())
+      return do_close();
+    batch_.close_after();
+    do_write();
+  }
+
+  // anticrisis: write the held responses with one gathered write, then a
+  // streamed response if there is one
+  void
+  do_write()
+  {
+    write_started_ = std::chrono::steady_clock::now();
+    stream_.expires_after(timeout);
+    if (! batch_.empty())
+      return net::async_write(
+        stream_,
+        batch_.buffers(),
+        beast::bind_front_handler(&session::on_write_batch,
+                                  shared_from_this()));
+
+    if (auto write = std::exchange(write_alone_, nullptr); write)
+      write(*this);
+  }
+
+  void
+  on_write_batch(beast::error_code ec, std::size_t bytes_transferred)
+  {
+    record_write(bytes_transferred);
+
+    if (ec)
+      return fail(ec, "write");
+
+    auto const close = batch_.close();
+    batch_.clear();
+    if (close)
+      return do_close();
+    if (write_alone_)
+      return do_write();
+
+    do_read();
+  }
+
+  // anticrisis: write a streamed response a piece at a time, each with its
+  // own deadline, so that a long stream is cut off only when a chunk takes
+  // too long to produce or the client stops taking it
+  template <class Serializer>
+  void
+  write_streamed(std::shared_ptr<Serializer> sr, bool close, std::size_t sent)
+  {
+    stream_.expires_after(timeout);
+    http::async_write_some(
+      stream_,
+      *sr,
+      [self = shared_from_this(), sr, close, sent](
+        beast::error_code ec, std::size_t bytes_transferred) {
+        if (! ec && ! sr->is_done())
+          return self->write_streamed(sr, close, sent + bytes_transferred);
+        self->on_write(close, ec, sent + bytes_transferred);
+      });
+  }
+
+  void
+  on_write(bool close, beast::error_code ec, std::size_t bytes_transferred)
+  {
+    record_write(bytes_transferred);
+
+    if (ec)
+      return fail(ec, "write");
+
+    if (close)
+    {
+      // This means we should close the connection, usually because
+      // the response indicated the "Connection: close" semantic.
+      return do_close();
+    }
+
+    // We're done with the response so delete it
+    res_ = nullptr;
+
+    // Read another request
+    do_read();
+  }
+
+  // anticrisis: adds the write begun by do_write to the server metrics
+  void
+  record_write(std::size_t bytes_transferred)
+  {
+    auto& metrics = get_server_metrics();
+    metrics.bytes_out += bytes_transferred;
+    metrics.write.record(std::chrono::steady_clock::now() - write_started_);
+  }
+
+  void
+  do_close()
+  {
+    // Send a TCP shutdown
+    beast::error_code ec;
+    stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+
+    // At this point the connection is closed gracefully
+  }
+};
+
+//------------------------------------------------------------------------------
+
+// Accepts incoming connections and launches the sessions
+class listener : public std::enable_shared_from_this<listener>
+{
+  net::io_context& ioc_;
+  tcp::acceptor    acceptor_;
+
+  // anticrisis: replace doc_root with alt_handler; instead of accepting
+  // without limit, stop accepting while admission control has no room and
+  // resume when a session closes
+  alt_handler*                   alt_handler_;
+  admission_control<tcp::socket> admission_;
+  std::atomic_flag               accepting_ = ATOMIC_FLAG_INIT;
+  std::atomic<bool>              stopping_{ false };
+  body_options                   body_;
+
+  using decision = admission_control<tcp::socket>::decision;
+
+public:
+  listener(net::io_context&         ioc,
+           tcp::endpoint            endpoint,
+           alt_handler*             alt_handler,
+           admission_options const& admission,
+           body_options const&      body)
+      : ioc_(ioc)
+      , acceptor_(net::make_strand(ioc))
+      , alt_handler_(alt_handler)
+      , admission_(admission)
+      , body_(body)
+  {
+    // anticrisis: throw instead of reporting, so run_async can return an
+    // error like run does
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(net::socket_base::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen(net::socket_base::max_listen_connections);
+  }
+
+  // Start accepting incoming connections
+  void
+  run()
+  {
+    accepting_.test_and_set();
+    do_accept();
+  }
+
+  // anticrisis: stop accepting; sessions destroyed from now on close the
+  // queued connections instead of handing them their slot
+  void
+  stop()
+  {
+    stopping_ = true;
+    net::post(acceptor_.get_executor(), [self = shared_from_this()] {
+      beast::error_code ec;
+      self->acceptor_.close(ec);
+    });
+  }
+
+  // anticrisis: called by each session as it is destroyed; a queued
+  // connection takes over its slot
+  void
+  on_session_closed()
+  {
+    if (stopping_)
+      return admission_.release_stopping();
+
+    if (auto next = admission_.release(); next)
+      std::make_shared<session>(std::move(*next),
+                                alt_handler_,
+                                shared_from_this(),
+                                body_)
+        ->run();
+
+    if (admission_.has_room() && ! accepting_.test_and_set())
+      net::post(
+        acceptor_.get_executor(),
+        beast::bind_front_handler(&listener::do_accept, shared_from_this()));
+  }
+
+private:
+  void
+  do_accept()
+  {
+    // The new connection gets its own strand
+    acceptor_.async_accept(
+      net::make_strand(ioc_),
+      beast::bind_front_handler(&listener::on_accept, shared_from_this()));
+  }
+
+  void
+  on_accept(beast::error_code ec, tcp::socket socket)
+  {
+    // anticrisis: the acceptor was closed by stop
+    if (stopping_)
+      return;
+
+    if (ec)
+    {
+      fail(ec, "accept");
+    }
+    else
+    {
+      switch (admission_.offer(socket))
+      {
+      case decision::admit:
+        // Create the session and run it
+        std::make_shared<session>(std::move(socket),
+                                  alt_handler_,
+                                  shared_from_this(),
+                                  body_)
+          ->run();
+        break;
+      case decision::queue: break;
+      case decision::reject: send_unavailable(std::move(socket)); break;
+      case decision::close: break;
+      }
+    }
+
+    // anticrisis: pause accepting while there is no room; the next session
+    // to close starts accepting again
+    if (! admission_.has_room())
+    {
+      accepting_.clear();
+      if (! admission_.has_room() || accepting_.test_and_set())
+        return;
+    }
+
+    // Accept another connection
+    do_accept();
+  }
+};
+
+session::~session() { listener_->on_session_closed(); }
+
+// anticrisis: refuse a connection which could not be admitted
+void
+send_unavailable(tcp::socket&& socket)
+{
+  struct state
+  {
+    beast::tcp_stream                 stream;
+    http::response<http::string_body> res;
+  };
+
+  auto sp = std::make_shared<state>(
+    state{ beast::tcp_stream{ std::move(socket) }, service_unavailable() });
+  sp->stream.expires_after(std::chrono::seconds(5));
+  http::async_write(sp->stream, sp->res, [sp](beast::error_code, std::size_t) {
+    beast::error_code ec;
+    sp->stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+  });
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+
+// anticrisis: replace main with a server object which runs until stopped
+
+struct server::impl
+{
+  net::io_context           ioc;
+  std::shared_ptr<listener> listener_;
+  std::vector<std::thread>  threads;
+
+  explicit impl(int threads) : ioc{ threads } {}
+};
+
+server::server(std::string_view         address_,
+               unsigned short           port,
+               alt_handler*             alt_handler,
+               int                      io_threads,
+               admission_options const& admission,
+               body_options const&      body)
+{
+  auto const address = net::ip::make_address(address_);
+  auto const threads = std::max<int>(1, io_threads);
+
+  // The io_context is required for all I/O
+  impl_ = std::make_unique<impl>(threads);
+
+  // Create and launch a listening port
+  impl_->listener_ = std::make_shared<listener>(impl_->ioc,
+                                               tcp::endpoint{ address, port },
+                                               alt_handler,
+                                               admission,
+                                               body);
+  impl_->listener_->run();
+
+  // Run the I/O service on the requested number of threads
+  impl_->threads.reserve(threads);
+  for (auto i = threads; i > 0; --i)
+    impl_->threads.emplace_back([&ioc = impl_->ioc] { ioc.run(); });
+}
+
+server::~server() { stop(); }
+
+void
+server::stop()
+{
+  if (! impl_)
+    return;
+
+  impl_->listener_->stop();
+  impl_->ioc.stop();
+  wait();
+
+  // destroys the sessions still owned by pending operations
+  impl_.reset();
+}
+
+void
+server::wait()
+{
+  if (! impl_)
+    return;
+
+  for (auto& t: impl_->threads)
+    if (t.joinable())
+      t.join();
+}
+
+// anticrisis: change main to run_async; remove doc_root
+int
+run_async(std::string_view         address_,
+          unsigned short           port,
+          alt_handler*             alt_handler,
+          int                      io_threads,
+          admission_options const& admission,
+          body_options const&      body)
+{
+  try
+  {
+    server s{ address_, port, alt_handler, io_threads, admission, body };
+    s.wait();
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+} // namespace http_tcl
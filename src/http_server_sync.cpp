@@ -17,6 +17,8 @@
 //------------------------------------------------------------------------------
 
 // anticrisis: include header
+#include "admission.h"
+#include "handle_request.h"
 #include "http_tcl/http_tcl.h"
 
 #include <atomic>
@@ -39,226 +41,36 @@ namespace http  = beast::http;          // from <boost/beast/http.hpp>
 namespace net   = boost::asio;          // from <boost/asio.hpp>
 using tcp       = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 
-// anticrisis: add thread_count
-std::atomic<int> thread_count;
+// anticrisis: connection counters shared by both servers
+admission_counters the_admission_counters;
 
-//------------------------------------------------------------------------------
-
-// This function produces an HTTP response for the given
-// request. The type of the response object depends on the
-// contents of the request, so the interface requires the
-// caller to pass a generic lambda for receiving the response.
-// anticrisis: remove support for doc_root and static files; add support for
-// alt_handler
-template <class Body, class Allocator, class Send>
-void
-handle_request(alt_handler&                                         alt_handler,
-               http::request<Body, http::basic_fields<Allocator>>&& req,
-               Send&&                                               send)
-{
-  // Returns a bad request response
-  auto const bad_request = [&req](beast::string_view why) {
-    http::response<http::string_body> res{ http::status::bad_request,
-                                           req.version() };
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, "text/html");
-    res.keep_alive(req.keep_alive());
-    res.body() = std::string(why);
-    res.prepare_payload();
-    return res;
-  };
-
-  // Returns a not found response
-  auto const not_found = [&req](beast::string_view target) {
-    http::response<http::string_body> res{ http::status::not_found,
-                                           req.version() };
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, "text/html");
-    res.keep_alive(req.keep_alive());
-    res.body() = "The resource '" + std::string(target) + "' was not found.";
-    res.prepare_payload();
-    return res;
-  };
-
-  // Returns a server error response
-  auto const server_error = [&req](beast::string_view what) {
-    http::response<http::string_body> res{ http::status::internal_server_error,
-                                           req.version() };
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, "text/html");
-    res.keep_alive(req.keep_alive());
-    res.body() = "An error occurred: '" + std::string(what) + "'";
-    res.prepare_payload();
-    return res;
-  };
-
-  // anticrisis
-  auto const send_no_content
-    = [&send, &req](int status, std::optional<headers>&& headers) {
-        http::response<http::empty_body> res{ static_cast<http::status>(status),
-                                              req.version() };
-        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-        if (headers)
-          for (auto& kv: *headers)
-          {
-            res.base().set(kv.first, std::move(kv.second));
-          }
-        res.keep_alive(req.keep_alive());
-        return send(std::move(res));
-      };
-
-  auto const send_empty = [&send, &req](int                      status,
-                                        std::optional<headers>&& headers,
-                                        size_t                   content_size,
-                                        std::string&&            content_type) {
-    http::response<http::empty_body> res{ static_cast<http::status>(status),
-                                          req.version() };
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, content_type);
-    res.content_length(content_size);
-    if (headers)
-      for (auto& kv: *headers)
-      {
-        res.base().set(kv.first, std::move(kv.second));
-      }
-    res.keep_alive(req.keep_alive());
-    return send(std::move(res));
-  };
-
-  auto const send_body = [&send, &req](int                      status,
-                                       std::optional<headers>&& headers,
-                                       std::string&&            body,
-                                       std::string&&            content_type) {
-    http::response<http::string_body> res{ static_cast<http::status>(status),
-                                           req.version() };
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, content_type);
-    res.content_length(body.size());
-    if (headers)
-      for (auto& kv: *headers)
-      {
-        res.base().set(kv.first, std::move(kv.second));
-      }
-    res.body() = std::move(body);
-    res.keep_alive(req.keep_alive());
-    return send(std::move(res));
-  };
-
-  auto get_headers = [&req]() {
-    http_tcl::headers hs;
-    for (auto const& kv: req.base())
-    {
-      hs.emplace(kv.name_string(), kv.value());
-    }
-    return hs;
-  };
-
-  // Make sure we can handle the method
-  // anticrisis: add methods
-  if (req.method() != http::verb::get && req.method() != http::verb::head
-      && req.method() != http::verb::post && req.method() != http::verb::put
-      && req.method() != http::verb::delete_
-      && req.method() != http::verb::options)
-    return send(bad_request("Unknown HTTP-method"));
-
-  // Request path must be absolute and not contain "..".
-  if (req.target().empty() || req.target()[0] != '/'
-      || req.target().find("..") != beast::string_view::npos)
-    return send(bad_request("Illegal request-target"));
-
-  // anticrisis: replace doc_root support with alt_handler
-  if (req.method() == http::verb::options)
-  {
-    auto [status, headers, body, content_type]
-      = alt_handler.options({ req.target().data(), req.target().size() },
-                            { req.body().data(), req.body().size() },
-                            std::move(get_headers));
-    return send_body(status,
-                     std::move(headers),
-                     std::move(body),
-                     std::move(content_type));
-  }
-  else if (req.method() == http::verb::head)
-  {
-    auto [status, headers, size, content_type]
-      = alt_handler.head({ req.target().data(), req.target().size() },
-                         std::move(get_headers));
-    return send_empty(status,
-                      std::move(headers),
-                      size,
-                      std::move(content_type));
-  }
-  else if (req.method() == http::verb::get)
-  {
-    auto [status, headers, body, content_type]
-      = alt_handler.get({ req.target().data(), req.target().size() },
-                        std::move(get_headers));
-    return send_body(status,
-                     std::move(headers),
-                     std::move(body),
-                     std::move(content_type));
-  }
-  else if (req.method() == http::verb::post)
-  {
-    auto [status, headers, body, content_type]
-      = alt_handler.post({ req.target().data(), req.target().size() },
-                         { req.body().data(), req.body().size() },
-                         std::move(get_headers));
-    return send_body(status,
-                     std::move(headers),
-                     std::move(body),
-                     std::move(content_type));
-  }
-  else if (req.method() == http::verb::put)
-  {
-    auto [status, headers]
-      = alt_handler.put({ req.target().data(), req.target().size() },
-                        { req.body().data(), req.body().size() },
-                        std::move(get_headers));
-    return send_no_content(status, std::move(headers));
-  }
-  else if (req.method() == http::verb::delete_)
-  {
-    auto [status, headers, body, content_type]
-      = alt_handler.delete_({ req.target().data(), req.target().size() },
-                            { req.body().data(), req.body().size() },
-                            std::move(get_headers));
-    return send_body(status,
-                     std::move(headers),
-                     std::move(body),
-                     std::move(content_type));
-  }
-
-  return send(server_error("not implemented."));
-}
-
-//------------------------------------------------------------------------------
-
-// Report a failure
-void
-fail(beast::error_code ec, char const* what)
+admission_stats
+get_admission_stats()
 {
-  // anticrisis: ignore these common errors
-  if (ec == net::error::operation_aborted || ec == beast::error::timeout
-      || ec == net::error::connection_reset)
-    return;
-
-  std::cerr << what << ": " << ec.message() << "\n";
+  auto& c = the_admission_counters;
+  return { c.admitted, c.queued, c.rejected, c.active, c.waiting };
 }
 
 // This is the C++11 equivalent of a generic lambda.
 // The function object is used to send an HTTP message.
+// anticrisis: responses are held in a batch until flush, except streamed
+// ones, which are written at once after the batch
 template <class Stream>
 struct send_lambda
 {
   Stream&            stream_;
   bool&              close_;
   beast::error_code& ec_;
+  response_batch&    batch_;
 
-  explicit send_lambda(Stream& stream, bool& close, beast::error_code& ec)
+  explicit send_lambda(Stream&            stream,
+                       bool&              close,
+                       beast::error_code& ec,
+                       response_batch&    batch)
       : stream_(stream)
       , close_(close)
       , ec_(ec)
+      , batch_(batch)
   {
   }
 
@@ -269,44 +81,155 @@ struct send_lambda
     // Determine if we should close the connection after
     close_ = msg.need_eof();
 
-    // We need the serializer here because the serializer requires
-    // a non-const file_body, and the message oriented version of
-    // http::write only works with const messages.
-    http::serializer<isRequest, Body, Fields> sr{ msg };
-    http::write(stream_, sr, ec_);
+    if constexpr (! isRequest && is_batchable<Body>::value)
+      batch_.push(std::move(msg));
+    else
+    {
+      flush();
+      if (ec_)
+        return;
+
+      // We need the serializer here because the serializer requires
+      // a non-const file_body, and the message oriented version of
+      // http::write only works with const messages.
+      http::serializer<isRequest, Body, Fields> sr{ msg };
+      timed([&] { return http::write(stream_, sr, ec_); });
+    }
+  }
+
+  // writes the held responses with one gathered write
+  void
+  flush() const
+  {
+    if (batch_.empty())
+      return;
+    timed([&] { return net::write(stream_, batch_.buffers(), ec_); });
+    batch_.clear();
+  }
+
+  // anticrisis: adds a write to the server metrics
+  template <class F>
+  void
+  timed(F&& write) const
+  {
+    auto&      metrics = get_server_metrics();
+    auto const started = std::chrono::steady_clock::now();
+    metrics.bytes_out += write();
+    metrics.write.record(std::chrono::steady_clock::now() - started);
   }
 };
 
 // Handles an HTTP server connection
+// anticrisis: read bodies according to body_options
 void
-do_session(tcp::socket& socket, alt_handler* alt_handler)
+do_session(tcp::socket&        socket,
+           alt_handler*        alt_handler,
+           body_options const& body)
 {
   bool              close = false;
   beast::error_code ec;
 
-  // anticrisis: increment thread count, decrement on exit
-  thread_count++;
-  auto _ = finally([] { thread_count--; });
-
   // This buffer is required to persist across reads
   beast::flat_buffer buffer;
 
+  // anticrisis: each request is read into memory from this arena
+  request_arena arena;
+
   // This lambda is used to send messages
-  send_lambda<tcp::socket> lambda{ socket, close, ec };
+  response_batch           batch;
+  send_lambda<tcp::socket> lambda{ socket, close, ec, batch };
+
+  // anticrisis: a read error ends the connection, but the responses held
+  // for the requests read before it are still sent
+  auto const fail_read = [&] {
+    auto const read_ec = ec;
+    lambda.flush();
+    fail(read_ec, "read");
+  };
 
   for (;;)
   {
+    // anticrisis: the previous request has been destroyed
+    arena.reset();
+
     // Read a request
-    http::request<http::string_body> req;
-    http::read(socket, buffer, req, ec);
+    // anticrisis: read the header first, to decide whether the body is
+    // refused, read into memory or spooled to a file
+    arena_parser<http::empty_body> header{ std::piecewise_construct,
+                                           std::make_tuple(),
+                                           std::make_tuple(arena.allocator()) };
+    // anticrisis: count the bytes of each request
+    auto& metrics = get_server_metrics();
+    metrics.bytes_in += http::read_header(socket, buffer, header, ec);
     if (ec == http::error::end_of_stream)
+    {
+      lambda.flush();
       break;
+    }
     if (ec)
-      return fail(ec, "read");
+      return fail_read();
+
+    auto const plan = plan_body(header, body);
+    if (plan == body_plan::too_large)
+    {
+      lambda(payload_too_large());
+      lambda.flush();
+      break;
+    }
+
+    arena_request req{ std::piecewise_construct,
+                       std::make_tuple(arena.allocator()),
+                       std::make_tuple(arena.allocator()) };
+    spool_file    spool;
+    if (plan == body_plan::spool)
+    {
+      arena_parser<http::file_body> parser{ std::move(header) };
+      parser.body_limit(body.max_size);
+      spool = spool_file{ body.spool_dir };
+      parser.get().body().open(spool.path().c_str(),
+                               beast::file_mode::write_new,
+                               ec);
+      if (ec)
+      {
+        fail(ec, "spool");
+        lambda(spool_failed());
+        lambda.flush();
+        break;
+      }
+      metrics.bytes_in += http::read(socket, buffer, parser, ec);
+      parser.get().body().close();
+      req.base() = std::move(parser.release().base());
+    }
+    else
+    {
+      arena_parser<arena_body> parser{ std::move(header), arena.allocator() };
+      parser.body_limit(body.max_size);
+      metrics.bytes_in += http::read(socket, buffer, parser, ec);
+      req = parser.release();
+    }
+
+    // anticrisis: a chunked body may turn out to be too large
+    if (ec == http::error::body_limit)
+    {
+      lambda(payload_too_large());
+      lambda.flush();
+      break;
+    }
+    if (ec)
+      return fail_read();
 
     // Send the response
     // anticrisis: remove doc_root
-    handle_request(*alt_handler, std::move(req), lambda);
+    handle_request(*alt_handler, std::move(req), lambda, spool.path());
+    if (ec)
+      return fail(ec, "write");
+
+    // anticrisis: answer the requests a pipelining client has already sent
+    // before writing, so that their responses go out together
+    if (! close && batch.size() < response_batch::max_size
+        && has_pipelined_request(buffer))
+      continue;
+    lambda.flush();
     if (ec)
       return fail(ec, "write");
     if (close)
@@ -325,17 +248,47 @@ do_session(tcp::socket& socket, alt_handler* alt_handler)
 
 //------------------------------------------------------------------------------
 
+// anticrisis: serve connections on this thread until no queued connection
+// is waiting to take over the slot
+void
+serve(tcp::socket                                     socket,
+      alt_handler*                                    alt_handler,
+      std::shared_ptr<admission_control<tcp::socket>> admission,
+      std::shared_ptr<body_options const>             body)
+{
+  for (;;)
+  {
+    do_session(socket, alt_handler, *body);
+
+    auto next = admission->release();
+    if (! next)
+      break;
+    socket = std::move(*next);
+  }
+}
+
+// anticrisis: refuse a connection which could not be admitted
+void
+send_unavailable(tcp::socket& socket)
+{
+  beast::error_code ec;
+  auto              res = service_unavailable();
+  http::write(socket, res, ec);
+  socket.shutdown(tcp::socket::shutdown_send, ec);
+}
+
 // anticrisis: change main to run; remove doc_root
 int
-run(std::string_view address_,
-    unsigned short   port,
-    alt_handler*     alt_handler,
-    int              max_connections)
+run(std::string_view         address_,
+    unsigned short           port,
+    alt_handler*             alt_handler,
+    admission_options const& admission_options,
+    body_options const&      body)
 {
+  using decision = admission_control<tcp::socket>::decision;
+
   try
   {
-    thread_count = 0;
-
     auto const address = net::ip::make_address(address_);
 
     // The io_context is required for all I/O
@@ -343,14 +296,16 @@ run(std::string_view address_,
 
     // The acceptor receives incoming connections
     tcp::acceptor acceptor{ ioc, { address, port } };
+
+    // anticrisis: sessions outlive this function's stack if it throws
+    auto admission
+      = std::make_shared<admission_control<tcp::socket>>(admission_options);
+    auto bodies = std::make_shared<body_options const>(body);
+
     for (;;)
     {
-      // anticrisis busy wait until thread_count is in range - will probably
-      // cause client and server errors
-      while (thread_count >= max_connections)
-      {
-        std::this_thread::yield();
-      }
+      // anticrisis: block until a connection could be admitted or queued
+      admission->wait_for_room();
 
       // This will receive the new connection
       tcp::socket socket{ ioc };
@@ -358,9 +313,18 @@ run(std::string_view address_,
       // Block until we get a connection
       acceptor.accept(socket);
 
-      // Launch the session, transferring ownership of the socket
-      std::thread{ std::bind(&do_session, std::move(socket), alt_handler) }
-        .detach();
+      switch (admission->offer(socket))
+      {
+      case decision::admit:
+        // Launch the session, transferring ownership of the socket
+        std::thread{
+          &serve, std::move(socket), alt_handler, admission, bodies
+        }.detach();
+        break;
+      case decision::queue: break;
+      case decision::reject: send_unavailable(socket); break;
+      case decision::close: break;
+      }
     }
   }
   catch (const std::exception& e)
@@ -1,111 +1,271 @@
-#include "http_tcl/http_tcl.h"
+#include "http_client.h"
 
 #include <boost/asio/connect.hpp>
-#include <boost/asio/ip/tcp.hpp>
-#include <boost/beast/core.hpp>
-#include <boost/beast/http.hpp>
-#include <boost/beast/version.hpp>
 #include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <string>
 
-namespace beast = boost::beast; // from <boost/beast.hpp>
-namespace http  = beast::http;  // from <boost/beast/http.hpp>
-namespace net   = boost::asio;  // from <boost/asio.hpp>
-using tcp       = net::ip::tcp; // from <boost/asio/ip/tcp.hpp>
-
 namespace http_tcl
 {
-std::tuple<int, headers, std::string>
+namespace client
+{
+connection_pool&
+the_pool()
+{
+  static connection_pool pool;
+  return pool;
+}
+
+resolver_cache&
+the_resolver_cache()
+{
+  static resolver_cache cache;
+  return cache;
+}
+
+http::verb
+to_verb(std::string_view method)
+{
+  http::verb verb = http::verb::get;
+
+  // clang-format off
+  if (method == "options")        verb = http::verb::options;
+  else if (method == "head")      verb = http::verb::head;
+  else if (method == "get")       verb = http::verb::get;
+  else if (method == "post")      verb = http::verb::post;
+  else if (method == "put")       verb = http::verb::put;
+  else if (method == "delete")    verb = http::verb::delete_;
+  // clang-format on
+
+  return verb;
+}
+
+http::request<http::string_body>
+make_request(http::verb                    verb,
+             std::string const&            host,
+             std::string const&            target,
+             std::optional<headers> const& headers,
+             std::string_view              body)
+{
+  http::request<http::string_body> req{ verb, target, 11 };
+  req.set(http::field::host, host);
+  req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+  // the first field of each name replaces any set above
+  if (headers)
+  {
+    for (auto it = headers->begin(); it != headers->end(); ++it)
+    {
+      if (headers->find(it->first) == it)
+        req.base().set(it->first, it->second);
+      else
+        req.base().insert(it->first, it->second);
+    }
+  }
+
+  if (! body.empty())
+  {
+    req.set(http::field::content_length, std::to_string(body.size()));
+    req.body() = body;
+  }
+  return req;
+}
+
+headers
+to_headers(http::fields const& fields)
+{
+  http_tcl::headers res_head;
+  for (auto const& kv: fields)
+    res_head.add({ kv.name_string().data(), kv.name_string().size() },
+                 { kv.value().data(), kv.value().size() });
+  return res_head;
+}
+
+} // namespace client
+
+using namespace client;
+
+void
+set_client_pool_options(client_pool_options const& options)
+{
+  the_pool().set_options(options);
+  the_resolver_cache().set_ttl(options.dns_ttl, options.dns_failure_ttl);
+}
+
+client_pool_stats
+get_client_pool_stats()
+{
+  auto  stats      = the_pool().stats();
+  auto& dns        = the_resolver_cache();
+  stats.dns_hits   = dns.hits();
+  stats.dns_misses = dns.misses();
+  return stats;
+}
+
+std::vector<client_dns_entry>
+get_client_dns_cache()
+{
+  return the_resolver_cache().entries();
+}
+
+void
+flush_client_dns_cache()
+{
+  the_resolver_cache().flush();
+}
+
+namespace
+{
+// Reads the body of a response piece by piece into sink, through a fixed
+// buffer, so memory use does not grow with the size of the body.
+void
+read_to_sink(beast::tcp_stream&                        stream,
+             beast::flat_buffer&                       buffer,
+             http::response_parser<http::buffer_body>& parser,
+             body_sink const&                          sink,
+             beast::error_code&                        ec)
+{
+  http::read_header(stream, buffer, parser, ec);
+  if (ec)
+    return;
+
+  char piece[64 * 1024];
+  while (! parser.is_done())
+  {
+    auto& body = parser.get().body();
+    body.data  = piece;
+    body.size  = sizeof(piece);
+    http::read(stream, buffer, parser, ec);
+    if (ec == http::error::need_buffer)
+      ec = {};
+    if (ec)
+      return;
+
+    auto const n = sizeof(piece) - body.size;
+    if (n > 0 && ! sink(piece, n))
+      throw std::runtime_error{ "could not write the response body" };
+  }
+}
+
+} // namespace
+
+client_result
 http_client(std::string_view              method,
             std::string                   host,
             std::string                   port,
             std::string                   target,
             std::optional<headers> const& headers,
-            std::string_view              body)
+            std::string_view              body,
+            body_sink const&              sink)
 {
   try
   {
-    // The io_context is required for all I/O
-    net::io_context ioc;
-
-    // These objects perform our I/O
-    tcp::resolver     resolver(ioc);
-    beast::tcp_stream stream(ioc);
+    auto&      pool = the_pool();
+    auto const key  = host + ':' + port;
 
-    // Look up the domain name
-    auto const results = resolver.resolve(host, port);
+    // Set up an HTTP request message
+    auto const verb = to_verb(method);
+    auto const req  = make_request(verb, host, target, headers, body);
 
-    // Make the connection on the IP address we get from a lookup
-    stream.connect(results);
+    // A pooled connection may still be closed by the server just as it is
+    // reused. If it fails before any of the response arrives, the request
+    // is sent again on a new connection, unless it is a POST, which may
+    // already have taken effect.
+    for (;;)
+    {
+      auto reused = pool.acquire(key);
+      pool.count(reused.has_value());
 
-    // Set up an HTTP request message
-    http::verb verb = http::verb::get;
-
-    // clang-format off
-    if (method == "options")        verb = http::verb::options;
-    else if (method == "head")      verb = http::verb::head;
-    else if (method == "get")       verb = http::verb::get;
-    else if (method == "post")      verb = http::verb::post;
-    else if (method == "put")       verb = http::verb::put;
-    else if (method == "delete")    verb = http::verb::delete_;
-    // clang-format on
-
-    http::request<http::string_body> req{ verb, target, 11 };
-    req.set(http::field::host, host);
-    req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-    if (headers)
-      for (auto& kv: *headers)
+      beast::tcp_stream stream(reused ? std::move(*reused)
+                                      : tcp::socket{ pool.context() });
+      if (! reused)
       {
-        req.base().set(kv.first, kv.second);
+        // Look up the domain name, unless the cache knows it
+        auto&             dns = the_resolver_cache();
+        beast::error_code ec;
+        auto              endpoints = dns.lookup(key, ec);
+        if (! endpoints)
+        {
+          tcp::resolver resolver(pool.context());
+          auto const    results = resolver.resolve(host, port, ec);
+          endpoints             = dns.store(key, results, ec);
+        }
+        if (ec)
+          throw beast::system_error{ ec };
+
+        // Make the connection on the IP address we get from a lookup
+        stream.connect(*endpoints);
       }
 
-    if (! body.empty())
-    {
-      req.set(http::field::content_length, std::to_string(body.size()));
-      req.body() = body;
-    }
+      // This buffer is used for reading and must be persisted
+      beast::flat_buffer buffer;
 
-    // Send the HTTP request to the remote host
-    http::write(stream, req);
+      // a streamed body has no size limit, and is not kept
+      if (sink)
+      {
+        http::response_parser<http::buffer_body> parser;
+        parser.body_limit((std::numeric_limits<std::uint64_t>::max)());
+        if (verb == http::verb::head)
+          parser.skip(true);
+
+        beast::error_code ec;
+        http::write(stream, req, ec);
+        if (! ec)
+          read_to_sink(stream, buffer, parser, sink, ec);
 
-    // This buffer is used for reading and must be persisted
-    beast::flat_buffer buffer;
+        if (ec)
+        {
+          if (reused && ! parser.got_some() && verb != http::verb::post)
+            continue;
+          throw beast::system_error{ ec };
+        }
 
-    // Declare a container to hold the response
-    http::response<http::dynamic_body> res;
+        auto& res = parser.get();
+        if (res.keep_alive() && parser.is_done())
+          pool.release(key, stream.release_socket());
+        else
+          stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+
+        return { static_cast<int>(res.result_int()),
+                 to_headers(res.base()),
+                 std::string{} };
+      }
 
-    // Receive the HTTP response
-    http::read(stream, buffer, res);
+      // Declare a parser to hold the response; a response to HEAD has
+      // no body, whatever its Content-Length says
+      http::response_parser<http::dynamic_body> parser;
+      if (verb == http::verb::head)
+        parser.skip(true);
 
-    // Write the message to standard out
-    // std::cout << res << std::endl;
+      // Send the HTTP request to the remote host, and receive the response
+      beast::error_code ec;
+      http::write(stream, req, ec);
+      if (! ec)
+        http::read(stream, buffer, parser, ec);
 
-    // Gracefully close the socket
-    beast::error_code ec;
-    stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+      if (ec)
+      {
+        if (reused && ! parser.got_some() && verb != http::verb::post)
+          continue;
+        throw beast::system_error{ ec };
+      }
 
-    // not_connected happens sometimes
-    // so don't bother reporting it.
-    //
-    if (ec && ec != beast::errc::not_connected)
-      throw beast::system_error{ ec };
+      auto& res = parser.get();
 
-    // If we get here then the connection is closed gracefully
+      // keep the connection for the next request to this host if the
+      // server allows it
+      if (res.keep_alive() && parser.is_done())
+        pool.release(key, stream.release_socket());
+      else
+        stream.socket().shutdown(tcp::socket::shutdown_both, ec);
 
-    http_tcl::headers res_head;
-    for (auto const& kv: res.base())
-    {
-      std::string k{ kv.name_string() };
-      std::string v{ kv.value() };
-      res_head.insert({ k, v });
+      return {
+        static_cast<int>(res.result_int()),
+        to_headers(res.base()),
+        beast::buffers_to_string(res.body().data()),
+      };
     }
-
-    return {
-      static_cast<int>(res.result_int()),
-      res_head,
-      beast::buffers_to_string(res.body().data()),
-    };
   }
   catch (std::exception const& e)
   {
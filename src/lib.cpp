@@ -4,13 +4,28 @@
 #include "version.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <stdexcept>
 #include <tcl.h>
 #include <thread>
+#include <utility>
 #include <vector>
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 // need a macro for compile-time string concatenation
 #define theNamespaceName    "::act::http"
 #define theUrlNamespaceName "::act::url"
@@ -35,6 +50,7 @@ static constexpr auto thePackageVersion  = PROJECT_VERSION;
 //    target = string request path, e.g. "/foo"
 //    body   = string request body
 //    status = integer HTTP status code
+//    content        = response body; a byte array is sent as raw bytes
 //    content_length = integer to place in 'Content-Length' header
 //    content_type   = string to place in 'Content-Type' header
 //
@@ -48,6 +64,10 @@ static constexpr auto thePackageVersion  = PROJECT_VERSION;
 //        list 200 "hello" "text/plain" {Set-Cookie foo X-Other-Header bar}
 //    }
 //
+// With '-callstyle args', each callback is a command prefix which is invoked
+// with three more arguments: target, body and a dictionary of request
+// headers. The request variables are not set in that case.
+//
 struct config_t
 {
   bool   valid{ false };
@@ -64,9 +84,62 @@ struct config_t
   TclObj port{};
   TclObj exit_target{};
   TclObj max_connections{};
+  TclObj io_threads{};
+  TclObj workers{};
+  TclObj worker_init{};
+  TclObj backlog{};
+  TclObj overflow{};
+  TclObj call_style{};
+  TclObj static_root{};
+  TclObj static_prefix{};
+  TclObj routes{};
+  TclObj cache_size{};
+  TclObj client_max_idle{};
+  TclObj client_idle_timeout{};
+  TclObj client_dns_ttl{};
+  TclObj client_dns_failure_ttl{};
+  TclObj max_body_size{};
+  TclObj spool_threshold{};
+  TclObj spool_dir{};
+  TclObj compress{};
+  TclObj req_query{};
+  TclObj metrics_target{};
 
   void
   init();
+
+  // Tcl objects belong to the thread which created them, so configuration
+  // is handed to worker threads as plain strings.
+  std::vector<std::string>
+  to_strings();
+
+  void
+  from_strings(std::vector<std::string> const& strings);
+
+private:
+  static constexpr TclObj config_t::*fields_[] = {
+    &config_t::options,         &config_t::head,
+    &config_t::get,             &config_t::post,
+    &config_t::put,             &config_t::delete_,
+    &config_t::req_target,      &config_t::req_body,
+    &config_t::req_headers,     &config_t::host,
+    &config_t::port,            &config_t::exit_target,
+    &config_t::max_connections, &config_t::io_threads,
+    &config_t::workers,         &config_t::worker_init,
+    &config_t::backlog,         &config_t::overflow,
+    &config_t::call_style,      &config_t::static_root,
+    &config_t::static_prefix,   &config_t::routes,
+    &config_t::cache_size,      &config_t::client_max_idle,
+    &config_t::client_idle_timeout,
+    &config_t::client_dns_ttl,
+    &config_t::client_dns_failure_ttl,
+    &config_t::max_body_size,
+    &config_t::spool_threshold,
+    &config_t::spool_dir,
+    &config_t::compress,
+    &config_t::req_query,
+    &config_t::metrics_target,
+  };
 };
 
 void
@@ -77,27 +150,137 @@ config_t::init()
     return Tcl_NewStringObj("", 0);
   };
 
-  options         = empty_string();
-  head            = empty_string();
-  get             = empty_string();
-  post            = empty_string();
-  put             = empty_string();
-  delete_         = empty_string();
-  req_target      = empty_string();
-  req_body        = empty_string();
-  req_headers     = empty_string();
-  host            = empty_string();
-  port            = empty_string();
-  exit_target     = empty_string();
-  max_connections = empty_string();
-  valid           = true;
+  options                = empty_string();
+  head                   = empty_string();
+  get                    = empty_string();
+  post                   = empty_string();
+  put                    = empty_string();
+  delete_                = empty_string();
+  req_target             = empty_string();
+  req_body               = empty_string();
+  req_headers            = empty_string();
+  host                   = empty_string();
+  port                   = empty_string();
+  exit_target            = empty_string();
+  max_connections        = empty_string();
+  io_threads             = empty_string();
+  workers                = empty_string();
+  worker_init            = empty_string();
+  backlog                = empty_string();
+  overflow               = empty_string();
+  call_style             = empty_string();
+  static_root            = empty_string();
+  static_prefix          = empty_string();
+  routes                 = empty_string();
+  cache_size             = empty_string();
+  client_max_idle        = empty_string();
+  client_idle_timeout    = empty_string();
+  client_dns_ttl         = empty_string();
+  client_dns_failure_ttl = empty_string();
+  max_body_size          = empty_string();
+  spool_threshold        = empty_string();
+  spool_dir              = empty_string();
+  compress               = empty_string();
+  req_query              = empty_string();
+  metrics_target         = empty_string();
+  valid                  = true;
+}
+
+std::vector<std::string>
+config_t::to_strings()
+{
+  std::vector<std::string> strings;
+  strings.reserve(std::size(fields_));
+  for (auto field: fields_)
+    strings.emplace_back(get_string((this->*field).value()));
+  return strings;
+}
+
+void
+config_t::from_strings(std::vector<std::string> const& strings)
+{
+  auto it = strings.begin();
+  for (auto field: fields_)
+  {
+    this->*field = Tcl_NewStringObj(it->data(), it->size());
+    ++it;
+  }
+  valid = true;
 }
 
+// Tcl objects pinned by response bodies. The I/O thread which finishes
+// writing a response may not touch the object, so it is handed back here
+// and released by the handler at the start of its next request.
+struct release_queue
+{
+  std::mutex            mutex;
+  std::vector<Tcl_Obj*> objs;
+  bool                  closed{ false };
+
+  void
+  push(Tcl_Obj* obj)
+  {
+    std::lock_guard lock(mutex);
+    // once the handler is gone nothing may release the object; leak it
+    if (! closed)
+      objs.push_back(obj);
+  }
+
+  void
+  drain()
+  {
+    std::vector<Tcl_Obj*> released;
+    {
+      std::lock_guard lock(mutex);
+      released.swap(objs);
+    }
+    for (auto obj: released)
+      Tcl_DecrRefCount(obj);
+  }
+};
+
+struct tcl_handler;
+
+// Produces a streamed body by calling the command given to 'http stream' for
+// each chunk, until it returns an empty string. Owns a reference to the
+// command, which is released by the handler like a response body.
+class tcl_chunk_source final : public http_tcl::chunk_source
+{
+  tcl_handler&                   handler_;
+  Tcl_Obj*                       cmd_;
+  std::shared_ptr<release_queue> releases_;
+
+public:
+  tcl_chunk_source(tcl_handler&                   handler,
+                   Tcl_Obj*                       cmd,
+                   std::shared_ptr<release_queue> releases)
+      : handler_(handler)
+      , cmd_(cmd)
+      , releases_(std::move(releases))
+  {
+  }
+
+  ~tcl_chunk_source() override { releases_->push(cmd_); }
+
+  std::optional<std::string>
+  next() override;
+};
+
 struct tcl_handler final : public http_tcl::thread_safe_handler<tcl_handler>
 {
   Tcl_Interp* interp_;
   config_t    config_;
 
+  std::shared_ptr<release_queue> releases_{
+    std::make_shared<release_queue>()
+  };
+
+  // headers of the request being handled, read by 'http header'
+  headers_access const* current_headers_{ nullptr };
+
+  // the command given to 'http stream' while handling this request
+  Tcl_Obj* stream_cmd_{ nullptr };
+
   void
   set_target(std::string_view target)
   {
@@ -110,15 +293,41 @@ struct tcl_handler final : public http_tcl::thread_safe_handler<tcl_handler>
     maybe_set_var(interp_, config_.req_body.value(), body);
   }
 
+  // The fields of the query and of a form body, as one dictionary.
+  void
+  set_query(std::string_view      target,
+            std::string_view      body,
+            headers_access const& get_headers)
+  {
+    if (get_string(config_.req_query.value()).empty())
+      return;
+
+    url::query_fields fields;
+    if (auto q = target.find('?'); q != std::string_view::npos)
+      url::parse_query(target.substr(q + 1), fields, false);
+
+    auto type = get_headers.find("Content-Type");
+    if (type
+        && http_tcl::headers::iequals(type->substr(0, type->find(';')),
+                                      "application/x-www-form-urlencoded"))
+      url::parse_query(body, fields, false);
+
+    Tcl_ObjSetVar2(interp_,
+                   config_.req_query.value(),
+                   nullptr,
+                   url::to_dict(fields),
+                   TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG);
+  }
+
   void
-  set_headers(headers_access&& get_headers)
+  set_headers(headers_access const& get_headers)
   {
     // only ask server to copy headers out of its internal
     // structure if we're actually going to use them.
     auto var_name_sv = get_string(config_.req_headers.value());
     if (! var_name_sv.empty())
     {
-      auto dict = to_dict(interp_, get_headers());
+      auto dict = to_dict(interp_, get_headers);
       Tcl_ObjSetVar2(interp_,
                      config_.req_headers.value(),
                      nullptr,
@@ -153,6 +362,46 @@ struct tcl_handler final : public http_tcl::thread_safe_handler<tcl_handler>
     return ::get_dict(interp_, dict);
   }
 
+  // Pins obj, an element of the callback's result, as the response body. A
+  // byte array is sent as raw bytes, anything else as its UTF-8 string. A
+  // byte array which the interpreter can reach from elsewhere might later
+  // be converted to another type, freeing its bytes while they are being
+  // written, so only then are they copied.
+  http_tcl::response_body
+  get_body(Tcl_Obj* obj)
+  {
+    static auto const byte_array_type = Tcl_GetObjType("bytearray");
+
+    // a streamed body replaces the one in the callback's result
+    if (stream_cmd_)
+      return http_tcl::response_body{ std::make_shared<tcl_chunk_source>(
+        *this, std::exchange(stream_cmd_, nullptr), releases_) };
+
+    if (obj->typePtr == byte_array_type
+        && (Tcl_IsShared(obj) || Tcl_IsShared(Tcl_GetObjResult(interp_))))
+      obj = Tcl_DuplicateObj(obj);
+
+    std::string_view bytes;
+    if (obj->typePtr == byte_array_type)
+    {
+      int  length{ 0 };
+      auto data = Tcl_GetByteArrayFromObj(obj, &length);
+      bytes     = { reinterpret_cast<char const*>(data),
+                static_cast<size_t>(length) };
+    }
+    else
+      bytes = get_string(obj);
+
+    Tcl_IncrRefCount(obj);
+    std::shared_ptr<void const> owner{
+      obj,
+      [releases = releases_](Tcl_Obj const* obj) {
+        releases->push(const_cast<Tcl_Obj*>(obj));
+      }
+    };
+    return { std::move(owner), bytes };
+  }
+
   std::optional<std::tuple<int, Tcl_Obj**>>
   eval_to_list(Tcl_Obj* obj)
   {
@@ -162,6 +411,106 @@ struct tcl_handler final : public http_tcl::thread_safe_handler<tcl_handler>
     return get_list(Tcl_GetObjResult(interp_));
   }
 
+  // Invokes the command prefix cmd with target, body and headers appended as
+  // arguments, followed by extra if given. Unlike a script, the command's
+  // bytecode is reused from call to call and no variables are written.
+  std::optional<std::tuple<int, Tcl_Obj**>>
+  invoke_to_list(Tcl_Obj*              cmd,
+                 std::string_view      target,
+                 std::string_view      body,
+                 headers_access const& get_headers,
+                 Tcl_Obj*              extra = nullptr)
+  {
+    int       prefixc{ 0 };
+    Tcl_Obj** prefixv;
+    if (Tcl_ListObjGetElements(interp_, cmd, &prefixc, &prefixv) != TCL_OK)
+      return std::nullopt;
+
+    std::vector<Tcl_Obj*> objv(prefixv, prefixv + prefixc);
+    objv.push_back(Tcl_NewStringObj(target.data(), target.size()));
+    objv.push_back(Tcl_NewStringObj(body.data(), body.size()));
+    objv.push_back(to_dict(interp_, get_headers));
+    if (extra)
+      objv.push_back(extra);
+
+    for (auto obj: objv)
+      Tcl_IncrRefCount(obj);
+    auto res = Tcl_EvalObjv(interp_, objv.size(), objv.data(), TCL_EVAL_GLOBAL);
+    for (auto obj: objv)
+      Tcl_DecrRefCount(obj);
+
+    if (res != TCL_OK)
+      return std::nullopt;
+
+    return get_list(Tcl_GetObjResult(interp_));
+  }
+
+  // Invokes the command registered by 'http route' for a matched route, with
+  // a dict of the path parameters as an extra argument. Parameters are
+  // percent-decoded; one with a malformed escape is passed as it is.
+  std::optional<std::tuple<int, Tcl_Obj**>>
+  invoke_route(http_tcl::route_match const& route,
+               std::string_view             target,
+               std::string_view             body,
+               headers_access const&        get_headers)
+  {
+    // routes are kept as a flat list of method, pattern and command
+    Tcl_Obj* cmd{ nullptr };
+    if (Tcl_ListObjIndex(interp_, config_.routes.value(), route.id * 3 + 2, &cmd)
+          != TCL_OK
+        || ! cmd)
+      return std::nullopt;
+
+    auto params = Tcl_NewDictObj();
+    for (auto const& [name, value]: route.params)
+    {
+      auto decoded = url::percent_decode(value, false);
+      auto v       = decoded ? std::string_view{ *decoded } : value;
+      Tcl_DictObjPut(interp_,
+                     params,
+                     Tcl_NewStringObj(name.data(), name.size()),
+                     Tcl_NewStringObj(v.data(), v.size()));
+    }
+
+    return invoke_to_list(cmd, target, body, get_headers, params);
+  }
+
+  // Evaluates the callback for a request according to -callstyle.
+  std::optional<std::tuple<int, Tcl_Obj**>>
+  eval_request(Tcl_Obj*         cmd,
+               std::string_view target,
+               std::string_view body,
+               headers_access&& get_headers)
+  {
+    releases_->drain();
+    set_stream(nullptr);
+
+    // the time since the request was read is time spent waiting for this
+    // interpreter
+    auto&      metrics = http_tcl::get_server_metrics();
+    auto const started = std::chrono::steady_clock::now();
+    if (get_headers.received != std::chrono::steady_clock::time_point{})
+      metrics.queue_wait.record(started - get_headers.received);
+    auto recorded = finally([&metrics, started] {
+      metrics.eval.record(std::chrono::steady_clock::now() - started);
+    });
+
+    current_headers_ = &get_headers;
+    auto _           = finally([this] { current_headers_ = nullptr; });
+
+    if (auto route = get_headers.route; route)
+      return invoke_route(*route, target, body, get_headers);
+
+    if (get_string(config_.call_style.value()) == "args")
+      return invoke_to_list(cmd, target, body, get_headers);
+
+    set_target(target);
+    set_body(body);
+    set_headers(get_headers);
+    set_query(target, body, get_headers);
+    return eval_to_list(cmd);
+  }
+
   std::string
   error_info()
   {
@@ -171,6 +520,12 @@ struct tcl_handler final : public http_tcl::thread_safe_handler<tcl_handler>
   }
 
 public:
+  ~tcl_handler()
+  {
+    std::lock_guard lock(releases_->mutex);
+    releases_->closed = true;
+  }
+
   void
   init(Tcl_Interp* i)
   {
@@ -178,6 +533,69 @@ public:
     config_.init();
   }
 
+  // Releases the objects of responses which have been written. Call on the
+  // interpreter's thread while no request is being handled.
+  void
+  release_bodies()
+  {
+    releases_->drain();
+    set_stream(nullptr);
+  }
+
+  Tcl_Interp*
+  interp()
+  {
+    return interp_;
+  }
+
+  // null unless called from a handler
+  headers_access const*
+  current_headers()
+  {
+    return current_headers_;
+  }
+
+  // makes cmd produce the body of the response being handled
+  void
+  set_stream(Tcl_Obj* cmd)
+  {
+    if (cmd)
+      Tcl_IncrRefCount(cmd);
+    if (stream_cmd_)
+      Tcl_DecrRefCount(stream_cmd_);
+    stream_cmd_ = cmd;
+  }
+
+  // Calls cmd for the next chunk of a streamed body; an empty result ends
+  // the body, and an error abandons it.
+  std::optional<std::string>
+  next_chunk(Tcl_Obj* cmd)
+  {
+    static auto const byte_array_type = Tcl_GetObjType("bytearray");
+
+    return locked([&]() -> std::optional<std::string> {
+      releases_->drain();
+      if (Tcl_EvalObjEx(interp_, cmd, TCL_EVAL_GLOBAL) != TCL_OK)
+        throw std::runtime_error(error_info());
+
+      auto obj = Tcl_GetObjResult(interp_);
+      if (obj->typePtr == byte_array_type)
+      {
+        int  length{ 0 };
+        auto data = Tcl_GetByteArrayFromObj(obj, &length);
+        if (length == 0)
+          return std::nullopt;
+        return std::string{ reinterpret_cast<char const*>(data),
+                            static_cast<size_t>(length) };
+      }
+
+      auto chunk = get_string(obj);
+      if (chunk.empty())
+        return std::nullopt;
+      return std::string{ chunk };
+    });
+  }
+
   auto&
   config()
   {
@@ -214,11 +632,8 @@ public:
       }
     }
 
-    set_target(target);
-    set_body(body);
-    set_headers(std::move(get_headers));
-
-    auto list = eval_to_list(config_.options.value());
+    auto list = eval_request(
+      config_.options.value(), target, body, std::move(get_headers));
     if (! list)
       return make_error();
 
@@ -228,7 +643,7 @@ public:
       return make_error("wrong number of items returned from callback");
 
     auto sc           = get_int(*objv++);
-    auto res_body     = get_string(*objv++);
+    auto res_body     = get_body(*objv++);
     auto content_type = get_string(*objv++);
 
     std::optional<http_tcl::headers> headers;
@@ -241,7 +656,7 @@ public:
 
     return { *sc,
              headers,
-             { res_body.data(), res_body.size() },
+             std::move(res_body),
              { content_type.data(), content_type.size() } };
   }
 
@@ -252,11 +667,8 @@ public:
       = std::make_tuple(500, std::nullopt, 0, "text/plain");
     constexpr auto req_args = 3;
 
-    set_target(target);
-    set_body("");
-    set_headers(std::move(get_headers));
-
-    auto list = eval_to_list(config_.head.value());
+    auto list = eval_request(
+      config_.head.value(), target, "", std::move(get_headers));
     if (! list)
       return error;
 
@@ -290,11 +702,8 @@ public:
       return { 500, std::nullopt, msg ? msg : error_info(), "text/plain" };
     };
 
-    set_target(target);
-    set_body("");
-    set_headers(std::move(get_headers));
-
-    auto list = eval_to_list(config_.get.value());
+    auto list = eval_request(
+      config_.get.value(), target, "", std::move(get_headers));
     if (! list)
       return make_error();
 
@@ -304,7 +713,7 @@ public:
       return make_error("wrong number of items returned from callback");
 
     auto sc           = get_int(*objv++);
-    auto body         = get_string(*objv++);
+    auto body         = get_body(*objv++);
     auto content_type = get_string(*objv++);
 
     std::optional<http_tcl::headers> headers;
@@ -317,7 +726,7 @@ public:
 
     return { *sc,
              headers,
-             { body.data(), body.size() },
+             std::move(body),
              { content_type.data(), content_type.size() } };
   }
 
@@ -331,11 +740,8 @@ public:
       return { 500, std::nullopt, msg ? msg : error_info(), "text/plain" };
     };
 
-    set_target(target);
-    set_body(body);
-    set_headers(std::move(get_headers));
-
-    auto list = eval_to_list(config_.post.value());
+    auto list = eval_request(
+      config_.post.value(), target, body, std::move(get_headers));
     if (! list)
       return make_error();
 
@@ -345,7 +751,7 @@ public:
       return make_error("wrong number of items returned from callback");
 
     auto sc           = get_int(*objv++);
-    auto res_body     = get_string(*objv++);
+    auto res_body     = get_body(*objv++);
     auto content_type = get_string(*objv++);
 
     std::optional<http_tcl::headers> headers;
@@ -358,7 +764,7 @@ public:
 
     return { *sc,
              headers,
-             { res_body.data(), res_body.size() },
+             std::move(res_body),
              { content_type.data(), content_type.size() } };
   }
 
@@ -370,11 +776,8 @@ public:
     static const auto error    = std::make_tuple(500, http_tcl::headers{});
     constexpr auto    req_args = 1;
 
-    set_target(target);
-    set_body(body);
-    set_headers(std::move(get_headers));
-
-    auto list = eval_to_list(config_.put.value());
+    auto list = eval_request(
+      config_.put.value(), target, body, std::move(get_headers));
     if (! list)
       return error;
 
@@ -404,11 +807,8 @@ public:
       return { 500, std::nullopt, msg ? msg : error_info(), "text/plain" };
     };
 
-    set_target(target);
-    set_body(body);
-    set_headers(std::move(get_headers));
-
-    auto list = eval_to_list(config_.delete_.value());
+    auto list = eval_request(
+      config_.delete_.value(), target, body, std::move(get_headers));
     if (! list)
       return make_error();
 
@@ -418,7 +818,7 @@ public:
       return make_error("wrong number of items returned from callback");
 
     auto sc           = get_int(*objv++);
-    auto res_body     = get_string(*objv++);
+    auto res_body     = get_body(*objv++);
     auto content_type = get_string(*objv++);
 
     std::optional<http_tcl::headers> headers;
@@ -431,142 +831,716 @@ public:
 
     return { *sc,
              headers,
-             { res_body.data(), res_body.size() },
+             std::move(res_body),
              { content_type.data(), content_type.size() } };
   }
 };
 
-struct client_data
+std::optional<std::string>
+tcl_chunk_source::next()
 {
-  tcl_handler handler;
-
-  void
-  init(Tcl_Interp*);
-};
+  return handler_.next_chunk(cmd_);
+}
 
-void
-client_data::init(Tcl_Interp* i)
+// Delivers each request to the thread of the interpreter which started the
+// server, through the Tcl event queue, so the server can run in the
+// background while the interpreter services its event loop. The calling I/O
+// thread waits until the interpreter has handled the request. A handler which
+// enters the event loop itself, with update or vwait, does not run the next
+// request: that stays queued until the handler has returned.
+class event_loop_handler final : public http_tcl::alt_handler
 {
-  handler.init(i);
-}
+  struct call
+  {
+    enum class state
+    {
+      queued,
+      running,
+      done,
+      abandoned
+    };
 
-// global
-client_data theClientData;
+    std::function<void()>   run;
+    std::shared_ptr<bool>   busy;
+    std::mutex              mutex;
+    std::condition_variable cv;
+    state                   state{ state::queued };
+  };
 
-//
+  struct call_event
+  {
+    Tcl_Event              header;
+    std::shared_ptr<call>* pending;
+  };
 
-int
-configure(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
-{
-  static const char* options[] = { "-head",
-                                   "-get",
-                                   "-post",
-                                   "-put",
-                                   "-delete",
-                                   "-reqtargetvariable",
-                                   "-reqbodyvariable",
-                                   "-reqheadersvariable",
-                                   "-host",
-                                   "-port",
-                                   "-options",
-                                   "-exittarget",
-                                   "-maxconnections",
-                                   nullptr };
+  tcl_handler&    handler_;
+  Tcl_ThreadId    owner_;
+  std::mutex      mutex_;
+  bool            stopping_{ false };
+  std::set<call*> calls_;
 
-  auto  cd_ptr    = static_cast<client_data*>(cd);
-  auto& my_config = cd_ptr->handler.config();
+  // set while a request runs; only used on the interpreter's thread, and
+  // shared with queued calls, which may outlive this handler
+  std::shared_ptr<bool> busy_{ std::make_shared<bool>(false) };
 
-  if (objc == 2)
+  // runs on the interpreter's thread
+  static int
+  process(Tcl_Event* ev, int flags)
   {
-    // return value of single option
-    int opt{ -1 };
-    if (Tcl_GetIndexFromObj(i, objv[1], options, "option", 0, &opt) != TCL_OK)
-      return TCL_ERROR;
+    if (! (flags & TCL_FILE_EVENTS))
+      return 0;
 
-    std::vector<Tcl_Obj*> objv;
-    switch (opt)
+    auto event = reinterpret_cast<call_event*>(ev);
     {
-    case 0: objv.push_back(my_config.head.value()); break;
-    case 1: objv.push_back(my_config.get.value()); break;
-    case 2: objv.push_back(my_config.post.value()); break;
-    case 3: objv.push_back(my_config.put.value()); break;
-    case 4: objv.push_back(my_config.delete_.value()); break;
-    case 5: objv.push_back(my_config.req_target.value()); break;
-    case 6: objv.push_back(my_config.req_body.value()); break;
-    case 7: objv.push_back(my_config.req_headers.value()); break;
-    case 8: objv.push_back(my_config.host.value()); break;
-    case 9: objv.push_back(my_config.port.value()); break;
-    case 10: objv.push_back(my_config.options.value()); break;
-    case 11: objv.push_back(my_config.exit_target.value()); break;
-    case 12: objv.push_back(my_config.max_connections.value()); break;
-    default: return TCL_ERROR;
+      auto& c = *event->pending;
+      std::lock_guard lock(c->mutex);
+      // tcl_handler's mutex is not recursive: leave the event queued until
+      // the request which entered the event loop has returned
+      if (c->state != call::state::abandoned && *c->busy)
+        return 0;
     }
-    auto list = Tcl_NewListObj(objv.size(), objv.data());
-    Tcl_SetObjResult(i, list);
-    return TCL_OK;
-  }
 
-  // require odd number of arguments
-  if (objc % 2 == 0)
-  {
-    Tcl_WrongNumArgs(
-      i,
-      objc,
-      objv,
-      "?-host host? ?-port port? ?-head headCmd? ?-get getCmd? "
-      "?-post postCmd? ?-put "
-      "putCmd? ?-delete delCmd? ?-options optCmd? ?-reqtargetvariable varName? "
-      "?-reqbodyvariable varName? ?-reqheadersvariable varName? ?-exittarget "
-      "target? ?-maxconnections n?");
-    return TCL_ERROR;
-  }
+    auto c = std::move(*event->pending);
+    delete event->pending;
 
-  if (objc == 1)
-  {
-    // return list of configuration
-    std::vector<Tcl_Obj*> objv;
-    objv.reserve(20);
-    objv.push_back(Tcl_NewStringObj("-host", -1));
-    objv.push_back(my_config.host.value());
-    objv.push_back(Tcl_NewStringObj("-port", -1));
-    objv.push_back(my_config.port.value());
-    objv.push_back(Tcl_NewStringObj("-head", -1));
-    objv.push_back(my_config.head.value());
-    objv.push_back(Tcl_NewStringObj("-get", -1));
-    objv.push_back(my_config.get.value());
-    objv.push_back(Tcl_NewStringObj("-post", -1));
-    objv.push_back(my_config.post.value());
-    objv.push_back(Tcl_NewStringObj("-put", -1));
-    objv.push_back(my_config.put.value());
-    objv.push_back(Tcl_NewStringObj("-delete", -1));
-    objv.push_back(my_config.delete_.value());
-    objv.push_back(Tcl_NewStringObj("-options", -1));
-    objv.push_back(my_config.options.value());
-    objv.push_back(Tcl_NewStringObj("-reqtargetvariable", -1));
-    objv.push_back(my_config.req_target.value());
-    objv.push_back(Tcl_NewStringObj("-reqbodyvariable", -1));
-    objv.push_back(my_config.req_body.value());
-    objv.push_back(Tcl_NewStringObj("-reqheadersvariable", -1));
-    objv.push_back(my_config.req_headers.value());
-    objv.push_back(Tcl_NewStringObj("-exittarget", -1));
-    objv.push_back(my_config.exit_target.value());
-    objv.push_back(Tcl_NewStringObj("-maxconnections", -1));
-    objv.push_back(my_config.max_connections.value());
+    {
+      std::lock_guard lock(c->mutex);
+      if (c->state == call::state::abandoned)
+        return 1;
+      c->state = call::state::running;
+    }
 
-    auto list = Tcl_NewListObj(objv.size(), objv.data());
-    Tcl_SetObjResult(i, list);
-    return TCL_OK;
+    *c->busy = true;
+    try
+    {
+      c->run();
+    }
+    catch (std::exception const&)
+    {
+      // the waiting thread answers with 503
+    }
+    *c->busy = false;
+
+    {
+      std::lock_guard lock(c->mutex);
+      c->state = call::state::done;
+    }
+    c->cv.notify_one();
+    return 1;
   }
 
-  for (auto idx = 1; idx < objc - 1; idx += 2)
+  template <typename R, typename F>
+  R
+  dispatch(R&& unavailable, F&& f)
   {
-    int opt{ -1 };
-    if (Tcl_GetIndexFromObj(i, objv[idx], options, "option", 0, &opt) != TCL_OK)
-      return TCL_ERROR;
+    std::optional<R> result;
+    auto             c = std::make_shared<call>();
+    c->run             = [&] { result.emplace(f(handler_)); };
+    c->busy            = busy_;
 
-    auto obj = objv[idx + 1];
+    {
+      std::lock_guard lock(mutex_);
+      if (stopping_)
+        return std::move(unavailable);
+      calls_.insert(c.get());
+    }
+
+    auto event
+      = reinterpret_cast<call_event*>(Tcl_Alloc(sizeof(call_event)));
+    event->header.proc = process;
+    event->pending     = new std::shared_ptr<call>(c);
+    Tcl_ThreadQueueEvent(owner_, &event->header, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(owner_);
 
-    switch (opt)
+    {
+      std::unique_lock lock(c->mutex);
+      c->cv.wait(lock, [&c] {
+        return c->state == call::state::done
+               || c->state == call::state::abandoned;
+      });
+    }
+
+    {
+      std::lock_guard lock(mutex_);
+      calls_.erase(c.get());
+    }
+
+    if (! result)
+      return std::move(unavailable);
+    return std::move(*result);
+  }
+
+  static get_r
+  unavailable()
+  {
+    return { 503, std::nullopt, "The server is stopping.", "text/plain" };
+  }
+
+  // Produces the chunks of a streamed body on the interpreter's thread.
+  class event_source final : public http_tcl::chunk_source
+  {
+    event_loop_handler&                     owner_;
+    std::shared_ptr<http_tcl::chunk_source> source_;
+
+  public:
+    event_source(event_loop_handler&                     owner,
+                 std::shared_ptr<http_tcl::chunk_source> source)
+        : owner_(owner)
+        , source_(std::move(source))
+    {
+    }
+
+    std::optional<std::string>
+    next() override
+    {
+      auto chunk = owner_.dispatch(std::optional<std::optional<std::string>>{},
+                                   [this](tcl_handler&) {
+                                     return source_->next();
+                                   });
+      if (! chunk)
+        throw std::runtime_error("The server is stopping.");
+      return std::move(*chunk);
+    }
+  };
+
+  template <typename R>
+  R
+  pin(R&& result)
+  {
+    auto& body = std::get<2>(result);
+    if (body.chunks())
+      body = http_tcl::response_body{
+        std::make_shared<event_source>(*this, body.chunks())
+      };
+    return std::move(result);
+  }
+
+public:
+  explicit event_loop_handler(tcl_handler& handler)
+      : handler_(handler)
+      , owner_(Tcl_GetCurrentThread())
+  {
+  }
+
+  // Answers requests still waiting in the event queue with 503, so that
+  // stopping the server, which joins the I/O threads, cannot wait on an
+  // interpreter which is busy stopping it.
+  void
+  shutdown()
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+    for (auto c: calls_)
+    {
+      {
+        std::lock_guard call_lock(c->mutex);
+        if (c->state == call::state::queued)
+          c->state = call::state::abandoned;
+      }
+      c->cv.notify_one();
+    }
+  }
+
+  options_r
+  options(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override
+  {
+    return pin(dispatch(unavailable(), [&](tcl_handler& h) {
+      return h.options(target, body, std::move(get_headers));
+    }));
+  }
+
+  head_r
+  head(std::string_view target, headers_access&& get_headers) override
+  {
+    return dispatch(head_r{ 503, std::nullopt, 0, "text/plain" },
+                    [&](tcl_handler& h) {
+                      return h.head(target, std::move(get_headers));
+                    });
+  }
+
+  get_r
+  get(std::string_view target, headers_access&& get_headers) override
+  {
+    return pin(dispatch(unavailable(), [&](tcl_handler& h) {
+      return h.get(target, std::move(get_headers));
+    }));
+  }
+
+  post_r
+  post(std::string_view target,
+       std::string_view body,
+       headers_access&& get_headers) override
+  {
+    return pin(dispatch(unavailable(), [&](tcl_handler& h) {
+      return h.post(target, body, std::move(get_headers));
+    }));
+  }
+
+  put_r
+  put(std::string_view target,
+      std::string_view body,
+      headers_access&& get_headers) override
+  {
+    return dispatch(put_r{ 503, std::nullopt }, [&](tcl_handler& h) {
+      return h.put(target, body, std::move(get_headers));
+    });
+  }
+
+  delete_r
+  delete_(std::string_view target,
+          std::string_view body,
+          headers_access&& get_headers) override
+  {
+    return pin(dispatch(unavailable(), [&](tcl_handler& h) {
+      return h.delete_(target, body, std::move(get_headers));
+    }));
+  }
+};
+
+// Callbacks of requests made with 'http client -async', run on the thread of
+// the interpreter which made them.
+class async_requests : public std::enable_shared_from_this<async_requests>
+{
+  struct done_event
+  {
+    Tcl_Event                        header;
+    std::shared_ptr<async_requests>* owner;
+    uint64_t                         id;
+    http_tcl::client_result*         result;
+  };
+
+  struct pending
+  {
+    uint64_t request;
+    TclObj   cmd;
+  };
+
+  Tcl_Interp*                 interp_{ nullptr };
+  Tcl_ThreadId                thread_{ nullptr };
+  std::mutex                  mutex_;
+  bool                        closed_{ false };
+  uint64_t                    next_id_{ 1 };
+  std::map<uint64_t, pending> pending_;
+
+  // runs on the interpreter's thread
+  static int
+  process(Tcl_Event* ev, int flags)
+  {
+    if (! (flags & TCL_FILE_EVENTS))
+      return 0;
+
+    auto event  = reinterpret_cast<done_event*>(ev);
+    auto self   = std::move(*event->owner);
+    auto result = std::unique_ptr<http_tcl::client_result>(event->result);
+    delete event->owner;
+
+    TclObj cmd{ nullptr };
+    {
+      std::lock_guard lock(self->mutex_);
+      auto            it = self->pending_.find(event->id);
+      if (self->closed_ || it == self->pending_.end())
+        return 1;
+      cmd = std::move(it->second.cmd);
+      self->pending_.erase(it);
+    }
+
+    auto  i                 = self->interp_;
+    auto& [sc, heads, body] = *result;
+
+    Tcl_Obj** prefix{ nullptr };
+    int       prefix_count{ 0 };
+    if (Tcl_ListObjGetElements(i, cmd.value(), &prefix_count, &prefix)
+        != TCL_OK)
+    {
+      Tcl_BackgroundException(i, TCL_ERROR);
+      return 1;
+    }
+
+    std::vector<Tcl_Obj*> objv(prefix, prefix + prefix_count);
+    objv.push_back(Tcl_NewIntObj(sc));
+    objv.push_back(to_dict(i, heads));
+    objv.push_back(Tcl_NewStringObj(body.data(), body.size()));
+
+    Tcl_Preserve(i);
+    for (auto obj: objv)
+      Tcl_IncrRefCount(obj);
+    auto res = Tcl_EvalObjv(i, objv.size(), objv.data(), TCL_EVAL_GLOBAL);
+    if (res != TCL_OK)
+      Tcl_BackgroundException(i, res);
+    for (auto obj: objv)
+      Tcl_DecrRefCount(obj);
+    Tcl_Release(i);
+    return 1;
+  }
+
+public:
+  void
+  init(Tcl_Interp* i)
+  {
+    interp_ = i;
+    thread_ = Tcl_GetCurrentThread();
+  }
+
+  // starts a request whose response is passed to cmd, and returns its id
+  uint64_t
+  start(std::string_view                        method,
+        std::string                             host,
+        std::string                             port,
+        std::string                             target,
+        std::optional<http_tcl::headers> const& headers,
+        std::string_view                        body,
+        std::chrono::milliseconds               timeout,
+        Tcl_Obj*                                cmd)
+  {
+    std::lock_guard lock(mutex_);
+    auto const      id      = next_id_++;
+    auto const      request = http_tcl::http_client_async(
+      method,
+      std::move(host),
+      std::move(port),
+      std::move(target),
+      headers,
+      body,
+      timeout,
+      [owner = std::weak_ptr(shared_from_this()),
+       id](http_tcl::client_result&& result) {
+        auto self = owner.lock();
+        if (! self)
+          return;
+
+        std::lock_guard lock(self->mutex_);
+        if (self->closed_)
+          return;
+
+        auto event
+          = reinterpret_cast<done_event*>(Tcl_Alloc(sizeof(done_event)));
+        event->header.proc = process;
+        event->owner       = new std::shared_ptr<async_requests>(self);
+        event->id          = id;
+        event->result      = new http_tcl::client_result(std::move(result));
+        Tcl_ThreadQueueEvent(self->thread_, &event->header, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(self->thread_);
+      });
+    pending_.emplace(id, pending{ request, TclObj{ cmd } });
+    return id;
+  }
+
+  // forgets the callback of a pending request and cancels it
+  bool
+  cancel(uint64_t id)
+  {
+    uint64_t request{ 0 };
+    {
+      std::lock_guard lock(mutex_);
+      auto            it = pending_.find(id);
+      if (it == pending_.end())
+        return false;
+      request = it->second.request;
+      pending_.erase(it);
+    }
+    http_tcl::http_client_cancel(request);
+    return true;
+  }
+
+  // drops the callbacks of pending requests; their responses are ignored
+  void
+  close()
+  {
+    std::lock_guard lock(mutex_);
+    closed_ = true;
+    pending_.clear();
+  }
+};
+
+struct client_data
+{
+  tcl_handler handler;
+
+  // callbacks of 'http client -async'
+  std::shared_ptr<async_requests> requests{
+    std::make_shared<async_requests>()
+  };
+
+  // state of a server started in the background by 'http start'
+  std::unique_ptr<http_tcl::worker_pool>    pool;
+  std::unique_ptr<event_loop_handler>       events;
+  std::unique_ptr<http_tcl::router>         router;
+  std::unique_ptr<http_tcl::compressor>     compressor;
+  std::unique_ptr<http_tcl::static_files>   statics;
+  std::unique_ptr<http_tcl::metrics_target> metrics;
+  std::unique_ptr<http_tcl::server>         server;
+
+  // shared with 'http purge' in worker interpreters; use atomic access
+  std::shared_ptr<http_tcl::response_cache> cache;
+
+  ~client_data() { requests->close(); }
+
+  void
+  init(Tcl_Interp*);
+
+  void
+  stop();
+
+  // stops the server once the handler which asked for it has returned
+  static void
+  stop_when_idle(ClientData cd);
+};
+
+void
+client_data::init(Tcl_Interp* i)
+{
+  handler.init(i);
+  requests->init(i);
+}
+
+void
+client_data::stop()
+{
+  Tcl_CancelIdleCall(stop_when_idle, this);
+  if (events)
+    events->shutdown();
+  server.reset();
+  metrics.reset();
+  statics.reset();
+  std::atomic_store(&cache, {});
+  compressor.reset();
+  router.reset();
+  pool.reset();
+  events.reset();
+  handler.release_bodies();
+}
+
+void
+client_data::stop_when_idle(ClientData cd)
+{
+  static_cast<client_data*>(cd)->stop();
+}
+
+// global
+client_data theClientData;
+
+int
+define_commands(Tcl_Interp* i, client_data* cd, bool server_commands);
+
+// Whether request bodies can be spooled to dir: empty for the system's
+// temporary directory, or else an existing directory this process may write.
+bool
+spool_dir_usable(std::string_view dir)
+{
+  if (dir.empty())
+    return true;
+
+  std::filesystem::path path{ dir };
+  std::error_code       ec;
+  if (! std::filesystem::is_directory(path, ec))
+    return false;
+#ifndef _WIN32
+  return ::access(path.c_str(), W_OK | X_OK) == 0;
+#else
+  return true;
+#endif
+}
+
+//
+
+int
+configure(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  static const char* options[] = { "-head",
+                                   "-get",
+                                   "-post",
+                                   "-put",
+                                   "-delete",
+                                   "-reqtargetvariable",
+                                   "-reqbodyvariable",
+                                   "-reqheadersvariable",
+                                   "-host",
+                                   "-port",
+                                   "-options",
+                                   "-exittarget",
+                                   "-maxconnections",
+                                   "-iothreads",
+                                   "-workers",
+                                   "-workerinit",
+                                   "-backlog",
+                                   "-overflow",
+                                   "-callstyle",
+                                   "-staticroot",
+                                   "-staticprefix",
+                                   "-cachesize",
+                                   "-clientmaxidle",
+                                   "-clientidletimeout",
+                                   "-clientdnsttl",
+                                   "-clientdnsfailurettl",
+                                   "-maxbodysize",
+                                   "-spoolthreshold",
+                                   "-spooldir",
+                                   "-compress",
+                                   "-reqqueryvariable",
+                                   "-metricstarget",
+                                   nullptr };
+  static const char* call_styles[] = { "script", "args", nullptr };
+
+  auto  cd_ptr    = static_cast<client_data*>(cd);
+  auto& my_config = cd_ptr->handler.config();
+
+  if (objc == 2)
+  {
+    // return value of single option
+    int opt{ -1 };
+    if (Tcl_GetIndexFromObj(i, objv[1], options, "option", 0, &opt) != TCL_OK)
+      return TCL_ERROR;
+
+    std::vector<Tcl_Obj*> objv;
+    switch (opt)
+    {
+    case 0: objv.push_back(my_config.head.value()); break;
+    case 1: objv.push_back(my_config.get.value()); break;
+    case 2: objv.push_back(my_config.post.value()); break;
+    case 3: objv.push_back(my_config.put.value()); break;
+    case 4: objv.push_back(my_config.delete_.value()); break;
+    case 5: objv.push_back(my_config.req_target.value()); break;
+    case 6: objv.push_back(my_config.req_body.value()); break;
+    case 7: objv.push_back(my_config.req_headers.value()); break;
+    case 8: objv.push_back(my_config.host.value()); break;
+    case 9: objv.push_back(my_config.port.value()); break;
+    case 10: objv.push_back(my_config.options.value()); break;
+    case 11: objv.push_back(my_config.exit_target.value()); break;
+    case 12: objv.push_back(my_config.max_connections.value()); break;
+    case 13: objv.push_back(my_config.io_threads.value()); break;
+    case 14: objv.push_back(my_config.workers.value()); break;
+    case 15: objv.push_back(my_config.worker_init.value()); break;
+    case 16: objv.push_back(my_config.backlog.value()); break;
+    case 17: objv.push_back(my_config.overflow.value()); break;
+    case 18: objv.push_back(my_config.call_style.value()); break;
+    case 19: objv.push_back(my_config.static_root.value()); break;
+    case 20: objv.push_back(my_config.static_prefix.value()); break;
+    case 21: objv.push_back(my_config.cache_size.value()); break;
+    case 22: objv.push_back(my_config.client_max_idle.value()); break;
+    case 23: objv.push_back(my_config.client_idle_timeout.value()); break;
+    case 24: objv.push_back(my_config.client_dns_ttl.value()); break;
+    case 25: objv.push_back(my_config.client_dns_failure_ttl.value()); break;
+    case 26: objv.push_back(my_config.max_body_size.value()); break;
+    case 27: objv.push_back(my_config.spool_threshold.value()); break;
+    case 28: objv.push_back(my_config.spool_dir.value()); break;
+    case 29: objv.push_back(my_config.compress.value()); break;
+    case 30: objv.push_back(my_config.req_query.value()); break;
+    case 31: objv.push_back(my_config.metrics_target.value()); break;
+    default: return TCL_ERROR;
+    }
+    auto list = Tcl_NewListObj(objv.size(), objv.data());
+    Tcl_SetObjResult(i, list);
+    return TCL_OK;
+  }
+
+  // require odd number of arguments
+  if (objc % 2 == 0)
+  {
+    Tcl_WrongNumArgs(
+      i,
+      objc,
+      objv,
+      "?-host host? ?-port port? ?-head headCmd? ?-get getCmd? "
+      "?-post postCmd? ?-put "
+      "putCmd? ?-delete delCmd? ?-options optCmd? ?-reqtargetvariable varName? "
+      "?-reqbodyvariable varName? ?-reqheadersvariable varName? ?-exittarget "
+      "target? ?-maxconnections n? ?-iothreads n? ?-workers n? ?-workerinit "
+      "script? ?-backlog n? ?-overflow queue|reject|close? ?-callstyle "
+      "script|args? ?-staticroot dir? ?-staticprefix prefix? ?-cachesize "
+      "bytes? ?-clientmaxidle n? ?-clientidletimeout ms? ?-clientdnsttl ms? "
+      "?-clientdnsfailurettl ms? ?-maxbodysize bytes? ?-spoolthreshold "
+      "bytes? ?-spooldir dir? ?-compress options? ?-reqqueryvariable "
+      "varName? ?-metricstarget target?");
+    return TCL_ERROR;
+  }
+
+  if (objc == 1)
+  {
+    // return list of configuration
+    std::vector<Tcl_Obj*> objv;
+    objv.reserve(64);
+    objv.push_back(Tcl_NewStringObj("-host", -1));
+    objv.push_back(my_config.host.value());
+    objv.push_back(Tcl_NewStringObj("-port", -1));
+    objv.push_back(my_config.port.value());
+    objv.push_back(Tcl_NewStringObj("-head", -1));
+    objv.push_back(my_config.head.value());
+    objv.push_back(Tcl_NewStringObj("-get", -1));
+    objv.push_back(my_config.get.value());
+    objv.push_back(Tcl_NewStringObj("-post", -1));
+    objv.push_back(my_config.post.value());
+    objv.push_back(Tcl_NewStringObj("-put", -1));
+    objv.push_back(my_config.put.value());
+    objv.push_back(Tcl_NewStringObj("-delete", -1));
+    objv.push_back(my_config.delete_.value());
+    objv.push_back(Tcl_NewStringObj("-options", -1));
+    objv.push_back(my_config.options.value());
+    objv.push_back(Tcl_NewStringObj("-reqtargetvariable", -1));
+    objv.push_back(my_config.req_target.value());
+    objv.push_back(Tcl_NewStringObj("-reqbodyvariable", -1));
+    objv.push_back(my_config.req_body.value());
+    objv.push_back(Tcl_NewStringObj("-reqheadersvariable", -1));
+    objv.push_back(my_config.req_headers.value());
+    objv.push_back(Tcl_NewStringObj("-exittarget", -1));
+    objv.push_back(my_config.exit_target.value());
+    objv.push_back(Tcl_NewStringObj("-maxconnections", -1));
+    objv.push_back(my_config.max_connections.value());
+    objv.push_back(Tcl_NewStringObj("-iothreads", -1));
+    objv.push_back(my_config.io_threads.value());
+    objv.push_back(Tcl_NewStringObj("-workers", -1));
+    objv.push_back(my_config.workers.value());
+    objv.push_back(Tcl_NewStringObj("-workerinit", -1));
+    objv.push_back(my_config.worker_init.value());
+    objv.push_back(Tcl_NewStringObj("-backlog", -1));
+    objv.push_back(my_config.backlog.value());
+    objv.push_back(Tcl_NewStringObj("-overflow", -1));
+    objv.push_back(my_config.overflow.value());
+    objv.push_back(Tcl_NewStringObj("-callstyle", -1));
+    objv.push_back(my_config.call_style.value());
+    objv.push_back(Tcl_NewStringObj("-staticroot", -1));
+    objv.push_back(my_config.static_root.value());
+    objv.push_back(Tcl_NewStringObj("-staticprefix", -1));
+    objv.push_back(my_config.static_prefix.value());
+    objv.push_back(Tcl_NewStringObj("-cachesize", -1));
+    objv.push_back(my_config.cache_size.value());
+    objv.push_back(Tcl_NewStringObj("-clientmaxidle", -1));
+    objv.push_back(my_config.client_max_idle.value());
+    objv.push_back(Tcl_NewStringObj("-clientidletimeout", -1));
+    objv.push_back(my_config.client_idle_timeout.value());
+    objv.push_back(Tcl_NewStringObj("-clientdnsttl", -1));
+    objv.push_back(my_config.client_dns_ttl.value());
+    objv.push_back(Tcl_NewStringObj("-clientdnsfailurettl", -1));
+    objv.push_back(my_config.client_dns_failure_ttl.value());
+    objv.push_back(Tcl_NewStringObj("-maxbodysize", -1));
+    objv.push_back(my_config.max_body_size.value());
+    objv.push_back(Tcl_NewStringObj("-spoolthreshold", -1));
+    objv.push_back(my_config.spool_threshold.value());
+    objv.push_back(Tcl_NewStringObj("-spooldir", -1));
+    objv.push_back(my_config.spool_dir.value());
+    objv.push_back(Tcl_NewStringObj("-compress", -1));
+    objv.push_back(my_config.compress.value());
+    objv.push_back(Tcl_NewStringObj("-reqqueryvariable", -1));
+    objv.push_back(my_config.req_query.value());
+    objv.push_back(Tcl_NewStringObj("-metricstarget", -1));
+    objv.push_back(my_config.metrics_target.value());
+
+    auto list = Tcl_NewListObj(objv.size(), objv.data());
+    Tcl_SetObjResult(i, list);
+    return TCL_OK;
+  }
+
+  bool client_pool_changed{ false };
+  for (auto idx = 1; idx < objc - 1; idx += 2)
+  {
+    int opt{ -1 };
+    if (Tcl_GetIndexFromObj(i, objv[idx], options, "option", 0, &opt) != TCL_OK)
+      return TCL_ERROR;
+
+    auto obj = objv[idx + 1];
+
+    switch (opt)
     {
     case 0: my_config.head = obj; break;
     case 1: my_config.get = obj; break;
@@ -581,195 +1555,1412 @@ configure(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
     case 10: my_config.options = obj; break;
     case 11: my_config.exit_target = obj; break;
     case 12: my_config.max_connections = obj; break;
+    case 13: my_config.io_threads = obj; break;
+    case 14: my_config.workers = obj; break;
+    case 15: my_config.worker_init = obj; break;
+    case 16: my_config.backlog = obj; break;
+    case 17: my_config.overflow = obj; break;
+    case 18:
+    {
+      int style{ -1 };
+      if (Tcl_GetIndexFromObj(i, obj, call_styles, "call style", 0, &style)
+          != TCL_OK)
+        return TCL_ERROR;
+      my_config.call_style = Tcl_NewStringObj(call_styles[style], -1);
+      break;
+    }
+    case 19: my_config.static_root = obj; break;
+    case 20: my_config.static_prefix = obj; break;
+    case 21: my_config.cache_size = obj; break;
+    case 22:
+    case 23:
+    case 24:
+    case 25:
+    {
+      int n{ 0 };
+      if (Tcl_GetIntFromObj(i, obj, &n) != TCL_OK)
+        return TCL_ERROR;
+      TclObj config_t::*fields[] = { &config_t::client_max_idle,
+                                     &config_t::client_idle_timeout,
+                                     &config_t::client_dns_ttl,
+                                     &config_t::client_dns_failure_ttl };
+      my_config.*fields[opt - 22] = obj;
+      client_pool_changed         = true;
+      break;
+    }
+    case 26: my_config.max_body_size = obj; break;
+    case 27: my_config.spool_threshold = obj; break;
+    case 28:
+      if (! spool_dir_usable(get_string(obj)))
+      {
+        Tcl_SetObjResult(
+          i, Tcl_NewStringObj("-spooldir is not a writable directory.", -1));
+        return TCL_ERROR;
+      }
+      my_config.spool_dir = obj;
+      break;
+    case 29: my_config.compress = obj; break;
+    case 30: my_config.req_query = obj; break;
+    case 31: my_config.metrics_target = obj; break;
     default: return TCL_ERROR;
     }
   }
+
+  // the client pool is shared by the whole process, so it changes now
+  // rather than when a server starts
+  if (client_pool_changed)
+  {
+    http_tcl::client_pool_options pool;
+    int                           n{ 0 };
+    if (Tcl_GetIntFromObj(nullptr, my_config.client_max_idle.value(), &n)
+        == TCL_OK)
+      pool.max_idle_per_host = n;
+    if (Tcl_GetIntFromObj(nullptr, my_config.client_idle_timeout.value(), &n)
+        == TCL_OK)
+      pool.idle_timeout = std::chrono::milliseconds{ n };
+    if (Tcl_GetIntFromObj(nullptr, my_config.client_dns_ttl.value(), &n)
+        == TCL_OK)
+      pool.dns_ttl = std::chrono::milliseconds{ n };
+    if (Tcl_GetIntFromObj(
+          nullptr, my_config.client_dns_failure_ttl.value(), &n)
+        == TCL_OK)
+      pool.dns_failure_ttl = std::chrono::milliseconds{ n };
+    http_tcl::set_client_pool_options(pool);
+  }
+  return TCL_OK;
+}
+
+// Sets one of the options shared by 'http client' and 'http client_multi'.
+int
+set_request_option(Tcl_Interp*               i,
+                   int                       opt,
+                   Tcl_Obj*                  obj,
+                   http_tcl::client_request& req)
+{
+  switch (opt)
+  {
+  case 0: req.host = get_string(obj); break;
+  case 1: req.port = get_string(obj); break;
+  case 2: req.target = get_string(obj); break;
+  case 3: req.method = get_string(obj); break;
+  case 4: req.body = get_string(obj); break;
+  case 5: req.headers = get_dict(i, obj); break;
+  default: return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+int
+get_timeout(Tcl_Interp* i, Tcl_Obj* obj, int& timeout)
+{
+  if (Tcl_GetIntFromObj(i, obj, &timeout) != TCL_OK)
+    return TCL_ERROR;
+  if (timeout < 0)
+  {
+    Tcl_SetObjResult(i,
+                     Tcl_NewStringObj("-timeout must not be negative.", -1));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+Tcl_Obj*
+to_list(Tcl_Interp* i, http_tcl::client_result const& result)
+{
+  auto& [sc, heads, body] = result;
+
+  std::vector<Tcl_Obj*> resv{
+    Tcl_NewStringObj(std::to_string(sc).c_str(), -1),
+    to_dict(i, heads),
+    Tcl_NewStringObj(body.data(), body.size()),
+  };
+  return Tcl_NewListObj(resv.size(), resv.data());
+}
+
+int
+http_client(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  static const char* options[] = { "-host",       "-port",    "-target",
+                                   "-method",     "-body",    "-headers",
+                                   "-timeout",    "-async",   "-outchannel",
+                                   "-outfile",    nullptr };
+
+  auto const error = [&i, &objc, &objv] {
+    Tcl_WrongNumArgs(
+      i,
+      objc,
+      objv,
+      "?-host host? ?-port port? ?-target target? ?-method http-method? "
+      "?-body body? ?-headers headerDict? ?-timeout ms? ?-async cmd? "
+      "?-outchannel channel? ?-outfile path?");
+    return TCL_ERROR;
+  };
+
+  // require odd number of arguments
+  if (objc % 2 == 0)
+    return error();
+
+  http_tcl::client_request req;
+  int                      timeout{ 0 };
+  Tcl_Obj*                 async_cmd{ nullptr };
+  Tcl_Obj*                 out_channel{ nullptr };
+  Tcl_Obj*                 out_file{ nullptr };
+
+  for (auto idx = 1; idx < objc - 1; idx += 2)
+  {
+    int opt{ -1 };
+    if (Tcl_GetIndexFromObj(i, objv[idx], options, "option", 0, &opt) != TCL_OK)
+      return TCL_ERROR;
+
+    auto obj = objv[idx + 1];
+
+    switch (opt)
+    {
+    case 6:
+      if (get_timeout(i, obj, timeout) != TCL_OK)
+        return TCL_ERROR;
+      break;
+    case 7: async_cmd = obj; break;
+    case 8: out_channel = obj; break;
+    case 9: out_file = obj; break;
+    default:
+      if (set_request_option(i, opt, obj, req) != TCL_OK)
+        return TCL_ERROR;
+    }
+  }
+
+  if (req.host.empty())
+    return error();
+
+  tolower(req.method);
+
+  // stream the body into a channel as it arrives; channels belong to this
+  // thread, so the request runs here
+  if (out_channel || out_file)
+  {
+    if (async_cmd || timeout > 0 || (out_channel && out_file))
+    {
+      Tcl_SetObjResult(i,
+                       Tcl_NewStringObj("-outchannel and -outfile cannot be "
+                                        "combined with each other, -async "
+                                        "or -timeout.",
+                                        -1));
+      return TCL_ERROR;
+    }
+
+    Tcl_Channel chan{ nullptr };
+    if (out_channel)
+    {
+      int mode{ 0 };
+      chan = Tcl_GetChannel(i, Tcl_GetString(out_channel), &mode);
+      if (! chan)
+        return TCL_ERROR;
+      if (! (mode & TCL_WRITABLE))
+      {
+        Tcl_SetObjResult(
+          i, Tcl_NewStringObj("-outchannel is not writable.", -1));
+        return TCL_ERROR;
+      }
+    }
+    else
+    {
+      chan = Tcl_OpenFileChannel(i, Tcl_GetString(out_file), "w", 0666);
+      if (! chan)
+        return TCL_ERROR;
+      Tcl_SetChannelOption(nullptr, chan, "-translation", "binary");
+    }
+
+    auto result = http_tcl::http_client(
+      req.method,
+      req.host,
+      req.port,
+      req.target,
+      req.headers,
+      req.body,
+      [chan](char const* data, std::size_t size) {
+        return Tcl_Write(chan, data, static_cast<int>(size)) >= 0;
+      });
+
+    if (out_file && Tcl_Close(i, chan) != TCL_OK)
+      return TCL_ERROR;
+
+    Tcl_SetObjResult(i, to_list(i, result));
+    return TCL_OK;
+  }
+
+  // with -async, return the request's id; the response is passed to the
+  // command from the event loop
+  if (async_cmd)
+  {
+    auto cd_ = static_cast<client_data*>(cd);
+    auto id  = cd_->requests->start(req.method,
+                                   req.host,
+                                   req.port,
+                                   req.target,
+                                   req.headers,
+                                   req.body,
+                                   std::chrono::milliseconds{ timeout },
+                                   async_cmd);
+    Tcl_SetObjResult(i, Tcl_NewWideIntObj(static_cast<Tcl_WideInt>(id)));
+    return TCL_OK;
+  }
+
+  // a synchronous request with a timeout is a batch of one
+  http_tcl::client_result result;
+  if (timeout > 0)
+    result = std::move(
+      http_tcl::http_client_multi({ req },
+                                  std::chrono::milliseconds{ timeout },
+                                  1)
+        .front());
+  else
+    result = http_tcl::http_client(
+      req.method, req.host, req.port, req.target, req.headers, req.body);
+
+  Tcl_SetObjResult(i, to_list(i, result));
+  return TCL_OK;
+}
+
+int
+client_multi(ClientData, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  static const char* request_options[] = { "-host",   "-port", "-target",
+                                           "-method", "-body", "-headers",
+                                           nullptr };
+  static const char* options[] = { "-timeout", "-concurrency", nullptr };
+
+  if (objc % 2 != 0)
+  {
+    Tcl_WrongNumArgs(
+      i, objc, objv, "requestList ?-timeout ms? ?-concurrency n?");
+    return TCL_ERROR;
+  }
+
+  int timeout{ 0 };
+  int concurrency{ 0 };
+  for (auto idx = 2; idx < objc - 1; idx += 2)
+  {
+    int opt{ -1 };
+    if (Tcl_GetIndexFromObj(i, objv[idx], options, "option", 0, &opt) != TCL_OK)
+      return TCL_ERROR;
+
+    auto obj = objv[idx + 1];
+    if (opt == 0 && get_timeout(i, obj, timeout) != TCL_OK)
+      return TCL_ERROR;
+    if (opt == 1 && Tcl_GetIntFromObj(i, obj, &concurrency) != TCL_OK)
+      return TCL_ERROR;
+  }
+
+  // each request is a list of the options of 'http client'
+  Tcl_Obj** specs{ nullptr };
+  int       spec_count{ 0 };
+  if (Tcl_ListObjGetElements(i, objv[1], &spec_count, &specs) != TCL_OK)
+    return TCL_ERROR;
+
+  std::vector<http_tcl::client_request> reqs(spec_count);
+  for (auto n = 0; n < spec_count; ++n)
+  {
+    Tcl_Obj** elems{ nullptr };
+    int       count{ 0 };
+    if (Tcl_ListObjGetElements(i, specs[n], &count, &elems) != TCL_OK)
+      return TCL_ERROR;
+    if (count % 2 != 0)
+    {
+      Tcl_SetObjResult(
+        i, Tcl_NewStringObj("request needs option value pairs.", -1));
+      return TCL_ERROR;
+    }
+
+    auto& req = reqs[n];
+    for (auto idx = 0; idx < count; idx += 2)
+    {
+      int opt{ -1 };
+      if (Tcl_GetIndexFromObj(
+            i, elems[idx], request_options, "option", 0, &opt)
+            != TCL_OK
+          || set_request_option(i, opt, elems[idx + 1], req) != TCL_OK)
+        return TCL_ERROR;
+    }
+
+    if (req.host.empty())
+    {
+      Tcl_SetObjResult(i, Tcl_NewStringObj("request needs -host.", -1));
+      return TCL_ERROR;
+    }
+    tolower(req.method);
+  }
+
+  auto results = http_tcl::http_client_multi(
+    reqs, std::chrono::milliseconds{ timeout }, concurrency);
+
+  std::vector<Tcl_Obj*> resv;
+  resv.reserve(results.size());
+  for (auto const& result: results)
+    resv.push_back(to_list(i, result));
+  Tcl_SetObjResult(i, Tcl_NewListObj(resv.size(), resv.data()));
+  return TCL_OK;
+}
+
+int
+http_cancel(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  if (objc != 2)
+  {
+    Tcl_WrongNumArgs(i, objc, objv, "id");
+    return TCL_ERROR;
+  }
+
+  Tcl_WideInt id{ 0 };
+  if (Tcl_GetWideIntFromObj(i, objv[1], &id) != TCL_OK)
+    return TCL_ERROR;
+
+  auto cd_       = static_cast<client_data*>(cd);
+  auto cancelled = cd_->requests->cancel(static_cast<uint64_t>(id));
+  Tcl_SetObjResult(i, Tcl_NewBooleanObj(cancelled));
+  return TCL_OK;
+}
+
+// Returns a function which creates a worker interpreter on the calling
+// thread, evaluates the -workerinit script in it, and returns a handler for
+// it. The interpreter is deleted when the handler is released.
+http_tcl::worker_pool::handler_factory
+make_worker(std::vector<std::string> config)
+{
+  return [config = std::move(config)]()
+           -> std::shared_ptr<http_tcl::alt_handler> {
+    auto interp = Tcl_CreateInterp();
+    auto cd     = new client_data;
+    cd->init(interp);
+    cd->handler.config().from_strings(config);
+
+    std::shared_ptr<client_data> owner{ cd, [](client_data* p) {
+                                         auto i = p->handler.interp();
+                                         p->handler.release_bodies();
+                                         Tcl_DeleteInterp(i);
+                                         delete p;
+                                         Tcl_FinalizeThread();
+                                       } };
+
+    if (Tcl_Init(interp) != TCL_OK
+        || define_commands(interp, cd, false) != TCL_OK
+        || Tcl_EvalObjEx(interp,
+                         cd->handler.config().worker_init.value(),
+                         TCL_EVAL_GLOBAL)
+             != TCL_OK)
+    {
+      auto cs = Tcl_GetVar(interp, "errorInfo", TCL_GLOBAL_ONLY);
+      throw std::runtime_error(cs ? cs : Tcl_GetStringResult(interp));
+    }
+
+    // alias the handler to the lifetime of its client data
+    return { owner, &cd->handler };
+  };
+}
+
+// Server options gathered from the configuration by get_server_settings.
+struct server_settings
+{
+  std::string                               host;
+  int                                       port{ 0 };
+  int                                       io_threads{ 0 };
+  int                                       workers{ 0 };
+  http_tcl::admission_options               admission;
+  http_tcl::body_options                    body;
+  std::optional<http_tcl::compress_options> compress;
+  std::string                               static_root;
+  std::string                               static_prefix;
+  Tcl_WideInt                               cache_size{ 0 };
+  std::vector<http_tcl::router::route>      routes;
+  std::vector<http_tcl::router::method>     fallback;
+  std::string                               metrics_target;
+};
+
+// Method names accepted by 'http route', in the order of router::method.
+static const char* route_methods[]
+  = { "OPTIONS", "HEAD", "GET", "POST", "PUT", "DELETE", nullptr };
+
+// Reads the flat list of method, pattern and command kept by 'http route'.
+int
+get_routes(Tcl_Interp*                           i,
+           Tcl_Obj*                              list,
+           std::vector<http_tcl::router::route>& out)
+{
+  int       objc{ 0 };
+  Tcl_Obj** objv;
+  if (Tcl_ListObjGetElements(i, list, &objc, &objv) != TCL_OK)
+    return TCL_ERROR;
+
+  for (auto idx = 0; idx + 2 < objc; idx += 3)
+  {
+    int verb{ -1 };
+    if (Tcl_GetIndexFromObj(i, objv[idx], route_methods, "method", 0, &verb)
+        != TCL_OK)
+      return TCL_ERROR;
+    out.push_back({ static_cast<http_tcl::router::method>(verb),
+                    std::string{ get_string(objv[idx + 1]) } });
+  }
+  return TCL_OK;
+}
+
+// Reads the dictionary given to -compress; if it is empty, nothing is
+// compressed.
+int
+get_compress_options(Tcl_Interp*                               i,
+                     Tcl_Obj*                                  dict,
+                     std::optional<http_tcl::compress_options>& out)
+{
+  static const char* keys[] = { "minsize", "types", "level", nullptr };
+
+  int size{ 0 };
+  if (Tcl_DictObjSize(i, dict, &size) != TCL_OK)
+    return TCL_ERROR;
+  if (size == 0)
+    return TCL_OK;
+
+  http_tcl::compress_options options;
+  Tcl_DictSearch             search;
+  Tcl_Obj *                  key, *value;
+  int                        done{ 0 };
+  if (Tcl_DictObjFirst(i, dict, &search, &key, &value, &done) != TCL_OK)
+    return TCL_ERROR;
+  auto _ = finally([&search] { Tcl_DictObjDone(&search); });
+
+  for (; ! done; Tcl_DictObjNext(&search, &key, &value, &done))
+  {
+    int opt{ -1 };
+    if (Tcl_GetIndexFromObj(i, key, keys, "compress option", 0, &opt)
+        != TCL_OK)
+      return TCL_ERROR;
+
+    int       n{ 0 };
+    int       objc{ 0 };
+    Tcl_Obj** objv;
+    switch (opt)
+    {
+    case 0:
+      if (Tcl_GetIntFromObj(i, value, &n) != TCL_OK)
+        return TCL_ERROR;
+      options.min_size = static_cast<size_t>(std::max(0, n));
+      break;
+    case 1:
+      if (Tcl_ListObjGetElements(i, value, &objc, &objv) != TCL_OK)
+        return TCL_ERROR;
+      options.types.clear();
+      for (auto idx = 0; idx < objc; ++idx)
+        options.types.emplace_back(get_string(objv[idx]));
+      break;
+    case 2:
+      if (Tcl_GetIntFromObj(i, value, &n) != TCL_OK)
+        return TCL_ERROR;
+      if (n < 1 || n > 9)
+      {
+        Tcl_SetObjResult(
+          i,
+          Tcl_NewStringObj("Invalid compression level: must be 1 to 9.", -1));
+        return TCL_ERROR;
+      }
+      options.level = n;
+      break;
+    }
+  }
+
+  out = std::move(options);
+  return TCL_OK;
+}
+
+int
+get_server_settings(Tcl_Interp* i, config_t& my_config, server_settings& out)
+{
+  int max_connections{ 0 };
+  int backlog{ 0 };
+
+  out.host = get_string(my_config.host.value());
+  if (Tcl_GetIntFromObj(i, my_config.port.value(), &out.port) != TCL_OK)
+  {
+    Tcl_SetObjResult(i, Tcl_NewStringObj("Invalid port number.", -1));
+    return TCL_ERROR;
+  }
+
+  // if bad value or not set, ignore the option and use server's default
+  if (Tcl_GetIntFromObj(i, my_config.max_connections.value(), &max_connections)
+        == TCL_OK
+      && max_connections > 0)
+    out.admission.max_connections = max_connections;
+
+  if (Tcl_GetIntFromObj(i, my_config.backlog.value(), &backlog) == TCL_OK
+      && backlog >= 0)
+    out.admission.backlog = backlog;
+
+  if (auto overflow = get_string(my_config.overflow.value());
+      overflow == "reject")
+    out.admission.overflow = http_tcl::overflow_policy::reject;
+  else if (overflow == "close")
+    out.admission.overflow = http_tcl::overflow_policy::close;
+  else if (! overflow.empty() && overflow != "queue")
+  {
+    Tcl_SetObjResult(i,
+                     Tcl_NewStringObj("Invalid overflow policy: must be "
+                                      "queue, reject or close.",
+                                      -1));
+    return TCL_ERROR;
+  }
+
+  // if bad value or not set, use the synchronous thread-per-connection server
+  if (Tcl_GetIntFromObj(i, my_config.io_threads.value(), &out.io_threads)
+      != TCL_OK)
+    out.io_threads = 0;
+
+  // if bad value or not set, run every request in this interpreter
+  if (Tcl_GetIntFromObj(i, my_config.workers.value(), &out.workers) != TCL_OK)
+    out.workers = 0;
+
+  // routes registered with 'http route'; requests which match none go to the
+  // handler configured for their method, if any
+  if (get_routes(i, my_config.routes.value(), out.routes) != TCL_OK)
+    return TCL_ERROR;
+
+  using method = http_tcl::router::method;
+  for (auto [callback, verb]: { std::pair{ &my_config.options, method::options },
+                                { &my_config.head, method::head },
+                                { &my_config.get, method::get },
+                                { &my_config.post, method::post },
+                                { &my_config.put, method::put },
+                                { &my_config.delete_, method::delete_ } })
+    if (! get_string(callback->value()).empty())
+      out.fallback.push_back(verb);
+
+  // the exit target is handled before the OPTIONS callback
+  if (! get_string(my_config.exit_target.value()).empty())
+    out.fallback.push_back(method::options);
+
+  // if bad value or not set, cache no responses
+  if (Tcl_GetWideIntFromObj(i, my_config.cache_size.value(), &out.cache_size)
+        != TCL_OK
+      || out.cache_size < 0)
+    out.cache_size = 0;
+
+  // if not set, serve no static files
+  out.static_root   = get_string(my_config.static_root.value());
+  out.static_prefix = get_string(my_config.static_prefix.value());
+
+  // if bad value or not set, keep request bodies in memory up to the
+  // server's default limit
+  Tcl_WideInt size{ 0 };
+  if (Tcl_GetWideIntFromObj(i, my_config.max_body_size.value(), &size) == TCL_OK
+      && size > 0)
+    out.body.max_size = static_cast<uint64_t>(size);
+  if (Tcl_GetWideIntFromObj(i, my_config.spool_threshold.value(), &size)
+        == TCL_OK
+      && size > 0)
+    out.body.spool_threshold = static_cast<uint64_t>(size);
+  out.body.spool_dir = get_string(my_config.spool_dir.value());
+
+  if (get_compress_options(i, my_config.compress.value(), out.compress)
+      != TCL_OK)
+    return TCL_ERROR;
+
+  // if not set, metrics are only read with 'http stats'
+  out.metrics_target = get_string(my_config.metrics_target.value());
+
+  Tcl_ResetResult(i);
+  return TCL_OK;
+}
+
+int
+make_pool(Tcl_Interp*                             i,
+          config_t&                               my_config,
+          int                                     workers,
+          std::unique_ptr<http_tcl::worker_pool>& out)
+{
+  try
+  {
+    out = std::make_unique<http_tcl::worker_pool>(
+      workers,
+      make_worker(my_config.to_strings()));
+  }
+  catch (std::exception const& e)
+  {
+    Tcl_SetObjResult(i, Tcl_NewStringObj(e.what(), -1));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+// Puts a router in front of handler if any routes are registered.
+http_tcl::alt_handler*
+maybe_route(server_settings const&             settings,
+            http_tcl::alt_handler*             handler,
+            std::unique_ptr<http_tcl::router>& router)
+{
+  if (settings.routes.empty())
+    return handler;
+
+  router = std::make_unique<http_tcl::router>(handler,
+                                              settings.routes,
+                                              settings.fallback);
+  return router.get();
+}
+
+// Puts a response cache in front of handler if -cachesize is set. Worker
+// interpreters purge it from their own threads, so it is published
+// atomically.
+http_tcl::alt_handler*
+maybe_cache(server_settings const&                     settings,
+            http_tcl::alt_handler*                     handler,
+            std::shared_ptr<http_tcl::response_cache>& cache)
+{
+  if (settings.cache_size == 0)
+    return handler;
+
+  auto made = std::make_shared<http_tcl::response_cache>(
+    handler,
+    static_cast<size_t>(settings.cache_size));
+  std::atomic_store(&cache, made);
+  return made.get();
+}
+
+// Puts a compressor in front of handler if -compress is set. It sits behind
+// the response cache, which then keeps each compressed variant.
+http_tcl::alt_handler*
+maybe_compress(server_settings const&                 settings,
+               http_tcl::alt_handler*                 handler,
+               std::unique_ptr<http_tcl::compressor>& compressor)
+{
+  if (! settings.compress)
+    return handler;
+
+  compressor
+    = std::make_unique<http_tcl::compressor>(handler, *settings.compress);
+  return compressor.get();
+}
+
+// Puts static file serving in front of handler if -staticroot is set.
+http_tcl::alt_handler*
+maybe_serve_static(server_settings const&                   settings,
+                   http_tcl::alt_handler*                   handler,
+                   std::unique_ptr<http_tcl::static_files>& statics)
+{
+  if (settings.static_root.empty())
+    return handler;
+
+  statics = std::make_unique<http_tcl::static_files>(handler,
+                                                     settings.static_root,
+                                                     settings.static_prefix,
+                                                     settings.compress);
+  return statics.get();
+}
+
+// Puts the Prometheus metrics target in front of handler if
+// -metricstarget is set, so that it is answered before any other.
+http_tcl::alt_handler*
+maybe_serve_metrics(server_settings const&                     settings,
+                    http_tcl::alt_handler*                     handler,
+                    std::unique_ptr<http_tcl::metrics_target>& metrics)
+{
+  if (settings.metrics_target.empty())
+    return handler;
+
+  metrics = std::make_unique<http_tcl::metrics_target>(handler,
+                                                       settings.metrics_target);
+  return metrics.get();
+}
+
+int
+run(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  auto  cd_ptr    = static_cast<client_data*>(cd);
+  auto& my_config = cd_ptr->handler.config();
+
+  server_settings settings;
+  if (get_server_settings(i, my_config, settings) != TCL_OK)
+    return TCL_ERROR;
+
+  http_tcl::alt_handler*                 handler = &cd_ptr->handler;
+  std::unique_ptr<http_tcl::worker_pool> pool;
+  if (settings.workers > 0)
+  {
+    if (make_pool(i, my_config, settings.workers, pool) != TCL_OK)
+      return TCL_ERROR;
+    handler = pool.get();
+  }
+
+  std::unique_ptr<http_tcl::router>         router;
+  std::unique_ptr<http_tcl::compressor>     compressor;
+  std::unique_ptr<http_tcl::static_files>   statics;
+  std::unique_ptr<http_tcl::metrics_target> metrics;
+  handler = maybe_route(settings, handler, router);
+  handler = maybe_compress(settings, handler, compressor);
+  handler = maybe_cache(settings, handler, cd_ptr->cache);
+  handler = maybe_serve_static(settings, handler, statics);
+  handler = maybe_serve_metrics(settings, handler, metrics);
+
+  if (settings.io_threads > 0)
+    http_tcl::run_async(settings.host,
+                        settings.port,
+                        handler,
+                        settings.io_threads,
+                        settings.admission,
+                        settings.body);
+  else
+    http_tcl::run(settings.host,
+                  settings.port,
+                  handler,
+                  settings.admission,
+                  settings.body);
+
   return TCL_OK;
 }
 
 int
-http_client(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+start(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
 {
-  static const char* options[]
-    = { "-host", "-port", "-target", "-method", "-body", "-headers", nullptr };
+  auto  cd_ptr    = static_cast<client_data*>(cd);
+  auto& my_config = cd_ptr->handler.config();
 
-  auto const error = [&i, &objc, &objv] {
-    Tcl_WrongNumArgs(
-      i,
-      objc,
-      objv,
-      "?-host host? ?-port port? ?-target target? ?-method http-method? "
-      "?-body body? ?-headers headerDict?");
+  if (objc != 1)
+  {
+    Tcl_WrongNumArgs(i, objc, objv, "");
     return TCL_ERROR;
-  };
+  }
 
-  // require odd number of arguments
-  if (objc % 2 == 0)
-    return error();
+  if (cd_ptr->server)
+  {
+    Tcl_SetObjResult(i, Tcl_NewStringObj("The server is already running.", -1));
+    return TCL_ERROR;
+  }
 
-  std::string                      host;
-  std::string                      port{ "80" };
-  std::string                      target{ "/" };
-  std::string                      method{ "get" };
-  std::string                      body;
-  std::optional<http_tcl::headers> headers;
+  server_settings settings;
+  if (get_server_settings(i, my_config, settings) != TCL_OK)
+    return TCL_ERROR;
 
-  for (auto idx = 1; idx < objc - 1; idx += 2)
+  // without workers, requests are handled by this interpreter as events
+  http_tcl::alt_handler* handler{ nullptr };
+  if (settings.workers > 0)
   {
-    int opt{ -1 };
-    if (Tcl_GetIndexFromObj(i, objv[idx], options, "option", 0, &opt) != TCL_OK)
+    if (make_pool(i, my_config, settings.workers, cd_ptr->pool) != TCL_OK)
       return TCL_ERROR;
+    handler = cd_ptr->pool.get();
+  }
+  else
+  {
+    cd_ptr->events = std::make_unique<event_loop_handler>(cd_ptr->handler);
+    handler        = cd_ptr->events.get();
+  }
+  handler = maybe_route(settings, handler, cd_ptr->router);
+  handler = maybe_compress(settings, handler, cd_ptr->compressor);
+  handler = maybe_cache(settings, handler, cd_ptr->cache);
+  handler = maybe_serve_static(settings, handler, cd_ptr->statics);
+  handler = maybe_serve_metrics(settings, handler, cd_ptr->metrics);
+
+  // the background server is always the asynchronous one, which can stop
+  try
+  {
+    cd_ptr->server = std::make_unique<http_tcl::server>(
+      settings.host,
+      settings.port,
+      handler,
+      std::max(1, settings.io_threads),
+      settings.admission,
+      settings.body);
+  }
+  catch (std::exception const& e)
+  {
+    cd_ptr->stop();
+    Tcl_SetObjResult(i, Tcl_NewStringObj(e.what(), -1));
+    return TCL_ERROR;
+  }
 
-    auto obj = objv[idx + 1];
+  return TCL_OK;
+}
 
-    switch (opt)
-    {
-    case 0: host = get_string(obj); break;
-    case 1: port = get_string(obj); break;
-    case 2: target = get_string(obj); break;
-    case 3: method = get_string(obj); break;
-    case 4: body = get_string(obj); break;
-    case 5: headers = get_dict(i, obj); break;
-    default: return TCL_ERROR;
-    }
+int
+stop(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  if (objc != 1)
+  {
+    Tcl_WrongNumArgs(i, objc, objv, "");
+    return TCL_ERROR;
   }
 
-  if (host.empty())
-    return error();
+  // Stopping joins the I/O threads, and one of them is waiting for the
+  // handler which is running this command; so refuse further requests now,
+  // and tear the server down once the handler has returned.
+  auto cd_ptr = static_cast<client_data*>(cd);
+  if (cd_ptr->handler.current_headers())
+  {
+    if (cd_ptr->events)
+      cd_ptr->events->shutdown();
+    Tcl_CancelIdleCall(client_data::stop_when_idle, cd);
+    Tcl_DoWhenIdle(client_data::stop_when_idle, cd);
+    return TCL_OK;
+  }
 
-  tolower(method);
-  auto [sc, heads, res_body]
-    = http_tcl::http_client(method, host, port, target, headers, body);
+  cd_ptr->stop();
+  return TCL_OK;
+}
 
-  std::vector<Tcl_Obj*> resv{
-    Tcl_NewStringObj(std::to_string(sc).c_str(), -1),
-    to_dict(i, heads),
-    Tcl_NewStringObj(res_body.c_str(), -1),
+// A dictionary of the count, sum, quantiles and maximum of durations, in
+// seconds.
+Tcl_Obj*
+to_dict(http_tcl::latency_histogram::summary const& s)
+{
+  auto dict = Tcl_NewDictObj();
+  auto put  = [dict](char const* key, Tcl_Obj* value) {
+    Tcl_DictObjPut(nullptr, dict, Tcl_NewStringObj(key, -1), value);
+  };
+  put("count", Tcl_NewWideIntObj(s.count));
+  put("sum", Tcl_NewDoubleObj(s.sum));
+  put("p50", Tcl_NewDoubleObj(s.p50));
+  put("p90", Tcl_NewDoubleObj(s.p90));
+  put("p99", Tcl_NewDoubleObj(s.p99));
+  put("max", Tcl_NewDoubleObj(s.max));
+  return dict;
+}
+
+// A dictionary of the requests, their count by class of status, and the
+// latency of their handlers.
+Tcl_Obj*
+to_dict(http_tcl::request_metrics const& m)
+{
+  static char const* const classes[] = { "1xx", "2xx", "3xx", "4xx", "5xx" };
+
+  auto dict = Tcl_NewDictObj();
+  Tcl_DictObjPut(nullptr,
+                 dict,
+                 Tcl_NewStringObj("requests", -1),
+                 Tcl_NewWideIntObj(m.requests.load()));
+  for (size_t c = 0; c < std::size(classes); ++c)
+    Tcl_DictObjPut(nullptr,
+                   dict,
+                   Tcl_NewStringObj(classes[c], -1),
+                   Tcl_NewWideIntObj(m.statuses[c].load()));
+  Tcl_DictObjPut(nullptr,
+                 dict,
+                 Tcl_NewStringObj("latency", -1),
+                 to_dict(m.latency.summarize()));
+  return dict;
+}
+
+int
+stats(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  if (objc != 1)
+  {
+    Tcl_WrongNumArgs(i, objc, objv, "");
+    return TCL_ERROR;
+  }
+
+  auto const s    = http_tcl::get_admission_stats();
+  auto       dict = Tcl_NewDictObj();
+  auto       put  = [&](char const* key, Tcl_WideInt value) {
+    Tcl_DictObjPut(i,
+                   dict,
+                   Tcl_NewStringObj(key, -1),
+                   Tcl_NewWideIntObj(value));
   };
-  auto list = Tcl_NewListObj(resv.size(), resv.data());
-  Tcl_SetObjResult(i, list);
+  put("admitted", s.admitted);
+  put("queued", s.queued);
+  put("rejected", s.rejected);
+  put("active", s.active);
+  put("waiting", s.waiting);
+
+  auto const& metrics = http_tcl::get_server_metrics();
+  put("bytes_in", metrics.bytes_in.load());
+  put("bytes_out", metrics.bytes_out.load());
+  Tcl_DictObjPut(i,
+                 dict,
+                 Tcl_NewStringObj("queue_wait", -1),
+                 to_dict(metrics.queue_wait.summarize()));
+  Tcl_DictObjPut(i,
+                 dict,
+                 Tcl_NewStringObj("eval", -1),
+                 to_dict(metrics.eval.summarize()));
+  Tcl_DictObjPut(i,
+                 dict,
+                 Tcl_NewStringObj("write", -1),
+                 to_dict(metrics.write.summarize()));
+
+  auto methods = Tcl_NewDictObj();
+  for (size_t m = 0; m < http_tcl::server_metrics::method_count; ++m)
+  {
+    auto verb = static_cast<http_tcl::server_metrics::method>(m);
+    Tcl_DictObjPut(
+      i,
+      methods,
+      Tcl_NewStringObj(http_tcl::server_metrics::method_name(verb), -1),
+      to_dict(metrics.requests(verb)));
+  }
+  Tcl_DictObjPut(i, dict, Tcl_NewStringObj("methods", -1), methods);
+
+  auto routes = Tcl_NewDictObj();
+  if (auto table = metrics.routes(); table)
+    for (auto const& r: *table)
+    {
+      auto key = r.method + " " + r.pattern;
+      Tcl_DictObjPut(i,
+                     routes,
+                     Tcl_NewStringObj(key.data(), key.size()),
+                     to_dict(r.counters));
+    }
+  Tcl_DictObjPut(i, dict, Tcl_NewStringObj("routes", -1), routes);
 
+  Tcl_SetObjResult(i, dict);
   return TCL_OK;
 }
 
 int
-run(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+route(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
 {
-  auto  cd_ptr    = static_cast<client_data*>(cd);
-  auto& my_config = cd_ptr->handler.config();
+  auto& my_config = static_cast<client_data*>(cd)->handler.config();
 
-  auto host = Tcl_GetString(my_config.host.value());
-  int  port{ 0 };
-  int  max_connections{ 0 };
-  if (Tcl_GetIntFromObj(i, my_config.port.value(), &port) != TCL_OK)
+  // with no arguments, return the routes
+  if (objc == 1)
   {
-    Tcl_SetObjResult(i, Tcl_NewStringObj("Invalid port number.", -1));
+    Tcl_SetObjResult(i, my_config.routes.value());
+    return TCL_OK;
+  }
+
+  if (objc != 4)
+  {
+    Tcl_WrongNumArgs(i, 1, objv, "method pattern command");
     return TCL_ERROR;
   }
 
-  // if bad value or not set, ignore the option and use server's default
-  if (Tcl_GetIntFromObj(i, my_config.max_connections.value(), &max_connections)
+  std::string verb_name{ get_string(objv[1]) };
+  for (auto& c: verb_name)
+    c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+  TclObj verb_obj = Tcl_NewStringObj(verb_name.data(), verb_name.size());
+
+  int verb{ -1 };
+  if (Tcl_GetIndexFromObj(i,
+                          verb_obj.value(),
+                          route_methods,
+                          "method",
+                          TCL_EXACT,
+                          &verb)
       != TCL_OK)
-    max_connections = 0;
+    return TCL_ERROR;
 
-  if (max_connections)
-    http_tcl::run(host, port, &cd_ptr->handler, max_connections);
-  else
-    http_tcl::run(host, port, &cd_ptr->handler);
+  if (auto error = http_tcl::router::check_pattern(get_string(objv[2])); error)
+  {
+    Tcl_SetObjResult(i, Tcl_NewStringObj(error->data(), error->size()));
+    return TCL_ERROR;
+  }
+
+  // replace the command of an existing route, or add a new one
+  TclObj    routes = Tcl_DuplicateObj(my_config.routes.value());
+  int       routec{ 0 };
+  Tcl_Obj** routev;
+  if (Tcl_ListObjGetElements(i, routes.value(), &routec, &routev) != TCL_OK)
+    return TCL_ERROR;
 
+  Tcl_Obj* entry[] = { Tcl_NewStringObj(route_methods[verb], -1),
+                       objv[2],
+                       objv[3] };
+  auto     idx     = 0;
+  while (idx + 2 < routec
+         && (get_string(routev[idx]) != route_methods[verb]
+             || get_string(routev[idx + 1]) != get_string(objv[2])))
+    idx += 3;
+
+  if (Tcl_ListObjReplace(i,
+                         routes.value(),
+                         idx,
+                         idx < routec ? 3 : 0,
+                         3,
+                         entry)
+      != TCL_OK)
+    return TCL_ERROR;
+
+  my_config.routes = routes;
   return TCL_OK;
 }
 
 int
-percent_encode(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+client_stats(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
 {
-  if (objc != 2)
+  if (objc != 1)
   {
-    Tcl_WrongNumArgs(i, objc, objv, "string");
+    Tcl_WrongNumArgs(i, objc, objv, "");
     return TCL_ERROR;
   }
 
-  auto in  = get_string(objv[1]);
-  auto out = url::percent_encode(in);
-  Tcl_SetObjResult(i, Tcl_NewStringObj(out.c_str(), out.size()));
+  auto const s    = http_tcl::get_client_pool_stats();
+  auto       dict = Tcl_NewDictObj();
+  auto       put  = [&](char const* key, Tcl_WideInt value) {
+    Tcl_DictObjPut(i,
+                   dict,
+                   Tcl_NewStringObj(key, -1),
+                   Tcl_NewWideIntObj(value));
+  };
+  put("hits", s.hits);
+  put("misses", s.misses);
+  put("idle", s.idle);
+  put("dns_hits", s.dns_hits);
+  put("dns_misses", s.dns_misses);
+
+  Tcl_SetObjResult(i, dict);
   return TCL_OK;
 }
 
 int
-percent_decode(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+stream(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
 {
   if (objc != 2)
   {
-    Tcl_WrongNumArgs(i, objc, objv, "string");
+    Tcl_WrongNumArgs(i, 1, objv, "cmd");
+    return TCL_ERROR;
+  }
+
+  auto& handler = static_cast<client_data*>(cd)->handler;
+  if (! handler.current_headers())
+  {
+    Tcl_SetObjResult(
+      i,
+      Tcl_NewStringObj("Not called from a request handler.", -1));
+    return TCL_ERROR;
+  }
+
+  handler.set_stream(objv[1]);
+  return TCL_OK;
+}
+
+int
+dns_cache(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  static const char* subcommands[] = { "flush", nullptr };
+
+  if (objc > 2)
+  {
+    Tcl_WrongNumArgs(i, 1, objv, "?flush?");
     return TCL_ERROR;
   }
-  auto in  = get_string(objv[1]);
-  auto out = url::percent_decode(in);
-  if (out)
+
+  if (objc == 2)
   {
-    Tcl_SetObjResult(i, Tcl_NewStringObj(out->c_str(), out->size()));
+    int sub{ -1 };
+    if (Tcl_GetIndexFromObj(i, objv[1], subcommands, "subcommand", 0, &sub)
+        != TCL_OK)
+      return TCL_ERROR;
+    http_tcl::flush_client_dns_cache();
     return TCL_OK;
   }
-  else
+
+  // host:port -> {addresses list error message ttl ms}
+  auto dict = Tcl_NewDictObj();
+  for (auto const& e: http_tcl::get_client_dns_cache())
+  {
+    std::vector<Tcl_Obj*> addresses;
+    for (auto const& a: e.addresses)
+      addresses.push_back(Tcl_NewStringObj(a.data(), a.size()));
+
+    auto entry = Tcl_NewDictObj();
+    Tcl_DictObjPut(i,
+                   entry,
+                   Tcl_NewStringObj("addresses", -1),
+                   Tcl_NewListObj(addresses.size(), addresses.data()));
+    Tcl_DictObjPut(i,
+                   entry,
+                   Tcl_NewStringObj("error", -1),
+                   Tcl_NewStringObj(e.error.data(), e.error.size()));
+    Tcl_DictObjPut(i,
+                   entry,
+                   Tcl_NewStringObj("ttl", -1),
+                   Tcl_NewWideIntObj(e.ttl.count()));
+    Tcl_DictObjPut(
+      i, dict, Tcl_NewStringObj(e.key.data(), e.key.size()), entry);
+  }
+  Tcl_SetObjResult(i, dict);
+  return TCL_OK;
+}
+
+int
+purge(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  if (objc != 2)
   {
-    Tcl_AddErrorInfo(i, "could not decode string.");
+    Tcl_WrongNumArgs(i, 1, objv, "prefix");
     return TCL_ERROR;
   }
+
+  // the server, and its cache, belong to the interpreter which loaded the
+  // package, whichever interpreter calls this
+  size_t purged{ 0 };
+  if (auto cache = std::atomic_load(&theClientData.cache); cache)
+    purged = cache->purge(get_string(objv[1]));
+
+  Tcl_SetObjResult(i, Tcl_NewWideIntObj(static_cast<Tcl_WideInt>(purged)));
+  return TCL_OK;
 }
 
-extern "C"
+int
+header(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
 {
-  DllExport int
-  Act_http_Init(Tcl_Interp* i)
+  if (objc != 2 && objc != 3)
   {
-    if (Tcl_InitStubs(i, TCL_VERSION, 0) == nullptr)
+    Tcl_WrongNumArgs(i, 1, objv, "name ?default?");
+    return TCL_ERROR;
+  }
+
+  auto heads = static_cast<client_data*>(cd)->handler.current_headers();
+  if (! heads)
+  {
+    Tcl_SetObjResult(
+      i,
+      Tcl_NewStringObj("Not called from a request handler.", -1));
+    return TCL_ERROR;
+  }
+
+  // only the requested field is copied out of the request
+  if (auto value = heads->find(get_string(objv[1])); value)
+    Tcl_SetObjResult(i, Tcl_NewStringObj(value->data(), value->size()));
+  else if (objc == 3)
+    Tcl_SetObjResult(i, objv[2]);
+  return TCL_OK;
+}
+
+int
+body_file(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  if (objc != 1)
+  {
+    Tcl_WrongNumArgs(i, 1, objv, "");
+    return TCL_ERROR;
+  }
+
+  auto heads = static_cast<client_data*>(cd)->handler.current_headers();
+  if (! heads)
+  {
+    Tcl_SetObjResult(
+      i,
+      Tcl_NewStringObj("Not called from a request handler.", -1));
+    return TCL_ERROR;
+  }
+
+  // empty unless the request body was spooled to a file
+  Tcl_SetObjResult(
+    i,
+    Tcl_NewStringObj(heads->body_file.data(), heads->body_file.size()));
+  return TCL_OK;
+}
+
+// With binary, obj is encoded as a byte array, byte by byte; otherwise as
+// UTF-8 text.
+Tcl_Obj*
+encode_obj(Tcl_Obj* obj, bool binary)
+{
+  std::string out;
+  if (binary)
+  {
+    int  length{ 0 };
+    auto data = Tcl_GetByteArrayFromObj(obj, &length);
+    out       = url::percent_encode(
+      { reinterpret_cast<char const*>(data), static_cast<size_t>(length) },
+      true);
+  }
+  else
+    out = url::percent_encode(get_string(obj));
+  return Tcl_NewStringObj(out.data(), out.size());
+}
+
+// Returns nullptr, leaving an error in the interpreter, if obj is malformed.
+Tcl_Obj*
+decode_obj(Tcl_Interp* i, Tcl_Obj* obj, bool binary)
+{
+  auto out = url::percent_decode(get_string(obj));
+  if (! out)
+  {
+    Tcl_SetObjResult(i, Tcl_NewStringObj("could not decode string", -1));
+    return nullptr;
+  }
+  if (binary)
+    return Tcl_NewByteArrayObj(
+      reinterpret_cast<unsigned char const*>(out->data()), out->size());
+  return Tcl_NewStringObj(out->data(), out->size());
+}
+
+// Reads the "?-binary? value" arguments of the encode and decode commands.
+std::optional<bool>
+binary_args(Tcl_Interp* i, int objc, Tcl_Obj* const objv[], char const* arg)
+{
+  if (objc == 3 && get_string(objv[1]) == "-binary")
+    return true;
+  if (objc != 2)
+  {
+    auto usage = std::string{ "?-binary? " } + arg;
+    Tcl_WrongNumArgs(i, 1, objv, usage.c_str());
+    return std::nullopt;
+  }
+  return false;
+}
+
+int
+percent_encode(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  auto binary = binary_args(i, objc, objv, "string");
+  if (! binary)
+    return TCL_ERROR;
+
+  Tcl_SetObjResult(i, encode_obj(objv[objc - 1], *binary));
+  return TCL_OK;
+}
+
+int
+percent_decode(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  auto binary = binary_args(i, objc, objv, "string");
+  if (! binary)
+    return TCL_ERROR;
+
+  auto out = decode_obj(i, objv[objc - 1], *binary);
+  if (! out)
+    return TCL_ERROR;
+  Tcl_SetObjResult(i, out);
+  return TCL_OK;
+}
+
+// encode_list and decode_list convert every element of a list in one call
+int
+percent_encode_list(ClientData     cd,
+                    Tcl_Interp*    i,
+                    int            objc,
+                    Tcl_Obj* const objv[])
+{
+  auto binary = binary_args(i, objc, objv, "list");
+  if (! binary)
+    return TCL_ERROR;
+
+  int       count{ 0 };
+  Tcl_Obj** elements;
+  if (Tcl_ListObjGetElements(i, objv[objc - 1], &count, &elements) != TCL_OK)
+    return TCL_ERROR;
+
+  std::vector<Tcl_Obj*> out;
+  out.reserve(count);
+  for (auto idx = 0; idx < count; ++idx)
+    out.push_back(encode_obj(elements[idx], *binary));
+  Tcl_SetObjResult(i, Tcl_NewListObj(out.size(), out.data()));
+  return TCL_OK;
+}
+
+int
+percent_decode_list(ClientData     cd,
+                    Tcl_Interp*    i,
+                    int            objc,
+                    Tcl_Obj* const objv[])
+{
+  auto binary = binary_args(i, objc, objv, "list");
+  if (! binary)
+    return TCL_ERROR;
+
+  int       count{ 0 };
+  Tcl_Obj** elements;
+  if (Tcl_ListObjGetElements(i, objv[objc - 1], &count, &elements) != TCL_OK)
+    return TCL_ERROR;
+
+  auto out = Tcl_NewListObj(0, nullptr);
+  for (auto idx = 0; idx < count; ++idx)
+  {
+    auto element = decode_obj(i, elements[idx], *binary);
+    if (! element)
+    {
+      Tcl_DecrRefCount(out);
       return TCL_ERROR;
+    }
+    Tcl_ListObjAppendElement(nullptr, out, element);
+  }
+  Tcl_SetObjResult(i, out);
+  return TCL_OK;
+}
 
-    theClientData.init(i);
+int
+parse_query(ClientData cd, Tcl_Interp* i, int objc, Tcl_Obj* const objv[])
+{
+  if (objc != 2)
+  {
+    Tcl_WrongNumArgs(i, 1, objv, "string");
+    return TCL_ERROR;
+  }
 
+  url::query_fields fields;
+  if (! url::parse_query(get_string(objv[1]), fields))
+  {
+    Tcl_SetObjResult(i, Tcl_NewStringObj("could not decode string", -1));
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(i, url::to_dict(fields));
+  return TCL_OK;
+}
+
+int
+define_commands(Tcl_Interp* i, client_data* cd, bool server_commands)
+{
 #define def(name, func)                                                        \
-  Tcl_CreateObjCommand(i,                                                      \
-                       theNamespaceName "::" name,                             \
-                       (func),                                                 \
-                       &theClientData,                                         \
-                       nullptr)
+  Tcl_CreateObjCommand(i, theNamespaceName "::" name, (func), cd, nullptr)
 
 #define urldef(name, func)                                                     \
-  Tcl_CreateObjCommand(i,                                                      \
-                       theUrlNamespaceName "::" name,                          \
-                       (func),                                                 \
-                       &theClientData,                                         \
-                       nullptr)
+  Tcl_CreateObjCommand(i, theUrlNamespaceName "::" name, (func), cd, nullptr)
 
-    auto parent_ns
-      = Tcl_CreateNamespace(i, theParentNamespace, nullptr, nullptr);
+  auto parent_ns = Tcl_CreateNamespace(i, theParentNamespace, nullptr, nullptr);
 
-    auto ns     = Tcl_CreateNamespace(i, theNamespaceName, nullptr, nullptr);
-    auto url_ns = Tcl_CreateNamespace(i, theUrlNamespaceName, nullptr, nullptr);
+  auto ns     = Tcl_CreateNamespace(i, theNamespaceName, nullptr, nullptr);
+  auto url_ns = Tcl_CreateNamespace(i, theUrlNamespaceName, nullptr, nullptr);
 
+  // worker interpreters only handle requests; the server is configured and
+  // run from the interpreter which loaded the package
+  if (server_commands)
+  {
     def("configure", configure);
     def("run", run);
-    def("client", http_client);
-
-    urldef("encode", percent_encode);
-    urldef("decode", percent_decode);
-
-    if (Tcl_Export(i, ns, "*", 0) != TCL_OK)
-      return TCL_ERROR;
+    def("start", start);
+    def("stop", stop);
+    def("stats", stats);
+    def("route", route);
+  }
+  def("client", http_client);
+  def("client_multi", client_multi);
+  def("clientstats", client_stats);
+  def("dnscache", dns_cache);
+  def("cancel", http_cancel);
+  def("header", header);
+  def("bodyfile", body_file);
+  def("stream", stream);
+  def("purge", purge);
+
+  urldef("encode", percent_encode);
+  urldef("decode", percent_decode);
+  urldef("encode_list", percent_encode_list);
+  urldef("decode_list", percent_decode_list);
+  urldef("parse_query", parse_query);
+
+  if (Tcl_Export(i, ns, "*", 0) != TCL_OK)
+    return TCL_ERROR;
 
-    if (Tcl_Export(i, url_ns, "*", 0) != TCL_OK)
-      return TCL_ERROR;
+  if (Tcl_Export(i, url_ns, "*", 0) != TCL_OK)
+    return TCL_ERROR;
 
-    if (Tcl_Export(i, parent_ns, "*", 0) != TCL_OK)
-      return TCL_ERROR;
+  if (Tcl_Export(i, parent_ns, "*", 0) != TCL_OK)
+    return TCL_ERROR;
 
-    Tcl_CreateEnsemble(i, theNamespaceName, ns, 0);
-    Tcl_CreateEnsemble(i, theUrlNamespaceName, url_ns, 0);
+  Tcl_CreateEnsemble(i, theNamespaceName, ns, 0);
+  Tcl_CreateEnsemble(i, theUrlNamespaceName, url_ns, 0);
 
-    Tcl_PkgProvide(i, thePackageName, thePackageVersion);
-    return TCL_OK;
+  Tcl_PkgProvide(i, thePackageName, thePackageVersion);
+  return TCL_OK;
 #undef def
 #undef urldef
+}
+
+extern "C"
+{
+  DllExport int
+  Act_http_Init(Tcl_Interp* i)
+  {
+    if (Tcl_InitStubs(i, TCL_VERSION, 0) == nullptr)
+      return TCL_ERROR;
+
+    theClientData.init(i);
+    return define_commands(i, &theClientData, true);
   }
 
   DllExport int
@@ -780,7 +2971,9 @@ extern "C"
     Tcl_DeleteNamespace(ns);
     Tcl_DeleteNamespace(url_ns);
 
-    // init client data again to free variables in the prior configuration
+    // stop a background server, and init client data again to free variables
+    // in the prior configuration
+    theClientData.stop();
     theClientData.init(i);
     return TCL_OK;
   }
@@ -0,0 +1,396 @@
+#include "http_tcl/http_tcl.h"
+
+#include <cstdio>
+
+namespace http_tcl
+{
+namespace
+{
+using clock = std::chrono::steady_clock;
+
+// the index of the highest bit set in n, which is not zero
+size_t
+highest_bit(uint64_t n)
+{
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(n);
+#else
+  size_t e{ 0 };
+  while (n >>= 1)
+    ++e;
+  return e;
+#endif
+}
+
+char const* const status_classes[] = { "1xx", "2xx", "3xx", "4xx", "5xx" };
+
+// Writes metrics in the Prometheus text exposition format.
+class exposition
+{
+  std::string out_;
+
+  void
+  number(double value)
+  {
+    char buffer[32];
+    std::snprintf(buffer, sizeof buffer, "%.9g", value);
+    out_ += buffer;
+  }
+
+public:
+  void
+  family(char const* name, char const* type, char const* help)
+  {
+    out_ += "# HELP ";
+    out_ += name;
+    out_ += ' ';
+    out_ += help;
+    out_ += "\n# TYPE ";
+    out_ += name;
+    out_ += ' ';
+    out_ += type;
+    out_ += '\n';
+  }
+
+  // labels is empty, or a list such as method="GET" with values escaped
+  void
+  sample(std::string_view name, std::string_view labels, double value)
+  {
+    out_ += name;
+    if (! labels.empty())
+    {
+      out_ += '{';
+      out_ += labels;
+      out_ += '}';
+    }
+    out_ += ' ';
+    number(value);
+    out_ += '\n';
+  }
+
+  // the samples of a summary: its quantiles, sum and count
+  void
+  summary(std::string const&                name,
+          std::string const&                labels,
+          latency_histogram::summary const& s)
+  {
+    auto const sep = labels.empty() ? "" : ",";
+    sample(name, labels + sep + "quantile=\"0.5\"", s.p50);
+    sample(name, labels + sep + "quantile=\"0.9\"", s.p90);
+    sample(name, labels + sep + "quantile=\"0.99\"", s.p99);
+    sample(name + "_sum", labels, s.sum);
+    sample(name + "_count", labels, static_cast<double>(s.count));
+  }
+
+  static std::string
+  label(std::string_view name, std::string_view value)
+  {
+    std::string out{ name };
+    out += "=\"";
+    for (auto c: value)
+    {
+      if (c == '\\' || c == '"')
+        out += '\\';
+      if (c == '\n')
+      {
+        out += "\\n";
+        continue;
+      }
+      out += c;
+    }
+    out += '"';
+    return out;
+  }
+
+  std::string
+  str() &&
+  {
+    return std::move(out_);
+  }
+};
+
+} // namespace
+
+void
+latency_histogram::record(clock::duration elapsed)
+{
+  auto const ns = static_cast<uint64_t>(
+    std::max<int64_t>(0,
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        elapsed)
+                        .count()));
+
+  buckets_[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(ns, std::memory_order_relaxed);
+
+  auto max = max_.load(std::memory_order_relaxed);
+  while (ns > max
+         && ! max_.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+  {
+  }
+}
+
+size_t
+latency_histogram::bucket(uint64_t ns)
+{
+  // below 8 ns each value has its own bucket; above, the three bits after
+  // the highest one choose among the eight buckets of its power of two
+  if (ns < sub_buckets)
+    return ns;
+
+  auto const e = highest_bit(ns);
+  if (e >= max_power)
+    return bucket_count - 1;
+  return (e - 2) * sub_buckets + ((ns >> (e - 3)) & (sub_buckets - 1));
+}
+
+uint64_t
+latency_histogram::upper_bound(size_t bucket)
+{
+  if (bucket < sub_buckets)
+    return bucket + 1;
+
+  auto const e   = bucket / sub_buckets + 2;
+  auto const sub = bucket % sub_buckets;
+  return (sub_buckets + sub + 1) << (e - 3);
+}
+
+latency_histogram::summary
+latency_histogram::summarize() const
+{
+  std::array<uint64_t, bucket_count> counts;
+  summary                            s;
+  for (size_t i = 0; i < bucket_count; ++i)
+  {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    s.count += counts[i];
+  }
+  s.sum = sum_.load(std::memory_order_relaxed) / 1e9;
+  s.max = max_.load(std::memory_order_relaxed) / 1e9;
+
+  // the upper bound of the bucket holding the value of rank q * count
+  auto quantile = [&](double q) {
+    auto const rank = static_cast<uint64_t>(q * s.count + 0.5);
+    uint64_t   seen{ 0 };
+    for (size_t i = 0; i < bucket_count; ++i)
+    {
+      seen += counts[i];
+      if (seen >= std::max<uint64_t>(rank, 1))
+        return std::min(upper_bound(i) / 1e9, s.max);
+    }
+    return s.max;
+  };
+  if (s.count > 0)
+  {
+    s.p50 = quantile(0.5);
+    s.p90 = quantile(0.9);
+    s.p99 = quantile(0.99);
+  }
+  return s;
+}
+
+void
+request_metrics::record(int status, clock::duration elapsed)
+{
+  requests.fetch_add(1, std::memory_order_relaxed);
+  if (status >= 100 && status < 600)
+    statuses[status / 100 - 1].fetch_add(1, std::memory_order_relaxed);
+  latency.record(elapsed);
+}
+
+char const*
+server_metrics::method_name(method m)
+{
+  static char const* const names[]
+    = { "OPTIONS", "HEAD", "GET", "POST", "PUT", "DELETE" };
+  return names[static_cast<size_t>(m)];
+}
+
+void
+server_metrics::set_routes(std::shared_ptr<route_metrics_table> routes)
+{
+  std::lock_guard lock(mutex_);
+  routes_ = std::move(routes);
+}
+
+std::shared_ptr<route_metrics_table const>
+server_metrics::routes() const
+{
+  std::lock_guard lock(mutex_);
+  return routes_;
+}
+
+std::string
+server_metrics::prometheus() const
+{
+  exposition out;
+
+  auto const a = get_admission_stats();
+  out.family("act_http_connections_active",
+             "gauge",
+             "Connections being served now.");
+  out.sample("act_http_connections_active", {}, a.active);
+  out.family("act_http_connections_waiting",
+             "gauge",
+             "Connections waiting in the backlog now.");
+  out.sample("act_http_connections_waiting", {}, a.waiting);
+  out.family("act_http_connections_total",
+             "counter",
+             "Connections accepted, by what became of them.");
+  out.sample("act_http_connections_total", "outcome=\"admitted\"", a.admitted);
+  out.sample("act_http_connections_total", "outcome=\"queued\"", a.queued);
+  out.sample("act_http_connections_total", "outcome=\"rejected\"", a.rejected);
+
+  out.family("act_http_received_bytes_total",
+             "counter",
+             "Bytes of requests read.");
+  out.sample("act_http_received_bytes_total", {}, bytes_in.load());
+  out.family("act_http_sent_bytes_total",
+             "counter",
+             "Bytes of responses written.");
+  out.sample("act_http_sent_bytes_total", {}, bytes_out.load());
+
+  // the requests of one method or route, by class of status
+  auto by_status = [&out](char const*            name,
+                          std::string const&     labels,
+                          request_metrics const& m) {
+    for (size_t i = 0; i < std::size(status_classes); ++i)
+      if (auto n = m.statuses[i].load(); n > 0)
+        out.sample(
+          name,
+          labels + "," + exposition::label("status", status_classes[i]),
+          n);
+  };
+  auto method_label = [](size_t i) {
+    return exposition::label("method", method_name(static_cast<method>(i)));
+  };
+
+  out.family("act_http_requests_total",
+             "counter",
+             "Requests answered, by method and class of status.");
+  for (size_t i = 0; i < method_count; ++i)
+    by_status("act_http_requests_total", method_label(i), methods_[i]);
+
+  out.family("act_http_request_duration_seconds",
+             "summary",
+             "Time from reading a request to its handler's return.");
+  for (size_t i = 0; i < method_count; ++i)
+    if (methods_[i].requests.load() > 0)
+      out.summary("act_http_request_duration_seconds",
+                  method_label(i),
+                  methods_[i].latency.summarize());
+
+  if (auto table = this->routes(); table && ! table->empty())
+  {
+    out.family("act_http_route_requests_total",
+               "counter",
+               "Requests which matched a route, by class of status.");
+    for (auto const& r: *table)
+      by_status("act_http_route_requests_total",
+                exposition::label("method", r.method) + ","
+                  + exposition::label("route", r.pattern),
+                r.counters);
+
+    out.family("act_http_route_duration_seconds",
+               "summary",
+               "Time taken by the handlers of a route.");
+    for (auto const& r: *table)
+      if (r.counters.requests.load() > 0)
+        out.summary("act_http_route_duration_seconds",
+                    exposition::label("method", r.method) + ","
+                      + exposition::label("route", r.pattern),
+                    r.counters.latency.summarize());
+  }
+
+  for (auto [name, help, h]: {
+         std::tuple{ "act_http_queue_wait_seconds",
+                     "Time requests waited for a free interpreter.",
+                     &queue_wait },
+         std::tuple{ "act_http_eval_seconds",
+                     "Time spent evaluating handlers in Tcl.",
+                     &eval },
+         std::tuple{ "act_http_write_seconds",
+                     "Time taken to write responses.",
+                     &write } })
+  {
+    out.family(name, "summary", help);
+    out.summary(name, {}, h->summarize());
+  }
+
+  return std::move(out).str();
+}
+
+server_metrics&
+get_server_metrics()
+{
+  static server_metrics metrics;
+  return metrics;
+}
+
+metrics_target::metrics_target(alt_handler* next, std::string target)
+    : next_(next)
+    , target_(std::move(target))
+{
+}
+
+bool
+metrics_target::matches(std::string_view target) const
+{
+  return target.substr(0, target.find('?')) == target_;
+}
+
+alt_handler::options_r
+metrics_target::options(std::string_view target,
+                        std::string_view body,
+                        headers_access&& get_headers)
+{
+  return next_->options(target, body, std::move(get_headers));
+}
+
+alt_handler::head_r
+metrics_target::head(std::string_view target, headers_access&& get_headers)
+{
+  if (! matches(target))
+    return next_->head(target, std::move(get_headers));
+  return { 200,
+           std::nullopt,
+           get_server_metrics().prometheus().size(),
+           "text/plain; version=0.0.4" };
+}
+
+alt_handler::get_r
+metrics_target::get(std::string_view target, headers_access&& get_headers)
+{
+  if (! matches(target))
+    return next_->get(target, std::move(get_headers));
+  return { 200,
+           std::nullopt,
+           get_server_metrics().prometheus(),
+           "text/plain; version=0.0.4" };
+}
+
+alt_handler::post_r
+metrics_target::post(std::string_view target,
+                     std::string_view body,
+                     headers_access&& get_headers)
+{
+  return next_->post(target, body, std::move(get_headers));
+}
+
+alt_handler::put_r
+metrics_target::put(std::string_view target,
+                    std::string_view body,
+                    headers_access&& get_headers)
+{
+  return next_->put(target, body, std::move(get_headers));
+}
+
+alt_handler::delete_r
+metrics_target::delete_(std::string_view target,
+                        std::string_view body,
+                        headers_access&& get_headers)
+{
+  return next_->delete_(target, body, std::move(get_headers));
+}
+
+} // namespace http_tcl
@@ -0,0 +1,296 @@
+#include "header_tokens.h"
+#include "http_tcl/http_tcl.h"
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <map>
+
+namespace http_tcl
+{
+namespace
+{
+using clock = std::chrono::steady_clock;
+
+using namespace header_tokens;
+
+// How long a response may be kept, from its Cache-Control header, or
+// nothing if it may not be cached.
+std::optional<std::chrono::seconds>
+max_age(headers const& hs)
+{
+  auto cc = hs.get("Cache-Control");
+  if (! cc || hs.get("Set-Cookie"))
+    return std::nullopt;
+
+  std::optional<std::chrono::seconds> age;
+  bool                                forbidden{ false };
+  for_each_token(*cc, [&](std::string_view token) {
+    constexpr std::string_view directive{ "max-age=" };
+    if (iequals(token, "no-store") || iequals(token, "no-cache")
+        || iequals(token, "private"))
+      forbidden = true;
+    else if (token.size() > directive.size()
+             && iequals(token.substr(0, directive.size()), directive))
+    {
+      // saturate at a year, which caches treat as forever anyway, so that
+      // a longer value cannot overflow
+      constexpr std::chrono::seconds::rep year{ 365 * 24 * 60 * 60 };
+      std::chrono::seconds::rep           n{ 0 };
+      for (auto c: token.substr(directive.size()))
+      {
+        if (c < '0' || c > '9')
+          return;
+        n = std::min(n * 10 + (c - '0'), year);
+      }
+      if (n > 0)
+        age = std::chrono::seconds{ n };
+    }
+  });
+
+  if (forbidden)
+    return std::nullopt;
+  return age;
+}
+
+} // namespace
+
+// A cached response. Hits share the body, so it is never copied again.
+struct response_cache::entry
+{
+  std::string                        key;
+  std::string                        target;
+  int                                status{ 0 };
+  headers                            hs;
+  std::shared_ptr<std::string const> body;
+  std::string                        content_type;
+  clock::time_point                  stored;
+  clock::time_point                  expires;
+};
+
+struct response_cache::store
+{
+  using lru_t = std::list<entry>;
+
+  std::mutex mutex;
+  size_t     max_bytes;
+  size_t     bytes{ 0 };
+  lru_t      lru;
+
+  // keyed by target, then the values of the varying headers, so that a
+  // prefix of targets is a range
+  std::map<std::string, lru_t::iterator, std::less<>> index;
+
+  // the request headers named by the Vary header of each target's response
+  std::map<std::string, std::vector<std::string>, std::less<>> vary;
+
+  explicit store(size_t max_bytes) : max_bytes(max_bytes) {}
+
+  // the key for a request, or nothing if it cannot be answered from the
+  // cache; call with the mutex held
+  std::optional<std::string>
+  key_for(std::string_view target, headers_access const& get_headers)
+  {
+    if (get_headers.find("Authorization"))
+      return std::nullopt;
+
+    std::string key{ target };
+    if (auto it = vary.find(target); it != vary.end())
+      for (auto const& name: it->second)
+      {
+        key.push_back('\n');
+        if (auto value = get_headers.find(name); value)
+          key.append(*value);
+      }
+    return key;
+  }
+
+  void
+  erase(lru_t::iterator it)
+  {
+    bytes -= it->body->size();
+    index.erase(it->key);
+    lru.erase(it);
+  }
+
+  std::optional<entry>
+  find(std::string_view target, headers_access const& get_headers)
+  {
+    std::lock_guard lock(mutex);
+    auto            key = key_for(target, get_headers);
+    if (! key)
+      return std::nullopt;
+
+    auto it = index.find(*key);
+    if (it == index.end())
+      return std::nullopt;
+
+    if (it->second->expires <= clock::now())
+    {
+      erase(it->second);
+      return std::nullopt;
+    }
+
+    lru.splice(lru.begin(), lru, it->second);
+    return *it->second;
+  }
+
+  void
+  insert(std::string_view      target,
+         headers_access const& get_headers,
+         entry&&               e)
+  {
+    std::lock_guard lock(mutex);
+    if (e.body->size() > max_bytes)
+      return;
+
+    // remember which request headers this target's responses vary on
+    std::vector<std::string> names;
+    bool                     any{ false };
+    if (auto v = e.hs.get("Vary"); v)
+      for_each_token(*v, [&](std::string_view name) {
+        any = any || name == "*";
+        names.emplace_back(name);
+      });
+    if (any)
+      return;
+    vary[std::string{ target }] = std::move(names);
+
+    auto key = key_for(target, get_headers);
+    if (! key)
+      return;
+
+    if (auto it = index.find(*key); it != index.end())
+      erase(it->second);
+
+    e.key = std::move(*key);
+    bytes += e.body->size();
+    lru.push_front(std::move(e));
+    index.emplace(lru.front().key, lru.begin());
+
+    while (bytes > max_bytes)
+      erase(std::prev(lru.end()));
+  }
+
+  size_t
+  purge(std::string_view prefix)
+  {
+    std::lock_guard lock(mutex);
+    size_t          purged{ 0 };
+    for (auto it = index.lower_bound(prefix);
+         it != index.end() && it->first.compare(0, prefix.size(), prefix) == 0;)
+    {
+      auto next = std::next(it);
+      erase(it->second);
+      it = next;
+      ++purged;
+    }
+    for (auto it = vary.lower_bound(prefix);
+         it != vary.end() && it->first.compare(0, prefix.size(), prefix) == 0;)
+      it = vary.erase(it);
+    return purged;
+  }
+};
+
+response_cache::response_cache(alt_handler* next, size_t max_bytes)
+    : next_(next)
+    , store_(std::make_unique<store>(max_bytes))
+{
+}
+
+response_cache::~response_cache() = default;
+
+size_t
+response_cache::purge(std::string_view prefix)
+{
+  return store_->purge(prefix);
+}
+
+alt_handler::get_r
+response_cache::get(std::string_view target, headers_access&& get_headers)
+{
+  if (auto hit = store_->find(target, get_headers); hit)
+  {
+    auto age = std::chrono::duration_cast<std::chrono::seconds>(clock::now()
+                                                                - hit->stored);
+    hit->hs.set("Age", std::to_string(age.count()));
+    return { hit->status,
+             std::move(hit->hs),
+             response_body{ hit->body, *hit->body },
+             std::move(hit->content_type) };
+  }
+
+  auto res = next_->get(target, std::move(get_headers));
+
+  // a streamed body is not known until it has been sent
+  auto& [status, hs, body, content_type] = res;
+  if (status != 200 || ! hs || body.chunks())
+    return res;
+
+  auto age = max_age(*hs);
+  if (! age)
+    return res;
+
+  // copy the body once, so the cache does not hold on to the handler's
+  // objects, and answer this request from the copy too
+  auto copy = std::make_shared<std::string const>(body.view());
+  auto now  = clock::now();
+  store_->insert(target,
+                 get_headers,
+                 entry{ {},
+                        std::string{ target },
+                        status,
+                        *hs,
+                        copy,
+                        content_type,
+                        now,
+                        now + *age });
+  body = response_body{ copy, *copy };
+  return res;
+}
+
+alt_handler::head_r
+response_cache::head(std::string_view target, headers_access&& get_headers)
+{
+  if (auto hit = store_->find(target, get_headers); hit)
+    return { hit->status,
+             std::move(hit->hs),
+             hit->body->size(),
+             std::move(hit->content_type) };
+
+  return next_->head(target, std::move(get_headers));
+}
+
+alt_handler::options_r
+response_cache::options(std::string_view target,
+                        std::string_view body,
+                        headers_access&& get_headers)
+{
+  return next_->options(target, body, std::move(get_headers));
+}
+
+alt_handler::post_r
+response_cache::post(std::string_view target,
+                     std::string_view body,
+                     headers_access&& get_headers)
+{
+  return next_->post(target, body, std::move(get_headers));
+}
+
+alt_handler::put_r
+response_cache::put(std::string_view target,
+                    std::string_view body,
+                    headers_access&& get_headers)
+{
+  return next_->put(target, body, std::move(get_headers));
+}
+
+alt_handler::delete_r
+response_cache::delete_(std::string_view target,
+                        std::string_view body,
+                        headers_access&& get_headers)
+{
+  return next_->delete_(target, body, std::move(get_headers));
+}
+
+} // namespace http_tcl
@@ -0,0 +1,293 @@
+#include "http_tcl/http_tcl.h"
+
+#include <array>
+#include <map>
+#include <stdexcept>
+
+namespace http_tcl
+{
+namespace
+{
+constexpr size_t method_count = 6;
+
+// Calls f with each segment of a path, without the leading slash or any
+// query, e.g. "a", "b" and "" for "/a/b/?x".
+template <typename F>
+void
+for_each_segment(std::string_view path, F&& f)
+{
+  if (auto q = path.find_first_of("?#"); q != std::string_view::npos)
+    path = path.substr(0, q);
+  if (! path.empty() && path.front() == '/')
+    path.remove_prefix(1);
+
+  for (;;)
+  {
+    auto slash = path.find('/');
+    f(path.substr(0, slash));
+    if (slash == std::string_view::npos)
+      break;
+    path.remove_prefix(slash + 1);
+  }
+}
+
+bool
+is_param(std::string_view segment)
+{
+  return segment.size() > 2 && segment.front() == '{' && segment.back() == '}';
+}
+
+// most paths have fewer segments than this, and so are split without
+// allocating
+using segment_list = small_vector<std::string_view, 16>;
+
+} // namespace
+
+// A trie of path segments. Each node has literal children, and at most one
+// parameter child which matches any single segment.
+struct router::node
+{
+  static constexpr auto none = static_cast<size_t>(-1);
+
+  std::map<std::string, std::unique_ptr<node>, std::less<>> literals;
+  std::unique_ptr<node>                                     param;
+  std::array<size_t, method_count>                          ids;
+
+  node() { ids.fill(none); }
+
+  // Depth-first, literals before the parameter, so that /users/me wins
+  // over /users/{id}; values collects the segments matched by parameters.
+  // A literal branch which fails further down is retried as the parameter,
+  // so a path may visit more nodes than it has segments.
+  size_t
+  match(method                  verb,
+        std::string_view const* segment,
+        std::string_view const* end,
+        segment_list&           values) const
+  {
+    if (segment == end)
+      return ids[static_cast<size_t>(verb)];
+
+    if (auto it = literals.find(*segment); it != literals.end())
+      if (auto id = it->second->match(verb, segment + 1, end, values);
+          id != none)
+        return id;
+
+    if (param)
+    {
+      values.push_back(*segment);
+      if (auto id = param->match(verb, segment + 1, end, values); id != none)
+        return id;
+      values.pop_back();
+    }
+    return none;
+  }
+};
+
+router::router(alt_handler*               next,
+               std::vector<route> const&  routes,
+               std::vector<method> const& fallback)
+    : next_(next)
+    , root_(std::make_unique<node>())
+    , fallback_(method_count, false)
+    , metrics_(std::make_shared<route_metrics_table>())
+{
+  names_.reserve(routes.size());
+  for (auto const& r: routes)
+  {
+    if (auto error = check_pattern(r.pattern); error)
+      throw std::invalid_argument(*error);
+
+    std::vector<std::string> names;
+    auto                     n = root_.get();
+    for_each_segment(r.pattern, [&](std::string_view segment) {
+      std::unique_ptr<node>* child;
+      if (is_param(segment))
+      {
+        names.emplace_back(segment.substr(1, segment.size() - 2));
+        child = &n->param;
+      }
+      else
+        child = &n->literals[std::string{ segment }];
+
+      if (! *child)
+        *child = std::make_unique<node>();
+      n = child->get();
+    });
+
+    n->ids[static_cast<size_t>(r.verb)] = names_.size();
+    names_.push_back(std::move(names));
+    metrics_->emplace_back(server_metrics::method_name(r.verb), r.pattern);
+  }
+
+  for (auto m: fallback)
+    fallback_[static_cast<size_t>(m)] = true;
+
+  get_server_metrics().set_routes(metrics_);
+}
+
+router::~router() = default;
+
+std::optional<std::string>
+router::check_pattern(std::string_view pattern)
+{
+  if (pattern.empty() || pattern.front() != '/')
+    return "route pattern must begin with '/': " + std::string{ pattern };
+
+  std::optional<std::string> error;
+  for_each_segment(pattern, [&](std::string_view segment) {
+    if (error || is_param(segment))
+      return;
+    if (segment.find_first_of("{}") != std::string_view::npos)
+      error = "route segment must be literal or a {parameter}: "
+              + std::string{ segment };
+  });
+  if (! error && pattern.find_first_of("?#") != std::string_view::npos)
+    error = "route pattern may not contain a query: " + std::string{ pattern };
+  return error;
+}
+
+bool
+router::find(method verb, std::string_view target, route_match& out) const
+{
+  segment_list segments;
+  for_each_segment(target, [&](std::string_view segment) {
+    segments.push_back(segment);
+  });
+
+  segment_list values;
+  auto const   id
+    = root_->match(verb, segments.begin(), segments.end(), values);
+  if (id == node::none)
+    return false;
+
+  auto const& names = names_[id];
+  out.id            = id;
+  out.params.clear();
+  for (size_t i = 0; i < names.size(); ++i)
+    out.params.push_back({ names[i], values[i] });
+  return true;
+}
+
+template <typename R, typename F>
+R
+router::call_route(route_match& match, headers_access& get_headers, F&& call)
+{
+  get_headers.route  = &match;
+  auto const started = std::chrono::steady_clock::now();
+  auto       result  = call();
+  (*metrics_)[match.id].counters.record(
+    std::get<0>(result),
+    std::chrono::steady_clock::now() - started);
+  return result;
+}
+
+template <typename R, typename F>
+R
+router::dispatch(method           verb,
+                 std::string_view target,
+                 headers_access&  get_headers,
+                 R&&              not_found,
+                 F&&              call)
+{
+  route_match match;
+  if (find(verb, target, match))
+    return call_route<R>(match, get_headers, call);
+
+  if (fallback_[static_cast<size_t>(verb)])
+    return call();
+  return std::move(not_found);
+}
+
+alt_handler::options_r
+router::options(std::string_view target,
+                std::string_view body,
+                headers_access&& get_headers)
+{
+  return dispatch(method::options,
+                  target,
+                  get_headers,
+                  options_r{ 404, std::nullopt, "Not found", "text/plain" },
+                  [&] {
+                    return next_->options(target, body, std::move(get_headers));
+                  });
+}
+
+alt_handler::head_r
+router::head(std::string_view target, headers_access&& get_headers)
+{
+  route_match match;
+  if (find(method::head, target, match))
+    return call_route<head_r>(match, get_headers, [&] {
+      return next_->head(target, std::move(get_headers));
+    });
+
+  // a path routed for GET alone answers HEAD as GET would, without the body
+  if (find(method::get, target, match))
+    return call_route<head_r>(match, get_headers, [&] {
+      auto [status, hs, body, content_type]
+        = next_->get(target, std::move(get_headers));
+      auto size = body.size();
+      if (auto source = body.chunks(); source)
+        size = source->size().value_or(unknown_size);
+      return head_r{ status, std::move(hs), size, std::move(content_type) };
+    });
+
+  if (fallback_[static_cast<size_t>(method::head)])
+    return next_->head(target, std::move(get_headers));
+  return { 404, std::nullopt, 0, "text/plain" };
+}
+
+alt_handler::get_r
+router::get(std::string_view target, headers_access&& get_headers)
+{
+  return dispatch(method::get,
+                  target,
+                  get_headers,
+                  get_r{ 404, std::nullopt, "Not found", "text/plain" },
+                  [&] { return next_->get(target, std::move(get_headers)); });
+}
+
+alt_handler::post_r
+router::post(std::string_view target,
+             std::string_view body,
+             headers_access&& get_headers)
+{
+  return dispatch(method::post,
+                  target,
+                  get_headers,
+                  post_r{ 404, std::nullopt, "Not found", "text/plain" },
+                  [&] {
+                    return next_->post(target, body, std::move(get_headers));
+                  });
+}
+
+alt_handler::put_r
+router::put(std::string_view target,
+            std::string_view body,
+            headers_access&& get_headers)
+{
+  return dispatch(method::put,
+                  target,
+                  get_headers,
+                  put_r{ 404, std::nullopt },
+                  [&] {
+                    return next_->put(target, body, std::move(get_headers));
+                  });
+}
+
+alt_handler::delete_r
+router::delete_(std::string_view target,
+                std::string_view body,
+                headers_access&& get_headers)
+{
+  return dispatch(method::delete_,
+                  target,
+                  get_headers,
+                  delete_r{ 404, std::nullopt, "Not found", "text/plain" },
+                  [&] {
+                    return next_->delete_(target, body, std::move(get_headers));
+                  });
+}
+
+} // namespace http_tcl
@@ -0,0 +1,547 @@
+#include "http_tcl/http_tcl.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace http_tcl
+{
+namespace
+{
+// how long a cached stat result is trusted before the file is checked again
+constexpr auto revalidate_after = std::chrono::seconds(1);
+
+// files at least this large are read as they are sent instead of being
+// held in memory
+constexpr std::uint64_t read_into_memory_from = 256 * 1024;
+
+std::string_view
+content_type_for(std::string_view path)
+{
+  static const std::unordered_map<std::string_view, std::string_view> types{
+    { "css", "text/css" },
+    { "csv", "text/csv" },
+    { "gif", "image/gif" },
+    { "htm", "text/html" },
+    { "html", "text/html" },
+    { "ico", "image/vnd.microsoft.icon" },
+    { "jpeg", "image/jpeg" },
+    { "jpg", "image/jpeg" },
+    { "js", "application/javascript" },
+    { "json", "application/json" },
+    { "map", "application/json" },
+    { "mjs", "application/javascript" },
+    { "pdf", "application/pdf" },
+    { "png", "image/png" },
+    { "svg", "image/svg+xml" },
+    { "txt", "text/plain" },
+    { "wasm", "application/wasm" },
+    { "webp", "image/webp" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "xml", "application/xml" },
+  };
+
+  auto const dot   = path.rfind('.');
+  auto const slash = path.rfind('/');
+  if (dot != std::string_view::npos
+      && (slash == std::string_view::npos || dot > slash))
+  {
+    std::string ext{ path.substr(dot + 1) };
+    for (auto& c: ext)
+      c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (auto it = types.find(ext); it != types.end())
+      return it->second;
+  }
+  return "application/octet-stream";
+}
+
+std::string
+http_date(std::time_t t)
+{
+  std::tm tm{};
+#ifdef _WIN32
+  gmtime_s(&tm, &t);
+#else
+  gmtime_r(&t, &tm);
+#endif
+  char buf[64];
+  auto n = std::strftime(buf, sizeof buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return { buf, n };
+}
+
+int
+hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Decodes the path of a target, without its query, into a path relative to
+// the static root. Returns nothing if the path could escape the root.
+std::optional<std::string>
+relative_path(std::string_view path)
+{
+  if (auto q = path.find_first_of("?#"); q != std::string_view::npos)
+    path = path.substr(0, q);
+
+  std::string out;
+  out.reserve(path.size());
+  for (size_t i = 0; i < path.size(); ++i)
+  {
+    if (path[i] == '%')
+    {
+      if (i + 2 >= path.size())
+        return std::nullopt;
+      auto hi = hex_value(path[i + 1]);
+      auto lo = hex_value(path[i + 2]);
+      if (hi < 0 || lo < 0)
+        return std::nullopt;
+      out.push_back(static_cast<char>(hi * 16 + lo));
+      i += 2;
+    }
+    else
+      out.push_back(path[i]);
+  }
+
+  if (out.find('\0') != std::string::npos || out.find("..") != std::string::npos
+      || out.find('\\') != std::string::npos)
+    return std::nullopt;
+
+  if (out.empty() || out.back() == '/')
+    out += "index.html";
+  return out;
+}
+
+#ifndef _WIN32
+// An open file, closed once the cache and every response reading it are
+// done with it.
+struct descriptor
+{
+  int fd;
+
+  explicit descriptor(int fd) : fd(fd) {}
+  ~descriptor() { ::close(fd); }
+
+  descriptor(descriptor const&) = delete;
+  descriptor&
+  operator=(descriptor const&)
+    = delete;
+};
+
+// Reads a large file as the response is written, a piece at a time, from
+// the descriptor opened with it. If the file is truncated meanwhile, the
+// response is abandoned rather than sent shorter than its Content-Length.
+class file_chunks final : public chunk_source
+{
+  static constexpr std::uint64_t chunk_size = 64 * 1024;
+
+  std::shared_ptr<descriptor const> file_;
+  std::uint64_t                     size_;
+  std::uint64_t                     offset_{ 0 };
+
+public:
+  file_chunks(std::shared_ptr<descriptor const> file, std::uint64_t size)
+      : file_(std::move(file))
+      , size_(size)
+  {
+  }
+
+  std::optional<std::string>
+  next() override
+  {
+    if (offset_ == size_)
+      return std::nullopt;
+
+    std::string chunk(std::min(chunk_size, size_ - offset_), '\0');
+    auto const  at = static_cast<off_t>(offset_);
+    auto const  n  = ::pread(file_->fd, chunk.data(), chunk.size(), at);
+    if (n <= 0)
+      throw std::runtime_error("static file changed while it was sent");
+    chunk.resize(static_cast<size_t>(n));
+    offset_ += chunk.size();
+    return chunk;
+  }
+
+  std::optional<std::uint64_t>
+  size() const override
+  {
+    return size_;
+  }
+};
+
+// Reads up to size bytes from the start of the file; fewer if it is
+// truncated meanwhile.
+std::string
+read_all(int fd, std::uint64_t size)
+{
+  std::string out(size, '\0');
+  size_t      done{ 0 };
+  while (done < out.size())
+  {
+    auto const at = static_cast<off_t>(done);
+    auto const n  = ::pread(fd, out.data() + done, out.size() - done, at);
+    if (n <= 0)
+      break;
+    done += static_cast<size_t>(n);
+  }
+  out.resize(done);
+  return out;
+}
+#endif
+
+} // namespace
+
+// The contents of a file. Small files are read into memory when opened, so
+// every response sends the same bytes however the file changes. Larger ones
+// keep their descriptor open and are read as each response is written,
+// which stays valid for responses still being written after the entry has
+// left the cache.
+struct static_files::contents
+{
+  std::shared_ptr<std::string const> bytes;
+#ifndef _WIN32
+  std::shared_ptr<descriptor const> file;
+#endif
+  std::uint64_t size{ 0 };
+
+  explicit operator bool() const
+  {
+#ifndef _WIN32
+    if (file)
+      return true;
+#endif
+    return bytes != nullptr;
+  }
+
+  response_body
+  body() const
+  {
+#ifndef _WIN32
+    if (file)
+      return response_body{ std::make_shared<file_chunks>(file, size) };
+#endif
+    return response_body{ bytes, *bytes };
+  }
+
+  // The file and its stat result, taken from the same descriptor so that
+  // they agree.
+  static std::optional<contents>
+  read(std::string const& path, struct stat& st)
+  {
+    contents c;
+#ifndef _WIN32
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return std::nullopt;
+    auto file = std::make_shared<descriptor const>(fd);
+    if (::fstat(fd, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+      return std::nullopt;
+
+    c.size = static_cast<std::uint64_t>(st.st_size);
+    if (c.size >= read_into_memory_from)
+    {
+      c.file = std::move(file);
+      return c;
+    }
+
+    c.bytes = std::make_shared<std::string const>(read_all(fd, c.size));
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (! in || ::stat(path.c_str(), &st) != 0)
+      return std::nullopt;
+    c.bytes = std::make_shared<std::string const>(
+      std::istreambuf_iterator<char>{ in },
+      std::istreambuf_iterator<char>{});
+#endif
+    c.size = c.bytes->size();
+    return c;
+  }
+};
+
+// An open file: its contents, its gzipped contents if it is served
+// compressed, and the response headers which describe it.
+struct static_files::file
+{
+  contents      plain;
+  contents      gzipped;
+  std::string   content_type;
+  std::string   last_modified;
+  std::time_t   mtime{ 0 };
+  std::uint64_t size{ 0 };
+
+  std::chrono::steady_clock::time_point checked;
+
+  static std::shared_ptr<file>
+  open(std::string const& path, std::optional<compress_options> const& compress)
+  {
+    struct stat st;
+    auto        plain = contents::read(path, st);
+    if (! plain)
+      return nullptr;
+
+    auto f           = std::make_shared<file>();
+    f->plain         = std::move(*plain);
+    f->content_type  = content_type_for(path);
+    f->last_modified = http_date(st.st_mtime);
+    f->mtime         = st.st_mtime;
+    f->size          = static_cast<std::uint64_t>(st.st_size);
+    f->checked       = std::chrono::steady_clock::now();
+
+    if (! compress || ! compress->compresses(f->content_type, f->size))
+      return f;
+
+    // a precompressed copy is preferred to compressing the file here
+    struct stat gz_st;
+    if (auto gz = contents::read(path + ".gz", gz_st); gz)
+    {
+      f->gzipped = std::move(*gz);
+      return f;
+    }
+
+    // only files held in memory are compressed here; larger ones are sent
+    // as they are, rather than read whole on the I/O thread and kept
+    if (! f->plain.bytes || f->size >= read_into_memory_from)
+      return f;
+
+    auto gz = std::make_shared<std::string const>(
+      compressor::encode(*f->plain.bytes, "gzip", compress->level));
+    if (gz->size() < f->plain.size)
+    {
+      f->gzipped.bytes = gz;
+      f->gzipped.size  = gz->size();
+    }
+    return f;
+  }
+
+  // the contents to answer a request with, and their Content-Encoding
+  std::pair<contents const*, std::string_view>
+  choose(headers_access const& get_headers) const
+  {
+    if (gzipped
+        && compressor::negotiate(get_headers.find("Accept-Encoding"))
+             == "gzip")
+      return { &gzipped, "gzip" };
+    return { &plain, {} };
+  }
+
+  headers
+  response_headers(std::string_view coding) const
+  {
+    headers hs{ { "Last-Modified", last_modified } };
+    if (gzipped)
+      hs.add("Vary", "Accept-Encoding");
+    if (! coding.empty())
+      hs.add("Content-Encoding", coding);
+    return hs;
+  }
+};
+
+struct static_files::cache
+{
+  using lru_t = std::list<std::string>;
+
+  struct entry
+  {
+    std::shared_ptr<file const> f;
+    lru_t::iterator             position;
+  };
+
+  std::mutex                             mutex;
+  size_t                                 capacity;
+  lru_t                                  lru;
+  std::unordered_map<std::string, entry> entries;
+
+  explicit cache(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+  std::shared_ptr<file const>
+  find(std::string const& path)
+  {
+    std::lock_guard lock(mutex);
+    auto            it = entries.find(path);
+    if (it == entries.end())
+      return nullptr;
+
+    lru.splice(lru.begin(), lru, it->second.position);
+    return it->second.f;
+  }
+
+  void
+  insert(std::string const& path, std::shared_ptr<file const> f)
+  {
+    std::lock_guard lock(mutex);
+    if (auto it = entries.find(path); it != entries.end())
+    {
+      it->second.f = std::move(f);
+      lru.splice(lru.begin(), lru, it->second.position);
+      return;
+    }
+
+    lru.push_front(path);
+    entries.emplace(path, entry{ std::move(f), lru.begin() });
+    if (entries.size() > capacity)
+    {
+      entries.erase(lru.back());
+      lru.pop_back();
+    }
+  }
+
+  void
+  erase(std::string const& path)
+  {
+    std::lock_guard lock(mutex);
+    if (auto it = entries.find(path); it != entries.end())
+    {
+      lru.erase(it->second.position);
+      entries.erase(it);
+    }
+  }
+};
+
+static_files::static_files(alt_handler*                    next,
+                           std::string                     root,
+                           std::string                     prefix,
+                           std::optional<compress_options> compress,
+                           size_t                          cache_size)
+    : next_(next)
+    , root_(std::move(root))
+    , prefix_(std::move(prefix))
+    , compress_(std::move(compress))
+    , cache_(std::make_unique<cache>(cache_size))
+{
+  while (! root_.empty() && root_.back() == '/')
+    root_.pop_back();
+  if (prefix_.empty() || prefix_.back() != '/')
+    prefix_.push_back('/');
+}
+
+static_files::~static_files() = default;
+
+bool
+static_files::serves(std::string_view target) const
+{
+  // the prefix without its trailing slash names the index
+  return target.substr(0, prefix_.size()) == prefix_
+         || target == std::string_view{ prefix_ }.substr(0, prefix_.size() - 1);
+}
+
+std::shared_ptr<static_files::file const>
+static_files::lookup(std::string_view target)
+{
+  auto const rel = relative_path(
+    target.size() < prefix_.size() ? "" : target.substr(prefix_.size()));
+  if (! rel)
+    return nullptr;
+
+  auto const path = root_ + '/' + *rel;
+  auto const now  = std::chrono::steady_clock::now();
+
+  auto cached = cache_->find(path);
+  if (cached && now - cached->checked < revalidate_after)
+    return cached;
+
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+  {
+    cache_->erase(path);
+    return nullptr;
+  }
+
+  // unchanged: trust it for another interval
+  if (cached && cached->mtime == st.st_mtime
+      && cached->size == static_cast<std::uint64_t>(st.st_size))
+  {
+    auto renewed     = std::make_shared<file>(*cached);
+    renewed->checked = now;
+    cache_->insert(path, renewed);
+    return renewed;
+  }
+
+  auto opened = file::open(path, compress_);
+  if (opened)
+    cache_->insert(path, opened);
+  else
+    cache_->erase(path);
+  return opened;
+}
+
+alt_handler::head_r
+static_files::head(std::string_view target, headers_access&& get_headers)
+{
+  if (! serves(target))
+    return next_->head(target, std::move(get_headers));
+
+  auto f = lookup(target);
+  if (! f)
+    return { 404, std::nullopt, 0, "text/plain" };
+
+  auto [body, coding] = f->choose(get_headers);
+  return { 200, f->response_headers(coding), body->size, f->content_type };
+}
+
+alt_handler::get_r
+static_files::get(std::string_view target, headers_access&& get_headers)
+{
+  if (! serves(target))
+    return next_->get(target, std::move(get_headers));
+
+  auto f = lookup(target);
+  if (! f)
+    return { 404, std::nullopt, "Not found", "text/plain" };
+
+  // the response keeps the file open until it has been written
+  auto [body, coding] = f->choose(get_headers);
+  return { 200, f->response_headers(coding), body->body(), f->content_type };
+}
+
+alt_handler::options_r
+static_files::options(std::string_view target,
+                      std::string_view body,
+                      headers_access&& get_headers)
+{
+  return next_->options(target, body, std::move(get_headers));
+}
+
+alt_handler::post_r
+static_files::post(std::string_view target,
+                   std::string_view body,
+                   headers_access&& get_headers)
+{
+  return next_->post(target, body, std::move(get_headers));
+}
+
+alt_handler::put_r
+static_files::put(std::string_view target,
+                  std::string_view body,
+                  headers_access&& get_headers)
+{
+  return next_->put(target, body, std::move(get_headers));
+}
+
+alt_handler::delete_r
+static_files::delete_(std::string_view target,
+                      std::string_view body,
+                      headers_access&& get_headers)
+{
+  return next_->delete_(target, body, std::move(get_headers));
+}
+
+} // namespace http_tcl
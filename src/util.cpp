@@ -1,9 +1,15 @@
 #include "util.h"
 
 #include <algorithm>
-#include <sstream>
+#include <array>
+#include <cstring>
 #include <unordered_map>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HTTP_TCL_SSE2 1
+#endif
+
 TclObj::TclObj(Tcl_Obj* p) noexcept : ptr_{ p }
 {
   if (ptr_)
@@ -85,41 +91,64 @@ get_string(Tcl_Obj* obj)
   auto cs = Tcl_GetStringFromObj(obj, &length);
   return { cs, static_cast<size_t>(length) };
 }
-std::optional<http_tcl::headers>
-get_dict(Tcl_Interp* interp, Tcl_Obj* dict)
+
+std::string_view
+get_bytes(Tcl_Obj* obj)
 {
-  Tcl_DictSearch search;
-  Tcl_Obj*       key;
-  Tcl_Obj*       value;
-  int            done{ 0 };
+  static auto const byte_array_type = Tcl_GetObjType("bytearray");
 
-  http_tcl::headers headers;
+  if (obj->typePtr != byte_array_type)
+    return get_string(obj);
 
-  if (Tcl_DictObjFirst(interp, dict, &search, &key, &value, &done) != TCL_OK)
-    return std::nullopt;
+  int  length{ 0 };
+  auto data = Tcl_GetByteArrayFromObj(obj, &length);
+  return { reinterpret_cast<char const*>(data), static_cast<size_t>(length) };
+}
 
-  // cleanup when leaving function
-  auto _ = finally([&search] { Tcl_DictObjDone(&search); });
+// Reads a dictionary, or any list of names and values, in order; unlike a
+// dictionary, the list may repeat a name.
+std::optional<http_tcl::headers>
+get_dict(Tcl_Interp* interp, Tcl_Obj* dict)
+{
+  int       objc{ 0 };
+  Tcl_Obj** objv;
+  if (Tcl_ListObjGetElements(interp, dict, &objc, &objv) != TCL_OK
+      || objc % 2 != 0)
+    return std::nullopt;
 
-  while (done == 0)
-  {
-    headers.emplace(get_string(key), get_string(value));
-    Tcl_DictObjNext(&search, &key, &value, &done);
-  }
+  http_tcl::headers headers;
+  headers.reserve(objc / 2);
+  for (auto idx = 0; idx < objc; idx += 2)
+    headers.add(get_string(objv[idx]), get_string(objv[idx + 1]));
   return headers;
 }
 
+// Returns the fields as a list of names and values, which can be read as a
+// dictionary; a repeated name appears once for each of its fields.
 Tcl_Obj*
-to_dict(Tcl_Interp* i, http_tcl::headers heads)
+to_dict(Tcl_Interp*, http_tcl::headers const& heads)
 {
-  auto dict = Tcl_NewDictObj();
+  std::vector<Tcl_Obj*> objv;
+  objv.reserve(heads.size() * 2);
   for (auto const& kv: heads)
   {
-    auto k = Tcl_NewStringObj(kv.first.c_str(), -1);
-    auto v = Tcl_NewStringObj(kv.second.c_str(), -1);
-    Tcl_DictObjPut(i, dict, k, v);
+    objv.push_back(Tcl_NewStringObj(kv.first.data(), kv.first.size()));
+    objv.push_back(Tcl_NewStringObj(kv.second.data(), kv.second.size()));
   }
-  return dict;
+  return Tcl_NewListObj(objv.size(), objv.data());
+}
+
+Tcl_Obj*
+to_dict(Tcl_Interp*, http_tcl::headers_access const& heads)
+{
+  auto list = Tcl_NewListObj(0, nullptr);
+  heads.each([&](std::string_view name, std::string_view value) {
+    Tcl_ListObjAppendElement(
+        nullptr, list, Tcl_NewStringObj(name.data(), name.size()));
+    Tcl_ListObjAppendElement(
+        nullptr, list, Tcl_NewStringObj(value.data(), value.size()));
+  });
+  return list;
 }
 
 void
@@ -139,65 +168,225 @@ maybe_set_var(Tcl_Interp* i, Tcl_Obj* var_name, std::string_view val)
 
 namespace url
 {
-std::string
-percent_encode(std::string_view in)
+namespace
 {
-  // ascii table: https://tools.ietf.org/html/rfc20
-  // rfc3986: https://tools.ietf.org/html/rfc3986
-  // performs additional encoding of whitespace characters
+// ascii table: https://tools.ietf.org/html/rfc20
+// rfc3986: https://tools.ietf.org/html/rfc3986
+// the reserved characters, '%' and whitespace are escaped in any string;
+// other bytes, including those of non-ASCII characters, are copied
+constexpr auto escaped_in_text = [] {
+  std::array<bool, 256> table{};
+  std::string_view chars{ " \t\r\n\f\v!#$%&'()*+,/:;=?@[]" };
+  for (unsigned char c: chars)
+    table[c] = true;
+  return table;
+}();
 
-  static std::unordered_map<char, char const*> map{
-    { ' ', "%20" },  { '\t', "%09" }, { '\r', "%0D" }, { '\n', "%0A" },
-    { '\f', "%0C" }, { '\v', "%0B" }, { '!', "%21" },  { '#', "%23" },
-    { '$', "%24" },  { '%', "%25" },  { '&', "%26" },  { '\'', "%27" },
-    { '(', "%28" },  { ')', "%29" },  { '*', "%2A" },  { '+', "%2B" },
-    { ',', "%2C" },  { '/', "%2F" },  { ':', "%3A" },  { ';', "%3B" },
-    { '=', "%3D" },  { '?', "%3F" },  { '@', "%40" },  { '[', "%5B" },
-    { ']', "%5D" },
-  };
+// in binary data, control characters and non-ASCII bytes are escaped too,
+// so that the result is always ASCII text
+constexpr auto escaped_in_binary = [] {
+  auto table = escaped_in_text;
+  for (size_t c = 0; c < table.size(); ++c)
+    if (c < 0x20 || c >= 0x7f)
+      table[c] = true;
+  return table;
+}();
 
-  std::ostringstream os;
+constexpr char hex_digits[] = "0123456789ABCDEF";
 
-  for (auto const& c: in)
+// the value of each hex digit, or -1
+constexpr auto hex_values = [] {
+  std::array<signed char, 256> table{};
+  for (auto& v: table)
+    v = -1;
+  for (int c = 0; c < 10; ++c)
+    table['0' + c] = c;
+  for (int c = 0; c < 6; ++c)
+    table['a' + c] = table['A' + c] = 10 + c;
+  return table;
+}();
+
+#ifdef HTTP_TCL_SSE2
+// Whether all 16 bytes at p are ASCII letters or digits, which are never
+// escaped.
+bool
+all_alnum(char const* p)
+{
+  auto block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+  auto lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+  auto digit = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('0' - 1)),
+                             _mm_cmplt_epi8(block, _mm_set1_epi8('9' + 1)));
+  auto alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                             _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+  return _mm_movemask_epi8(_mm_or_si128(digit, alpha)) == 0xffff;
+}
+
+// Whether none of the 16 bytes at p is '%' or '+'.
+bool
+no_escapes(char const* p)
+{
+  auto block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+  auto found = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('%')),
+                            _mm_cmpeq_epi8(block, _mm_set1_epi8('+')));
+  return _mm_movemask_epi8(found) == 0;
+}
+#endif
+
+} // namespace
+
+std::string
+percent_encode(std::string_view in, bool binary)
+{
+  auto const& escaped = binary ? escaped_in_binary : escaped_in_text;
+
+  // every byte takes at most three, so the output is written in place
+  // and trimmed at the end
+  std::string out(in.size() * 3, '\0');
+  auto        dst = out.data();
+  size_t      i{ 0 };
+
+  while (i < in.size())
   {
-    if (auto p = map.find(c); p != map.end())
-      os << p->second;
-    else
-      os << c;
+    auto end = std::min(in.size(), i + 16);
+#ifdef HTTP_TCL_SSE2
+    // runs of letters and digits are copied 16 bytes at a time
+    if (end - i == 16 && all_alnum(in.data() + i))
+    {
+      std::memcpy(dst, in.data() + i, 16);
+      dst += 16;
+      i = end;
+      continue;
+    }
+#endif
+    for (; i < end; ++i)
+    {
+      auto c = static_cast<unsigned char>(in[i]);
+      if (escaped[c])
+      {
+        *dst++ = '%';
+        *dst++ = hex_digits[c >> 4];
+        *dst++ = hex_digits[c & 0xf];
+      }
+      else
+        *dst++ = static_cast<char>(c);
+    }
   }
-  return os.str();
+
+  out.resize(dst - out.data());
+  return out;
 }
 
 std::optional<std::string>
-percent_decode(std::string_view in)
+percent_decode(std::string_view in, bool plus_is_space)
 {
-  std::ostringstream os;
-  std::string        temp_s{ "XX" };
+  // the output is never longer than the input
+  std::string out(in.size(), '\0');
+  auto        dst = out.data();
+  size_t      i{ 0 };
 
-  for (size_t i = 0; i < in.size(); ++i)
+  while (i < in.size())
   {
-    if (in[i] == '%')
+    auto end = std::min(in.size(), i + 16);
+#ifdef HTTP_TCL_SSE2
+    // runs without escapes are copied 16 bytes at a time
+    if (end - i == 16 && no_escapes(in.data() + i))
+    {
+      std::memcpy(dst, in.data() + i, 16);
+      dst += 16;
+      i = end;
+      continue;
+    }
+#endif
+    // an escape may run past end, which only bounds the next block
+    while (i < end)
     {
-      if (i + 3 > in.size())
-        return std::nullopt;
-
-      int value{ 0 };
-      temp_s[0] = in[i + 1];
-      temp_s[1] = in[i + 2];
-      std::istringstream is{ temp_s };
-      if (is >> std::hex >> value)
+      if (in[i] == '%')
       {
-        os << static_cast<char>(value);
-        i += 2;
+        if (i + 3 > in.size())
+          return std::nullopt;
+
+        auto high = hex_values[static_cast<unsigned char>(in[i + 1])];
+        auto low  = hex_values[static_cast<unsigned char>(in[i + 2])];
+        if (high < 0 || low < 0)
+          return std::nullopt;
+
+        *dst++ = static_cast<char>(high << 4 | low);
+        i += 3;
+      }
+      else if (in[i] == '+' && plus_is_space)
+      {
+        *dst++ = ' ';
+        ++i;
       }
       else
-        return std::nullopt;
+        *dst++ = in[i++];
     }
-    else if (in[i] == '+')
-      os << ' ';
-    else
-      os << in[i];
   }
-  return os.str();
+
+  out.resize(dst - out.data());
+  return out;
+}
+
+bool
+parse_query(std::string_view in, query_fields& out, bool strict)
+{
+  if (! in.empty() && in.front() == '?')
+    in.remove_prefix(1);
+
+  bool ok{ true };
+  while (! in.empty())
+  {
+    auto field = in.substr(0, in.find('&'));
+    in.remove_prefix(std::min(in.size(), field.size() + 1));
+    if (field.empty())
+      continue;
+
+    auto eq    = field.find('=');
+    auto name  = field.substr(0, eq);
+    auto value = eq == std::string_view::npos ? std::string_view{}
+                                              : field.substr(eq + 1);
+
+    auto dname  = percent_decode(name);
+    auto dvalue = percent_decode(value);
+    if (! dname || ! dvalue)
+    {
+      ok = false;
+      if (strict)
+        return false;
+    }
+    out.emplace_back(dname ? std::move(*dname) : std::string{ name },
+                     dvalue ? std::move(*dvalue) : std::string{ value });
+  }
+  return ok;
+}
+
+Tcl_Obj*
+to_dict(query_fields const& fields)
+{
+  std::unordered_map<std::string_view, size_t> counts;
+  for (auto const& field: fields)
+    ++counts[field.first];
+
+  auto dict = Tcl_NewDictObj();
+  for (auto const& [name, value]: fields)
+  {
+    TclObj key   = Tcl_NewStringObj(name.data(), name.size());
+    auto   v_obj = Tcl_NewStringObj(value.data(), value.size());
+    if (counts[name] == 1)
+    {
+      Tcl_DictObjPut(nullptr, dict, key.value(), v_obj);
+      continue;
+    }
+
+    Tcl_Obj* list{ nullptr };
+    Tcl_DictObjGet(nullptr, dict, key.value(), &list);
+    if (! list)
+    {
+      list = Tcl_NewListObj(0, nullptr);
+      Tcl_DictObjPut(nullptr, dict, key.value(), list);
+    }
+    Tcl_ListObjAppendElement(nullptr, list, v_obj);
+  }
+  return dict;
 }
 } // namespace url
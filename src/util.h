@@ -4,6 +4,8 @@
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 #include <tcl.h>
 
 // A refcount managed wrapper arount Tcl_Obj*
@@ -72,20 +74,47 @@ tolower(std::string& out);
 std::string_view
 get_string(Tcl_Obj* obj);
 
+// the bytes of a byte array, or the UTF-8 string of any other value
+std::string_view
+get_bytes(Tcl_Obj* obj);
+
 std::optional<http_tcl::headers>
 get_dict(Tcl_Interp* interp, Tcl_Obj* dict);
 
 Tcl_Obj*
-to_dict(Tcl_Interp* i, http_tcl::headers heads);
+to_dict(Tcl_Interp* i, http_tcl::headers const& heads);
+
+// builds the list straight from the request, without an intermediate copy
+Tcl_Obj*
+to_dict(Tcl_Interp* i, http_tcl::headers_access const& heads);
 
 void
 maybe_set_var(Tcl_Interp* i, Tcl_Obj* var_name, std::string_view val);
 
 namespace url
 {
+// Escapes the characters reserved by RFC 3986, '%' and whitespace; with
+// binary, also control characters and non-ASCII bytes.
 std::string
-percent_encode(std::string_view in);
+percent_encode(std::string_view in, bool binary = false);
 
+// Undoes percent_encode, reading '+' as a space unless plus_is_space is
+// false, as in a path; nullopt if an escape is not '%' and two hex digits.
 std::optional<std::string>
-percent_decode(std::string_view in);
+percent_decode(std::string_view in, bool plus_is_space = true);
+
+// the names and values of a query string, in order
+using query_fields = std::vector<std::pair<std::string, std::string>>;
+
+// Splits an application/x-www-form-urlencoded string, such as a query
+// without its '?', into decoded names and values, appending them to out.
+// Returns false on a malformed escape; unless strict, the field is then
+// kept undecoded instead.
+bool
+parse_query(std::string_view in, query_fields& out, bool strict = true);
+
+// A dictionary of the fields; the values of a repeated name are collected
+// into a list.
+Tcl_Obj*
+to_dict(query_fields const& fields);
 } // namespace url
@@ -0,0 +1,271 @@
+#include "http_tcl/http_tcl.h"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+namespace http_tcl
+{
+// A request waiting for a worker. Jobs live on the stack of the thread which
+// dispatched them, which blocks until a worker marks the job done.
+struct worker_pool::job
+{
+  std::mutex              mutex;
+  std::condition_variable cv;
+  bool                    done{ false };
+  std::exception_ptr      error;
+
+  virtual ~job() = default;
+
+  virtual void
+  run(alt_handler& handler)
+    = 0;
+};
+
+template <typename R, typename F>
+struct worker_pool::typed_job final : worker_pool::job
+{
+  F                f;
+  std::optional<R> result;
+
+  explicit typed_job(F&& f) : f(std::move(f)) {}
+
+  void
+  run(alt_handler& handler) override
+  {
+    result.emplace(f(handler));
+  }
+};
+
+thread_local std::deque<worker_pool::job*>* worker_pool::own_jobs_{ nullptr };
+
+worker_pool::worker_pool(int workers, handler_factory make_handler)
+{
+  starting_ = std::max(1, workers);
+  threads_.reserve(starting_);
+  for (auto n = starting_; n > 0; --n)
+    threads_.emplace_back([this, make_handler] { work(make_handler); });
+
+  // wait until every worker has created its handler
+  std::unique_lock lock(mutex_);
+  cv_.wait(lock, [this] { return starting_ == 0; });
+  if (! start_error_.empty())
+  {
+    auto error = std::move(start_error_);
+    lock.unlock();
+    stop();
+    throw std::runtime_error(error);
+  }
+}
+
+worker_pool::~worker_pool() { stop(); }
+
+void
+worker_pool::stop()
+{
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto& t: threads_)
+    if (t.joinable())
+      t.join();
+  threads_.clear();
+}
+
+void
+worker_pool::work(handler_factory const& make_handler)
+{
+  std::shared_ptr<alt_handler> handler;
+  try
+  {
+    handler = make_handler();
+    if (! handler)
+      throw std::runtime_error("could not create worker handler");
+  }
+  catch (std::exception const& e)
+  {
+    std::lock_guard lock(mutex_);
+    if (start_error_.empty())
+      start_error_ = e.what();
+    --starting_;
+    cv_.notify_all();
+    return;
+  }
+
+  {
+    std::lock_guard lock(mutex_);
+    --starting_;
+  }
+  cv_.notify_all();
+
+  // jobs for this worker alone come first, so a streamed body is not held
+  // up behind new requests
+  std::deque<job*> own;
+  own_jobs_ = &own;
+
+  for (;;)
+  {
+    job* j{ nullptr };
+    {
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock, [&] {
+        return stopping_ || ! jobs_.empty() || ! own.empty();
+      });
+      auto& queue = own.empty() ? jobs_ : own;
+      if (queue.empty())
+        break;
+      j = queue.front();
+      queue.pop_front();
+    }
+
+    try
+    {
+      j->run(*handler);
+    }
+    catch (...)
+    {
+      j->error = std::current_exception();
+    }
+
+    {
+      std::lock_guard lock(j->mutex);
+      j->done = true;
+    }
+    j->cv.notify_one();
+  }
+
+  // release the handler on the thread that created it
+  handler.reset();
+}
+
+template <typename F>
+auto
+worker_pool::dispatch(F&& f)
+{
+  return dispatch_to(jobs_, std::forward<F>(f));
+}
+
+template <typename F>
+auto
+worker_pool::dispatch_to(std::deque<job*>& queue, F&& f)
+{
+  using result_t = decltype(f(std::declval<alt_handler&>()));
+  typed_job<result_t, std::decay_t<F>> j{ std::forward<F>(f) };
+
+  {
+    std::lock_guard lock(mutex_);
+    if (stopping_)
+      throw std::runtime_error("the worker pool is stopping");
+    queue.push_back(&j);
+  }
+
+  // a job for one worker must wake that worker
+  if (&queue == &jobs_)
+    cv_.notify_one();
+  else
+    cv_.notify_all();
+
+  std::unique_lock lock(j.mutex);
+  j.cv.wait(lock, [&j] { return j.done; });
+  if (j.error)
+    std::rethrow_exception(j.error);
+  return std::move(*j.result);
+}
+
+// Produces the chunks of a streamed body on the worker which handled the
+// request, since only its handler knows how.
+class worker_pool::pinned_source final : public chunk_source
+{
+  worker_pool&                  pool_;
+  std::deque<job*>&             queue_;
+  std::shared_ptr<chunk_source> source_;
+
+public:
+  pinned_source(worker_pool&                  pool,
+                std::deque<job*>&             queue,
+                std::shared_ptr<chunk_source> source)
+      : pool_(pool)
+      , queue_(queue)
+      , source_(std::move(source))
+  {
+  }
+
+  std::optional<std::string>
+  next() override
+  {
+    return pool_.dispatch_to(queue_,
+                             [this](alt_handler&) { return source_->next(); });
+  }
+};
+
+// Makes the chunks of a streamed body come from the calling worker.
+template <typename R>
+R
+worker_pool::pin(R&& result)
+{
+  auto& body = std::get<2>(result);
+  if (body.chunks())
+    body = response_body{
+      std::make_shared<pinned_source>(*this, *own_jobs_, body.chunks())
+    };
+  return std::move(result);
+}
+
+alt_handler::options_r
+worker_pool::options(std::string_view target,
+                     std::string_view body,
+                     headers_access&& get_headers)
+{
+  return dispatch([&](alt_handler& h) {
+    return pin(h.options(target, body, std::move(get_headers)));
+  });
+}
+
+alt_handler::head_r
+worker_pool::head(std::string_view target, headers_access&& get_headers)
+{
+  return dispatch(
+    [&](alt_handler& h) { return h.head(target, std::move(get_headers)); });
+}
+
+alt_handler::get_r
+worker_pool::get(std::string_view target, headers_access&& get_headers)
+{
+  return dispatch([&](alt_handler& h) {
+    return pin(h.get(target, std::move(get_headers)));
+  });
+}
+
+alt_handler::post_r
+worker_pool::post(std::string_view target,
+                  std::string_view body,
+                  headers_access&& get_headers)
+{
+  return dispatch([&](alt_handler& h) {
+    return pin(h.post(target, body, std::move(get_headers)));
+  });
+}
+
+alt_handler::put_r
+worker_pool::put(std::string_view target,
+                 std::string_view body,
+                 headers_access&& get_headers)
+{
+  return dispatch([&](alt_handler& h) {
+    return h.put(target, body, std::move(get_headers));
+  });
+}
+
+alt_handler::delete_r
+worker_pool::delete_(std::string_view target,
+                     std::string_view body,
+                     headers_access&& get_headers)
+{
+  return dispatch([&](alt_handler& h) {
+    return pin(h.delete_(target, body, std::move(get_headers)));
+  });
+}
+
+} // namespace http_tcl
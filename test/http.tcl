@@ -42,6 +42,809 @@ test get_hello {Sanity check: hello world} -body {
     without_headers $res
 } -result {200 {hello, world}}
 
+test get_hello_async {Sanity check: hello world, asynchronous server} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure -get {list 200 "hello, world" "text/plain"} \
+            {*}$test_server -port $port -iothreads 2
+        act::http run
+        }
+    set res [act::http client {*}$test_addr -port $port -method get -target /]
+    kill $port
+    without_headers $res
+} -result {200 {hello, world}}
+
+test get_workers {GET: handled by worker interpreters} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        set init {
+            package require act::http
+            proc handle {} {list 200 [act::url encode "in worker"] "text/plain"}
+        }
+        act::http configure -get handle -workers 2 -workerinit \$init \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set res [act::http client {*}$test_addr -port $port -method get -target /]
+    kill $port
+    without_headers $res
+} -result {200 in%20worker}
+
+test overflow_reject {Connections beyond -maxconnections get 503} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure -get {list 200 "hello, world" "text/plain"} \
+            {*}$test_server -port $port -maxconnections 1 -overflow reject
+        act::http run
+        }
+    # hold the only slot open
+    set chan [socket 127.0.0.1 $port]
+    after 50
+    set res [act::http client {*}$test_addr -port $port -method get -target /]
+    close $chan
+    after 50
+    kill $port
+    list [lindex $res 0] [dict get [lindex $res 1] Retry-After]
+} -result {503 1}
+
+test start_event_loop {Background server shares the event loop} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        set ::ticks 0
+        proc tick {} {incr ::ticks; after 10 tick}
+        act::http configure -get {list 200 [expr {\$::ticks > 0}] "text/plain"} \
+            {*}$test_server -port $port
+        act::http start
+        tick
+        vwait forever
+        }
+    after 100
+    set res [act::http client {*}$test_addr -port $port -method get -target /]
+    kill $port
+    without_headers $res
+} -result {200 1}
+
+test stop_start {Background server can be stopped and started again} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc restart {} {
+            set ::active [dict get [act::http stats] active]
+            act::http start
+        }
+        proc handle {} {
+            if {\$::target eq "/stop"} {
+                act::http stop
+                after 100 restart
+            }
+            list 200 "restarted \$::active" "text/plain"
+        }
+        set ::active {}
+        act::http configure -get handle -reqtargetvariable ::target \
+            {*}$test_server -port $port
+        act::http start
+        act::http stop
+        act::http start
+        vwait forever
+        }
+    # a keep-alive connection still open when the server stops
+    set chan [socket 127.0.0.1 $port]
+    fconfigure $chan -translation binary
+    puts -nonewline $chan "GET /stop HTTP/1.1\r\nHost: localhost\r\n\r\n"
+    flush $chan
+    after 300
+    set res [act::http client {*}$test_addr -port $port -method get -target /]
+    close $chan
+    kill $port
+    without_headers $res
+} -result {200 {restarted 0}}
+
+test stop_from_handler {Handler can stop the background server} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc restart {} {
+            act::http configure -get {list 200 "restarted" "text/plain"}
+            act::http start
+        }
+        proc handle {} {
+            act::http stop
+            after 100 restart
+            list 200 "stopping" "text/plain"
+        }
+        act::http configure -get handle {*}$test_server -port $port
+        act::http start
+        vwait forever
+        }
+    set res [list [without_headers \
+        [act::http client {*}$test_addr -port $port -method get -target /]]]
+    after 200
+    lappend res [without_headers \
+        [act::http client {*}$test_addr -port $port -method get -target /]]
+    kill $port
+    set res
+} -result {{200 stopping} {200 restarted}}
+
+test start_nested_update {Handler entering the event loop defers other requests} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc handle {} {
+            if {\$::target eq "/slow"} {
+                after 200 {set ::waited 1}
+                vwait ::waited
+            }
+            list 200 \$::target "text/plain"
+        }
+        act::http configure -get handle -reqtargetvariable ::target \
+            {*}$test_server -port $port -iothreads 2
+        act::http start
+        vwait forever
+        }
+    proc collect {args} {lappend ::nested_res $args}
+    set ::nested_res {}
+    act::http client {*}$test_addr -port $port -target /slow -timeout 2000 \
+        -async collect
+    after 50
+    act::http client {*}$test_addr -port $port -target /fast -timeout 2000 \
+        -async collect
+    vwait ::nested_res
+    set res [list [without_headers [lindex $::nested_res 0]]]
+    vwait ::nested_res
+    lappend res [without_headers [lindex $::nested_res 1]]
+    kill $port
+    lsort $res
+} -result {{200 /fast} {200 /slow}}
+
+test callstyle_args {Handlers called with arguments} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc handle {prefix target body headers} {
+            list 200 "\$prefix \$target \$body [dict get \$headers X-Test]" \
+                "text/plain"
+        }
+        act::http configure -callstyle args -post {handle p} \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set res [act::http client {*}$test_addr -port $port -method post \
+                 -target /t -body b -headers {X-Test h}]
+    kill $port
+    without_headers $res
+} -result {200 {p /t b h}}
+
+test header_lookup {Read single request headers from a handler} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure \
+            -get {list 200 [list [http header x-test] [http header none dflt]] "text/plain"} \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set res [act::http client {*}$test_addr -port $port -method get \
+                 -target / -headers {X-Test h}]
+    kill $port
+    list [without_headers $res] [catch {http header x-test}]
+} -result {{200 {h dflt}} 1}
+
+test header_repeats {Headers may repeat a name} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc handle {} {
+            set n 0
+            foreach {k v} \$::headers {
+                if {[string equal -nocase \$k x-tag]} {incr n}
+            }
+            list 200 \$n "text/plain" {Set-Cookie a=1 Set-Cookie b=2}
+        }
+        act::http configure -get handle -reqheadersvariable ::headers \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set res [act::http client {*}$test_addr -port $port -method get \
+                 -target / -headers {X-Tag 1 X-Tag 2}]
+    kill $port
+    set cookies {}
+    foreach {k v} [lindex $res 1] {
+        if {[string equal -nocase $k set-cookie]} {lappend cookies $v}
+    }
+    list [without_headers $res] $cookies
+} -result {{200 2} {a=1 b=2}}
+
+test query_variable {Query and form fields are parsed into a dictionary} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure -get {list 200 \$::query "text/plain"} \
+            -post {list 200 \$::query "text/plain"} \
+            -reqqueryvariable ::query {*}$test_server -port $port
+        act::http run
+        }
+    set get [act::http client {*}$test_addr -port $port -method get \
+                 -target "/form?tag=a&tag=b&q=x%20y"]
+    set post [act::http client {*}$test_addr -port $port -method post \
+                  -target "/form?id=7" -body "name=J+Doe&bad=%zz" \
+                  -headers {Content-Type application/x-www-form-urlencoded}]
+    kill $port
+    list [lindex $get 2] [lindex $post 2]
+} -result {{tag {a b} q {x y}} {id 7 name {J Doe} bad %zz}}
+
+test get_binary {Byte array bodies are sent as raw bytes} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure \
+            -get {list 200 [binary format c* {0 -1 -128 10}] "application/octet-stream"} \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set chan [socket 127.0.0.1 $port]
+    fconfigure $chan -translation binary
+    puts -nonewline $chan "GET / HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n"
+    flush $chan
+    set res [read $chan]
+    close $chan
+    kill $port
+    set body [string range $res [expr {[string first "\r\n\r\n" $res] + 4}] end]
+    binary scan $body cu* bytes
+    set bytes
+} -result {0 255 128 10}
+
+test static_files {Files under -staticprefix are served from -staticroot} -setup {
+    # relative, so the background server finds it too
+    set dir static_test
+    file mkdir $dir
+    set f [open [file join $dir site.css] w]
+    puts -nonewline $f "body {}"
+    close $f
+} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure -get {list 200 "dynamic" "text/plain"} \
+            -staticroot static_test -staticprefix /assets \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set css [act::http client {*}$test_addr -port $port -method get \
+                 -target /assets/site.css]
+    set missing [act::http client {*}$test_addr -port $port -method get \
+                     -target /assets/none.css]
+    set other [act::http client {*}$test_addr -port $port -method get \
+                   -target /other]
+    kill $port
+    list [without_headers $css] [dict get [lindex $css 1] Content-Type] \
+        [dict exists [lindex $css 1] Last-Modified] \
+        [lindex $missing 0] [without_headers $other]
+} -cleanup {
+    file delete -force $dir
+} -result {{200 {body {}}} text/css 1 404 {200 dynamic}}
+
+test static_rewrite {Static files rewritten in place are served whole} -setup {
+    set dir static_rewrite
+    file mkdir $dir
+    proc write {name data} {
+        set f [open [file join static_rewrite $name] wb]
+        puts -nonewline $f $data
+        close $f
+    }
+    write small.txt [string repeat a 100]
+    write large.bin [string repeat b 400000]
+} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure -get {list 200 "dynamic" "text/plain"} \
+            -staticroot static_rewrite -staticprefix /assets \
+            {*}$test_server -port $port
+        act::http run
+        }
+    proc fetch {target} {
+        global test_addr port
+        set res [act::http client {*}$test_addr -port $port -target $target]
+        list [lindex $res 0] [string length [lindex $res 2]] \
+            [string index [lindex $res 2] end]
+    }
+    set res [list [fetch /assets/small.txt] [fetch /assets/large.bin]]
+
+    # within the second the cached entries are trusted, the small file is
+    # still served from memory, and the large one is not sent short
+    write small.txt bb
+    write large.bin c
+    lappend res [fetch /assets/small.txt]
+    catch {fetch /assets/large.bin}
+    after 1100
+    lappend res [fetch /assets/small.txt] [fetch /assets/large.bin]
+    kill $port
+    set res
+} -cleanup {
+    file delete -force $dir
+} -result {{200 100 a} {200 400000 b} {200 100 a} {200 2 b} {200 1 c}}
+
+test compress {Responses are compressed for clients which accept it} -setup {
+    set dir compress_test
+    file mkdir $dir
+    set f [open [file join $dir site.css] w]
+    puts -nonewline $f [string repeat "body {margin: 0}\n" 100]
+    close $f
+    set f [open [file join $dir site.css.gz] wb]
+    puts -nonewline $f [zlib gzip "precompressed"]
+    close $f
+    set f [open [file join $dir large.css] w]
+    puts -nonewline $f [string repeat "p {margin: 0}\n" 20000]
+    close $f
+} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc handle {} {
+            list 200 [string repeat {{"n": 1}, } 300] "application/json" \
+                {Cache-Control max-age=60}
+        }
+        act::http configure -get handle -cachesize 100000 \
+            -head {list 200 3000 "application/json"} \
+            -compress {minsize 100 level 9} \
+            -staticroot compress_test -staticprefix /assets \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set path [file join [pwd] compress.bin]
+    proc fetch {target args} {
+        global test_addr port path
+        set res [act::http client {*}$test_addr -port $port -target $target \
+            -outfile $path {*}$args]
+        set f [open $path rb]
+        set data [read $f]
+        close $f
+        set headers [lindex $res 1]
+        if {[dict exists $headers Content-Encoding]} {
+            set data [zlib gunzip $data]
+        }
+        list [dict exists $headers Content-Encoding] \
+            [dict exists $headers Vary] [string length $data]
+    }
+    proc head {args} {
+        global test_addr port
+        set headers [lindex [act::http client {*}$test_addr -port $port \
+            -method head -target / {*}$args] 1]
+        set size {}
+        if {[dict exists $headers Content-Length]} {
+            set size [dict get $headers Content-Length]
+        }
+        list [dict exists $headers Content-Encoding] \
+            [dict exists $headers Vary] $size
+    }
+    set gzip {-headers {Accept-Encoding "deflate;q=0.5, gzip"}}
+    set heads [list [head {*}$gzip] [head]]
+    set res [list [fetch / {*}$gzip] [fetch / {*}$gzip] [fetch /] \
+        [fetch /assets/site.css {*}$gzip] [fetch /assets/site.css] \
+        [fetch /assets/large.css {*}$gzip]]
+    lappend res {*}$heads
+    file delete $path
+    kill $port
+    set res
+} -cleanup {
+    file delete -force $dir
+} -result {{1 1 3000} {1 1 3000} {0 1 3000} {1 1 13} {0 1 1700} {0 0 280000} {0 1 {}} {0 1 3000}}
+
+test routes {Routes dispatch to commands with path parameters} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc posts {target body headers params} {
+            list 200 "posts [dict get \$params id]" "text/plain"
+        }
+        proc me {target body headers params} {
+            list 200 "me \$params" "text/plain"
+        }
+        proc post {which target body headers params} {
+            list 200 "\$which [dict get \$params id] \$body" "text/plain"
+        }
+        act::http route GET /users/{id}/posts posts
+        act::http route GET /users/me/posts me
+        act::http route post /users/{id} {post new}
+        act::http configure {*}$test_server -port $port
+        act::http run
+        }
+    set res {}
+    foreach {method target} {
+        get /users/42/posts get /users/me/posts post /users/7 get /nowhere
+        get /users/john%20doe/posts get /users/a+b/posts
+    } {
+        lappend res [without_headers [act::http client {*}$test_addr \
+            -port $port -method $method -target $target -body b]]
+    }
+    # HEAD is answered by the GET route
+    set head [act::http client {*}$test_addr -port $port -method head \
+        -target /users/42/posts]
+    lappend res [lindex $head 0] [dict get [lindex $head 1] Content-Length]
+    kill $port
+    set res
+} -result {{200 {posts 42}} {200 {me }} {200 {new 7 b}} {404 {Not found}} {200 {posts john doe}} {200 {posts a+b}} 200 8}
+
+test metrics {Server metrics in stats and in Prometheus format} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc user {target body headers params} {
+            list 200 "user" "text/plain"
+        }
+        proc handle {} {
+            set s [act::http stats]
+            set r [dict get \$s routes {GET /users/{id}}]
+            list 200 [list [dict get \$r requests] [dict get \$r 2xx] \
+                [dict get \$r latency count] \
+                [expr {[dict get \$s eval count] > 0}] \
+                [expr {[dict get \$s bytes_in] > 0}]] "text/plain"
+        }
+        act::http route GET /users/{id} user
+        act::http configure -get handle -metricstarget /metrics \
+            {*}$test_server -port $port
+        act::http run
+        }
+    foreach id {1 2 3} {
+        act::http client {*}$test_addr -port $port -target /users/$id
+    }
+    set stats [lindex [act::http client {*}$test_addr -port $port \
+                           -target /stats] 2]
+    set prom [lindex [act::http client {*}$test_addr -port $port \
+                          -target /metrics?x] 2]
+    kill $port
+    list $stats \
+        [regexp -line {^act_http_route_requests_total\{method="GET",route="/users/\{id\}",status="2xx"\} 3$} $prom] \
+        [regexp -line {^act_http_requests_total\{method="GET",status="2xx"\} [0-9]+$} $prom] \
+        [regexp -line {^act_http_write_seconds_count [0-9]+$} $prom]
+} -result {{3 3 3 1 1} 1 1 1}
+
+test response_cache {Responses opting in are served from the cache} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        set ::calls 0
+        act::http configure \
+            -get {list 200 [incr ::calls] "text/plain" {Cache-Control max-age=60}} \
+            -post {list 200 [http purge /cached] "text/plain"} \
+            -cachesize 100000 {*}$test_server -port $port
+        act::http run
+        }
+    set get [list act::http client {*}$test_addr -port $port -method get]
+    set first [{*}$get -target /cached]
+    set second [{*}$get -target /cached]
+    set other [{*}$get -target /other]
+    set purged [act::http client {*}$test_addr -port $port -method post \
+                    -target /]
+    set third [{*}$get -target /cached]
+    kill $port
+    list [lindex $first 2] [lindex $second 2] \
+        [dict exists [lindex $second 1] Age] [lindex $other 2] \
+        [lindex $purged 2] [lindex $third 2]
+} -result {1 1 1 2 1 3}
+
+test client_pool {Client reuses keep-alive connections} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure -get {list 200 "pooled" "text/plain"} \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set before [act::http clientstats]
+    set res {}
+    for {set n 0} {$n < 3} {incr n} {
+        lappend res [without_headers [act::http client {*}$test_addr \
+            -port $port -method get -target /]]
+    }
+    set after [act::http clientstats]
+    kill $port
+    list $res [expr {[dict get $after misses] - [dict get $before misses]}] \
+        [expr {[dict get $after hits] - [dict get $before hits]}]
+} -result {{{200 pooled} {200 pooled} {200 pooled}} 1 2}
+
+test stream_chunks {GET: handler streams its body in chunks} -body {
+    set res {}
+    foreach workers {0 2} {
+        set port [rand_port]
+
+        background $port [string map [list %workers% $workers] {
+            $load_http
+            namespace import ::act::*
+            set init {
+                package require act::http
+                proc handle {} {
+                    coroutine rows apply {{} {
+                        yield
+                        for {set n 1} {\$n <= 3} {incr n} {yield "row \$n\n"}
+                        return ""
+                    }}
+                    act::http stream rows
+                    list 200 "" "text/csv"
+                }
+            }
+            eval \$init
+            if {%workers%} {
+                act::http configure -workers %workers% -workerinit \$init
+            }
+            act::http configure -get handle {*}$test_server -port $port
+            act::http run
+            }]
+        lassign [act::http client {*}$test_addr -port $port -target /] \
+            status headers body
+        kill $port
+        lappend res $status [dict get $headers Transfer-Encoding] $body
+    }
+    set res
+} -result {200 chunked {row 1
+row 2
+row 3
+} 200 chunked {row 1
+row 2
+row 3
+}}
+
+test client_outfile {Client streams binary bodies to a file} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc handle {} {
+            set bytes [concat {*}[lrepeat 20000 {0 1 2 255 0 10 13}]]
+            list 200 [binary format c* \$bytes] "application/octet-stream"
+        }
+        act::http configure -get handle {*}$test_server -port $port
+        act::http run
+        }
+    set path [file join [pwd] client_outfile.bin]
+    set res [lindex [act::http client {*}$test_addr -port $port -target / \
+        -outfile $path] 0]
+    set f [open $path rb]
+    set data [read $f]
+    close $f
+    file delete $path
+    kill $port
+    list $res [string length $data] \
+        [string equal $data [string repeat [binary format c* {0 1 2 255 0 10 13}] 20000]]
+} -result {200 140000 1}
+
+test request_bodies {Large request bodies are spooled or refused} -body {
+    set res {}
+    foreach iothreads {0 2} {
+        set port [rand_port]
+
+        background $port [string map [list %iothreads% $iothreads] {
+            $load_http
+            namespace import ::act::*
+            proc handle {} {
+                set path [act::http bodyfile]
+                set size [expr {\$path eq "" ? "-" : [file size \$path]}]
+                list 200 "\$size [string length \$::body]" "text/plain"
+            }
+            if {%iothreads%} {
+                act::http configure -iothreads %iothreads%
+            }
+            act::http configure -post handle -reqbodyvariable ::body \
+                -spoolthreshold 100 -maxbodysize 5000 \
+                {*}$test_server -port $port
+            act::http run
+            }]
+        foreach size {10 1000 6000} {
+            set res [concat $res [without_headers [act::http client \
+                {*}$test_addr -port $port -method post -target / \
+                -body [string repeat x $size]]]]
+        }
+        kill $port
+    }
+    set res
+} -result {200 {- 10} 200 {1000 0} 413 {The request body is too large.} 200 {- 10} 200 {1000 0} 413 {The request body is too large.}}
+
+test spool_dir {Bodies which cannot be spooled get 500} -body {
+    set res [list [catch {act::http configure -spooldir /nonexistent/dir} msg] \
+                 $msg]
+    foreach iothreads {0 2} {
+        set port [rand_port]
+
+        background $port [string map [list %iothreads% $iothreads] {
+            $load_http
+            namespace import ::act::*
+            if {%iothreads%} {
+                act::http configure -iothreads %iothreads%
+            }
+            file mkdir spool_gone_$port
+            act::http configure -post {list 200 "stored" "text/plain"} \
+                -spoolthreshold 10 -spooldir spool_gone_$port \
+                {*}$test_server -port $port
+            file delete spool_gone_$port
+            act::http run
+            }]
+        lappend res {*}[without_headers [act::http client {*}$test_addr \
+            -port $port -method post -target / -body [string repeat x 100]]]
+        kill $port
+    }
+    set res
+} -result {1 {-spooldir is not a writable directory.} 500 {The request body could not be stored.} 500 {The request body could not be stored.}}
+
+test pipelining {Pipelined requests are answered in order} -body {
+    set res {}
+    foreach iothreads {0 2} {
+        set port [rand_port]
+
+        background $port [string map [list %iothreads% $iothreads] {
+            $load_http
+            namespace import ::act::*
+            if {%iothreads%} {
+                act::http configure -iothreads %iothreads%
+            }
+            act::http configure -get {list 200 \$::target "text/plain"} \
+                -reqtargetvariable ::target {*}$test_server -port $port
+            act::http run
+            }]
+        set sock [socket 127.0.0.1 $port]
+        fconfigure $sock -translation binary
+        set requests ""
+        foreach target {/a /b /c} {
+            append requests "GET $target HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        }
+        append requests "GET /d HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"
+        puts -nonewline $sock $requests
+        flush $sock
+        set data [read $sock]
+        close $sock
+        lappend res [regexp -all -inline {/[a-d]$|/[a-d](?=HTTP)} $data]
+
+        # requests read before one which cannot be parsed are still answered
+        foreach after {"xy\r\n\r\n" "GET /f HTTP/1.1\r\nbad\r\n\r\n"} {
+            set sock [socket 127.0.0.1 $port]
+            fconfigure $sock -translation binary
+            puts -nonewline $sock \
+                "GET /e HTTP/1.1\r\nHost: localhost\r\n\r\n$after"
+            flush $sock
+            lappend res [regexp -all -inline {/e$} [read $sock]]
+            close $sock
+        }
+        kill $port
+    }
+    set res
+} -result {{/a /b /c /d} /e /e {/a /b /c /d} /e /e}
+
+test client_dns {Client caches name lookups} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure -get {list 200 "resolved" "text/plain"} \
+            {*}$test_server -port $port
+        act::http run
+        }
+    # without pooled connections every request needs an address
+    act::http configure -clientmaxidle 0
+    act::http dnscache flush
+    set before [act::http clientstats]
+    set res {}
+    for {set n 0} {$n < 3} {incr n} {
+        lappend res [without_headers [act::http client -host localhost \
+            -port $port -target /]]
+    }
+    set after [act::http clientstats]
+    lappend res [expr {[dict get $after dns_misses] - [dict get $before dns_misses]}] \
+        [expr {[dict get $after dns_hits] - [dict get $before dns_hits]}] \
+        [dict exists [act::http dnscache] localhost:$port]
+    act::http dnscache flush
+    lappend res [dict size [act::http dnscache]]
+    act::http configure -clientmaxidle 4
+    kill $port
+    set res
+} -result {{200 resolved} {200 resolved} {200 resolved} 1 2 1 0}
+
+test client_async {Client runs requests in the background} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        proc handle {} {
+            if {\$::target eq "/slow"} {after 1000}
+            list 200 "async" "text/plain"
+        }
+        act::http configure -get handle -reqtargetvariable ::target \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set ::async_res {}
+    act::http client {*}$test_addr -port $port -target / \
+        -async {lappend ::async_res}
+    vwait ::async_res
+    set res [list [without_headers $::async_res]]
+
+    set ::async_res {}
+    act::http client {*}$test_addr -port $port -target /slow -timeout 200 \
+        -async {lappend ::async_res}
+    vwait ::async_res
+    lappend res [without_headers $::async_res]
+
+    set id [act::http client {*}$test_addr -port $port -target / \
+        -async {set ::async_res}]
+    lappend res [act::http cancel $id] [act::http cancel $id]
+    set ::async_res {}
+    after 200 {set ::async_done 1}
+    vwait ::async_done
+    lappend res $::async_res
+
+    lappend res [without_headers [act::http client {*}$test_addr \
+        -port $port -target /slow -timeout 200]]
+    after 1000
+    kill $port
+    set res
+} -result {{200 async} {500 {request timed out}} 1 0 {} {500 {request timed out}}}
+
+test client_multi {Client sends a batch of requests concurrently} -body {
+    set port [rand_port]
+
+    background $port {
+        $load_http
+        namespace import ::act::*
+        act::http configure -get {list 200 \$::target "text/plain"} \
+            -reqtargetvariable ::target \
+            {*}$test_server -port $port
+        act::http run
+        }
+    set specs {}
+    foreach target {/a /b /c /d /e} {
+        lappend specs [list {*}$test_addr -port $port -target $target]
+    }
+    set res {}
+    foreach result [act::http client_multi $specs -concurrency 2] {
+        lappend res [without_headers $result]
+    }
+    kill $port
+    set res
+} -result {{200 /a} {200 /b} {200 /c} {200 /d} {200 /e}}
+
 # prefix vars with \ to defer evaluation until inside the subshell
 proc check_target_body_headers {method} {
     # shell to check that post and put have access to target, body and headers
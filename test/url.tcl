@@ -18,4 +18,44 @@ test url_encode_whitespace {Whitespace encoding
     url encode " \t\r\n\f\v"
 } -result {%20%09%0D%0A%0C%0B}
 
+test url_encode_long {Long runs of letters and digits around escapes
+} -body {
+    set s "[string repeat abcdefghij0123456789 3]/[string repeat x 40]%2F"
+    list [url encode $s] [expr {[url decode [url encode $s]] eq $s}]
+} -result [list "[string repeat abcdefghij0123456789 3]%2F[string repeat x 40]%252F" 1]
+
+test url_decode_plus {Plus decodes to a space
+} -body {
+    url decode "a+b%20c+[string repeat d 20]+"
+} -result "a b c [string repeat d 20] "
+
+test url_decode_malformed {Malformed escapes are errors
+} -body {
+    list [catch {url decode "%2"}] [catch {url decode "%2G"}] \
+        [catch {url decode "[string repeat a 15]%zz"}]
+} -result {1 1 1}
+
+test url_binary {Byte arrays are encoded byte by byte
+} -body {
+    set bytes [binary format c* {0 1 -1 65 32 -61 -87}]
+    set encoded [url encode -binary $bytes]
+    list $encoded [string equal [url decode -binary $encoded] $bytes] \
+        [url decode [url encode -binary [encoding convertto utf-8 "caf\u00e9"]]] \
+        [string equal [url encode "a\x01b"] \
+             [url encode [binary format a* "a\x01b"]]] \
+        [url encode_list -binary [list $bytes]]
+} -result [list %00%01%FFA%20%C3%A9 1 "caf\u00e9" 1 %00%01%FFA%20%C3%A9]
+
+test url_lists {Encode and decode every element of a list
+} -body {
+    set encoded [url encode_list {{a b} c/d {}}]
+    list $encoded [url decode_list $encoded] [catch {url decode_list {ok %}}]
+} -result {{a%20b c%2Fd {}} {{a b} c/d {}} 1}
+
+test url_parse_query {Parse a query string into a dictionary
+} -body {
+    list [url parse_query "?a=1&b=x+y%21&a=2&&flag&c=%3D"] \
+        [url parse_query ""] [catch {url parse_query "a=%zz"}]
+} -result {{a {1 2} b {x y!} flag {} c =} {} 1}
+
 cleanupTests